@@ -0,0 +1,123 @@
+/*
+ * agenda-shm.h
+ *
+ * Copyright 2021 Alan Crispin <crispinalan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/**
+ *
+ * @title: Talk Calendar shared memory agenda
+ * @short_description: layout and reader for the published agenda
+ *
+ * The running calendar publishes the events of the next
+ * AGENDA_SHM_DAYS days in a read-only POSIX shared memory object named
+ * "/talkcalendar-agenda-<uid>". The region is rewritten after every
+ * change and at midnight.
+ *
+ * Writers make the sequence number odd, update the region and make it
+ * even again. Readers copy the region and retry if the sequence number
+ * was odd or changed during the copy (a seqlock), so polling costs a
+ * memcpy and no system calls after agenda_shm_open().
+ *
+ * Example:
+ *
+ *   const AgendaShm *shm = agenda_shm_open();
+ *   AgendaShm agenda;
+ *   if (shm && agenda_shm_read(shm, &agenda)) {
+ *     for (uint32_t i = 0; i < agenda.num_events; i++)
+ *       printf("%s\n", agenda.events[i].title);
+ *   }
+ *
+ * Link with -lrt on glibc older than 2.34.
+ *
+*/
+
+#ifndef AGENDA_SHM_H
+#define AGENDA_SHM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define AGENDA_SHM_MAGIC 0x47414354 //"TCAG"
+#define AGENDA_SHM_VERSION 1
+#define AGENDA_SHM_DAYS 7 //today and the following days
+#define AGENDA_SHM_MAX_EVENTS 256
+#define AGENDA_SHM_TITLE_LEN 64 //including the terminating zero
+#define AGENDA_SHM_LOCATION_LEN 48
+
+//event flags
+#define AGENDA_SHM_ALLDAY 1
+#define AGENDA_SHM_PRIORITY 2
+#define AGENDA_SHM_CONTINUED 4 //started on an earlier day
+
+typedef struct {
+	uint32_t julian_day; //GLib julian day (1 = 1 January year 1)
+	int32_t id; //event id, repeating events share the id of their series
+	uint16_t start_min; //minutes after midnight
+	uint16_t end_min;
+	uint32_t flags;
+	char title[AGENDA_SHM_TITLE_LEN];
+	char location[AGENDA_SHM_LOCATION_LEN];
+} AgendaShmEvent;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence; //odd while the writer is updating
+	uint32_t num_events; //sorted by day then start time
+	uint32_t first_day; //julian day of today
+	uint32_t num_days;
+	uint64_t generation; //incremented on every publish
+	AgendaShmEvent events[AGENDA_SHM_MAX_EVENTS];
+} AgendaShm;
+
+static inline void agenda_shm_name(char *name, size_t size)
+{
+	snprintf(name, size, "/talkcalendar-agenda-%u", (unsigned) getuid());
+}
+
+//map the published agenda read-only (NULL if the calendar is not running)
+static inline const AgendaShm* agenda_shm_open(void)
+{
+	char name[64];
+	agenda_shm_name(name, sizeof(name));
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+	void *shm = mmap(NULL, sizeof(AgendaShm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) return NULL;
+	return (const AgendaShm*) shm;
+}
+
+//consistent copy of the agenda, returns 0 if the writer kept it busy
+static inline int agenda_shm_read(const AgendaShm *shm, AgendaShm *copy)
+{
+	for (int tries = 0; tries < 1000; tries++) {
+		uint32_t before = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) continue;
+		memcpy(copy, shm, sizeof(AgendaShm));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint32_t after = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+		if (before == after) {
+			if (copy->magic != AGENDA_SHM_MAGIC || copy->version != AGENDA_SHM_VERSION) return 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#endif
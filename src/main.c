@@ -22,43 +22,212 @@
 
 #include <gtk/gtk.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <sys/file.h> //flock
+#include <malloc.h> //malloc_trim
 
 #include <math.h>  //compile with -lm
 #include <string.h>
 
+#include "agenda-shm.h"
+
 /**
  * 
  * @title: Talk Calendar
  * @short_description: Gtk 4 version of Talk Calendar
  * @author Alan crispin
  * Compile with:  
- * gcc $(pkg-config --cflags gtk4) -o talkcalendar main.c $(pkg-config --libs gtk4) -lm
+ * gcc $(pkg-config --cflags gtk4) -o talkcalendar main.c $(pkg-config --libs gtk4) -lm -lrt
  * 
 */
 
 #define CONFIG_DIRNAME "talkcal-gtk4-1"
 #define CONFIG_FILENAME "talkcal-gtk4-config-1"
 
+#define MAX_EXDATES 16 //exception dates per recurring series
+
+//recurrence frequencies (rrule style)
+enum {
+	RECUR_NONE=0,
+	RECUR_DAILY,
+	RECUR_WEEKLY,
+	RECUR_MONTHLY, //same day of month
+	RECUR_MONTHLY_WEEKDAY, //same weekday of month e.g. second Tuesday
+	RECUR_YEARLY
+};
+
+typedef struct {
+	int id;	
+	char title[101];
+	char location[101];
+	int year;
+	int month;
+	int day;
+	float start_time;
+	float end_time;	
+	int priority;
+	int is_yearly;
+	int is_allday;
+	guint32 end_date; //julian day a multi-day event ends (0 = same day)
+	//recurrence rule (one record per series)
+	int recur_freq;
+	int recur_interval; //every n days, weeks, months or years
+	int recur_weekdays; //weekly day mask bit 0=Monday (0 = start weekday)
+	int recur_count; //number of occurrences (0 = no limit)
+	guint32 recur_until; //julian day of last occurrence (0 = no limit)
+	int num_exdates;
+	guint32 exdates[MAX_EXDATES]; //julian days of deleted occurrences
+} Event;
+
+//an event instance returned by a query (recurring events expand to many)
+typedef struct {
+	int calendar;
+	int index; //event index in its calendar
+	guint32 jd; //julian day the occurrence starts
+	gint64 start; //minutes since julian day 0, queries return start order
+} Occurrence;
+
+typedef void (*OccurrenceFunc)(const Event *e, guint32 jd, gpointer user_data);
+
+//import file formats
+enum {
+	IMPORT_CSV=0, //events.csv records
+	IMPORT_ICS
+};
+
+//what an import does with an event already in the calendar (or earlier in the file)
+enum {
+	DUPLICATES_SKIP=0,
+	DUPLICATES_MERGE, //fill in what the existing event lacks
+	DUPLICATES_KEEP, //add it anyway, only counted
+	DUPLICATES_UNCHECKED //loading events.csv
+};
+
+typedef struct {
+	int imported;
+	int simplified; //repeat rule not supported, first occurrence only
+	int skipped; //no start date or cancelled
+	int duplicates; //same date, time, title and location as another event
+	int duplicate_mode;
+	guint64 generation; //from the csv header, 0 if none
+} ImportResult;
+
+//calendars, each an independent store with its own file and indexes
+enum {
+	CALENDAR_PERSONAL=0, //events.csv
+	CALENDAR_WORK,
+	CALENDAR_FAMILY,
+	CALENDAR_SHARED,
+	NUM_CALENDARS
+};
+
+typedef struct _IntervalIndex IntervalIndex;
+
+//immutable copy of a calendar's events (see store snapshots)
+typedef struct {
+	int size;
+	Event events[]; //ascending id order
+} StoreVersion;
+
+//the versions of every calendar published together
+typedef struct {
+	StoreVersion *calendars[NUM_CALENDARS];
+	guint serial; //counts the snapshots published
+} StoreSnapshot;
+
+//one-off events of a year more than a year from today, in their own file
+typedef struct {
+	int year;
+	guint loaded; //months (bit 0 = January) whose events are in the calendar
+	gboolean archived; //compressed by month (see archived years)
+	gboolean summarised; //total, day_counts and the month fields are known
+	int total; //events in the file
+	guchar day_counts[366]; //events on each day of the year, at most 15
+	int month_totals[12]; //events starting in each month
+	guchar month_reach[12]; //last month (0-11) an event starting in the month runs into
+	guint64 generation; //file header when read or written
+	GArray *file_hashes; //sorted content hashes of its rows when read or written
+} YearSegment;
+
+typedef struct {
+	const char *name;
+	const char *file_name; //in the run directory
+	Event *events; //ascending id order
+	int size;
+	int capacity; //grows on demand
+	GArray *series; //indices of recurring events
+	GHashTable *month_cache; //month key -> GArray of Occurrence
+	IntervalIndex *index; //one-off events
+	GArray *file_hashes; //sorted content hashes of the rows last read or written
+	GFileMonitor *monitor; //external changes to the file
+	guint reconcile_source; //change seen, waiting for the writer to finish
+	struct _ImportJob *reconcile_job; //parsing the changed file
+	guint file_version; //counts file_hashes updates
+	guint64 file_generation; //header of the file when last read or written
+	GPtrArray *segments; //YearSegment in year order
+	StoreVersion *version; //copy of events for snapshots, NULL once they change
+} Calendar;
+
 //declarations
 
 static void update_calendar(GtkWindow *window);
+static void calendar_queue_update(GtkWindow *window, gboolean day_changed);
 static void update_header (GtkWindow *window);
 static GtkWidget *create_widget (gpointer item, gpointer user_data);
 static void update_store(int m_year,int m_month,int m_day);
 static void update_marked_dates(int month, int year);
 static void reset_marked_dates();
+static int mark_month_days(int month, int year, int *marks);
+static gboolean is_public_holiday_in(int day, int month, int year);
+static void prefetch_clear();
 void load_csv_file();
+int file_exists(const char *file_name);
+static gboolean import_file(const char *file_name, int format, int calendar, int duplicates, ImportResult *result);
 gchar* get_css_string();
 GDate* calculate_easter(gint year);
-gboolean check_day_events_for_overlap();
+gboolean check_day_events_for_overlap(int year, int month, int day);
+
+//event database
+static int db_add_event(int calendar, Event *event);
+static Event* db_find_event(int id);
+static Calendar* db_find_calendar(int id);
+static gboolean db_update_event(const Event *event);
+static gboolean db_delete_event(int id);
+static void db_store_changed(Calendar *cal);
+static void calendar_file_synced(Calendar *cal);
+static void calendar_reconcile_now(int calendar);
+static void calendar_set_file_hashes(GArray **hashes, GPtrArray *rows);
+static int current_year();
+static int event_cold_year(const Event *e, int this_year);
+static void segments_open(Calendar *cal, int this_year);
+static void segments_prepare(Calendar *cal, int this_year);
+static gboolean segment_write(Calendar *cal, YearSegment *seg, GPtrArray *rows);
+static void segments_clear(Calendar *cal);
+static void calendar_page_in(Calendar *cal, guint32 jd_from, guint32 jd_to);
+static int calendar_unloaded_events(Calendar *cal);
+static void db_load_all_years();
+static void agenda_shm_schedule();
+static void reminder_schedule();
+static void autosave_schedule();
+static GArray* get_day_events(int year, int month, int day);
+static GArray* query_range(guint32 jd_from, guint32 jd_to);
+static guint32 julian_from_date_string(const char *str);
+static void csv_copy_text(gchar *dest, gsize size, const gchar *text);
+struct _Task;
+static gboolean task_is_cancelled(struct _Task *task);
 
 //Event Dialogs
 static void callbk_check_button_allday_toggled (GtkCheckButton *check_button, gpointer user_data);
 static void callbk_new_event_response(GtkDialog *dialog, gint response_id,  gpointer  user_data);
 static void callbk_new_event(GtkButton *button, gpointer  user_data);
 void callbk_edit_event_response(GtkDialog *dialog, gint response_id,  gpointer  user_data);
+static void callbk_edit_occurrence_response(GtkDialog *dialog, gint response_id, gpointer user_data);
 static void callbk_edit_event(GtkButton *button, gpointer  user_data);
 
+static void warn_event_conflicts(GtkWindow *window, int id);
+
 //Actions
 static void callbk_speak(GSimpleAction* action, GVariant *parameter,gpointer user_data);
 static void callbk_speak_about(GSimpleAction* action,G_GNUC_UNUSED  GVariant *parameter,gpointer user_data);
@@ -67,12 +236,17 @@ static void callbk_home(GSimpleAction* action, GVariant *parameter, gpointer use
 static void callbk_delete(GSimpleAction* action, GVariant *parameter,  gpointer user_data);
 static void callbk_quit(GSimpleAction* action,G_GNUC_UNUSED GVariant *parameter, gpointer user_data);
 static void callbk_delete_selected(GtkButton *button, gpointer  user_data);
+static void callbk_remote_add_event(GSimpleAction* action, GVariant *parameter, gpointer user_data);
+static void callbk_remote_goto(GSimpleAction* action, GVariant *parameter, gpointer user_data);
+static void command_service_register(GApplication *app);
+static void command_service_unregister(GApplication *app);
 static void set_button_blue(GtkButton *button);
 static void set_button_red_with_borders(GtkButton *button);
 static void set_button_red(GtkButton *button);
 static void set_button_green(GtkButton *button);
 
-static GMutex lock; //talking thread locked
+static GQueue m_speech_queue=G_QUEUE_INIT; //texts waiting to be spoken
+static gboolean m_speaking=FALSE; //an utterance is playing
 //config
 static char * m_config_file = NULL;
 static int m_talk =1;
@@ -82,6 +256,11 @@ static int m_font_size=20;
 static const gchar* m_font_name="Sans";
 static int m_holidays=0; //show holidays
 static int m_show_end_time=0; //show end_time
+static int m_reminders=0; //speak and notify before events
+static const gchar* m_reminder_leads="10"; //minutes before start, comma separated
+static int m_background=0; //keep running for reminders when the window is closed
+static int m_import_duplicates=DUPLICATES_SKIP;
+static int m_hidden_calendars=0; //bit per calendar
 
 
 static int m_row_index=-1; //selection index
@@ -98,26 +277,31 @@ static int m_is_allday=0;
 
 static GListStore *m_store;
 
-static int m_id_selection=-1;
+//input to paint latency of navigation (see navigation)
+static guint m_nav_steps=0; //navigation inputs
+static guint m_nav_rebuilds=0; //rebuilds they cost
+static guint m_nav_painted=0; //latencies measured
+static gint64 m_nav_latency_last=0; //us
+static gint64 m_nav_latency_max=0;
+static gint64 m_nav_latency_total=0;
 
-typedef struct {
-	int id;	
-	char title[101];
-	char location[101];
-	int year;
-	int month;
-	int day;
-	float start_time;
-	float end_time;	
-	int priority;
-	int is_yearly;
-	int is_allday;
-} Event;
+static int m_id_selection=-1;
+static guint32 m_start_jd=0; //date to open at instead of today (--goto)
+static gboolean m_start_background=FALSE; //--background: no window until activated again
+static gboolean m_background_hold=FALSE; //application held while no window is open
+
+static Calendar m_calendars[NUM_CALENDARS] = {
+	{ "Personal", "events.csv" },
+	{ "Work", "work.csv" },
+	{ "Family", "family.csv" },
+	{ "Shared", "shared.csv" }
+};
+static int m_calendar=CALENDAR_PERSONAL; //last chosen for new events and imports
+static gboolean m_db_open=FALSE;
+static int m_next_id=0; //unique across calendars, ids stay unique after deletes
 
-int max_records=5000;
-Event *db_store=NULL; 
+static gboolean m_headless=FALSE; //answering a command line query without a window
 
-int m_db_size=0;
 int marked_date[31]; //month days with events
 int num_marked_dates = 0;
 //---------------------------------------------------------------------
@@ -172,6 +356,11 @@ static void config_load_default()
 	if(!m_font_size) m_font_size=22;  	
 	if(!m_holidays) m_holidays=0;
 	if(!m_show_end_time) m_show_end_time=0;	
+	if(!m_reminders) m_reminders=0;
+	m_reminder_leads="10";
+	if(!m_background) m_background=0;
+	m_import_duplicates=DUPLICATES_SKIP;
+	m_hidden_calendars=0;
 	
 }
 
@@ -184,6 +373,11 @@ static void config_read()
 	m_font_size=22; 	
 	m_holidays=0;
 	m_show_end_time=0;		
+	m_reminders=0;
+	m_reminder_leads="10";
+	m_background=0;
+	m_import_duplicates=DUPLICATES_SKIP;
+	m_hidden_calendars=0;
 	
 	// Load keys from keyfile
 	GKeyFile * kf = g_key_file_new();
@@ -192,6 +386,13 @@ static void config_read()
 	m_talk_at_startup=g_key_file_get_integer(kf, "calendar_settings", "talk_startup", NULL);	
 	m_holidays = g_key_file_get_integer(kf, "calendar_settings", "holidays", NULL);	
 	m_show_end_time = g_key_file_get_integer(kf, "calendar_settings", "show_end_time", NULL);				
+	m_reminders = g_key_file_get_integer(kf, "calendar_settings", "reminders", NULL);
+	gchar *leads = g_key_file_get_string(kf, "calendar_settings", "reminder_leads", NULL);
+	if(leads) m_reminder_leads=leads;
+	m_background = g_key_file_get_integer(kf, "calendar_settings", "background", NULL);
+	m_import_duplicates = g_key_file_get_integer(kf, "calendar_settings", "import_duplicates", NULL);
+	if(m_import_duplicates<DUPLICATES_SKIP || m_import_duplicates>DUPLICATES_KEEP) m_import_duplicates=DUPLICATES_SKIP;
+	m_hidden_calendars = g_key_file_get_integer(kf, "calendar_settings", "hidden_calendars", NULL);
 	m_font_name=g_key_file_get_string(kf, "calendar_settings", "font_name", NULL);	
 	m_font_size=g_key_file_get_integer(kf, "calendar_settings", "font_size", NULL);	
 	g_key_file_free(kf);	
@@ -206,6 +407,11 @@ void config_write()
 	g_key_file_set_integer(kf, "calendar_settings", "talk_startup", m_talk_at_startup);		
 	g_key_file_set_integer(kf, "calendar_settings", "holidays", m_holidays);
 	g_key_file_set_integer(kf, "calendar_settings", "show_end_time", m_show_end_time);	
+	g_key_file_set_integer(kf, "calendar_settings", "reminders", m_reminders);
+	g_key_file_set_string(kf, "calendar_settings", "reminder_leads", m_reminder_leads);
+	g_key_file_set_integer(kf, "calendar_settings", "background", m_background);
+	g_key_file_set_integer(kf, "calendar_settings", "import_duplicates", m_import_duplicates);
+	g_key_file_set_integer(kf, "calendar_settings", "hidden_calendars", m_hidden_calendars);
 	g_key_file_set_string(kf, "calendar_settings", "font_name", m_font_name);
 	g_key_file_set_integer(kf, "calendar_settings", "font_size", m_font_size);	
 	gsize length;
@@ -382,747 +588,5846 @@ static int first_day_of_month(int month, int year)
 }
 
 //---------------------------------------------------------------------
-// calculate easter
+// calendars
 //---------------------------------------------------------------------
+// Personal, work, family and shared events are kept in separate stores,
+// each loaded from and saved to its own file with its own recurring
+// series list, month cache and interval index, so a change to one
+// calendar only invalidates that calendar's derived data. Ids are unique
+// across calendars. Queries run on each visible calendar and the sorted
+// results are merged, so hiding a calendar changes no store or index.
+
+static gboolean calendar_is_visible(int calendar)
+{
+	return (m_hidden_calendars & (1 << calendar))==0;
+}
 
-GDate* calculate_easter(gint year) {
+static Event* occurrence_event(const Occurrence *o)
+{
+	return &m_calendars[o->calendar].events[o->index];
+}
 
-	GDate *edate;
-	
-	gint Yr = year;
-    gint a = Yr % 19;
-    gint b = Yr / 100;
-    gint c = Yr % 100;
-    gint d = b / 4;
-    gint e = b % 4;
-    gint f = (b + 8) / 25;
-    gint g = (b - f + 1) / 3;
-    gint h = (19 * a + b - d - g + 15) % 30;
-    gint i = c / 4;
-    gint k = c % 4;
-    gint L = (32 + 2 * e + 2 * i - h - k) % 7;
-    gint m = (a + 11 * h + 22 * L) / 451;
-    gint month = (h + L - 7 * m + 114) / 31;
-    gint day = ((h + L - 7 * m + 114) % 31) + 1;	
-	edate = g_date_new_dmy(day, month, year);
+//NULL terminated calendar names for drop downs
+static const char** get_calendar_names()
+{
+	static const char *names[NUM_CALENDARS + 1];
+	for(int c=0; c<NUM_CALENDARS; c++) names[c]=m_calendars[c].name;
+	names[NUM_CALENDARS]=NULL;
+	return names;
+}
 
-	return edate;
+//-1 if name is not a calendar
+static int calendar_from_name(const char *name)
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(g_ascii_strcasecmp(name, m_calendars[c].name)==0) return c;
+	}
+	return -1;
+}
+
+//number of events in all calendars (or the visible ones), year files included
+static int db_count_events(gboolean visible_only)
+{
+	int count=0;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(visible_only && !calendar_is_visible(c)) continue;
+		count=count + m_calendars[c].size + calendar_unloaded_events(&m_calendars[c]);
+	}
+	return count;
 }
 
-//--------------------------------------------------------------------
-// new event
+//---------------------------------------------------------------------
+// recurrence
 //---------------------------------------------------------------------
 
-static void callbk_check_button_allday_toggled (GtkCheckButton *check_button, gpointer user_data)
+static guint32 julian_from_dmy(int day, int month, int year)
 {
- 	
- 	GtkWidget *spin_button_start_time; 	
- 	GtkWidget *spin_button_end_time;
- 	
- 	spin_button_start_time =g_object_get_data(G_OBJECT(user_data), "cb_allday_spin_start_time_key");	
-	spin_button_end_time= g_object_get_data(G_OBJECT(user_data), "cb_allday_spin_end_time_key");
+	if(!g_date_valid_dmy(day, month, year)) return 0;
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_dmy(&date, day, month, year);
+	return g_date_get_julian(&date);
+}
+
+static void dmy_from_julian(guint32 jd, int *day, int *month, int *year)
+{
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_julian(&date, jd);
+	*day = g_date_get_day(&date);
+	*month = g_date_get_month(&date);
+	*year = g_date_get_year(&date);
+}
+
+static int weekday_from_julian(guint32 jd)
+{
+	//julian day 1 (1 January year 1) is a Monday
+	return (jd - 1) % 7 + 1; //G_DATE_MONDAY=1 .. G_DATE_SUNDAY=7
+}
+
+static int event_is_recurring(const Event *e)
+{
+	return e->recur_freq != RECUR_NONE;
+}
+
+static int minutes_from_time(float time)
+{
+	//times are stored as hours.minutes e.g. 14.30
+	float integral_part;
+	float fractional_part = modff(time, &integral_part);
+	return (int) integral_part * 60 + (int) roundf(fractional_part * 100);
+}
+
+static guint32 event_span_days(const Event *e)
+{
+	guint32 start = julian_from_dmy(e->day, e->month, e->year);
+	if(e->end_date==0 || e->end_date < start) return 0;
+	return e->end_date - start;
+}
+
+//minutes since julian day 0 covered by an occurrence starting on day jd (end exclusive)
+static void event_interval(const Event *e, guint32 jd, gint64 *start, gint64 *end)
+{
+	gint64 last_day = jd + event_span_days(e);
+	if(e->is_allday) {
+		*start = (gint64) jd * 1440;
+		*end = (last_day + 1) * 1440;
+		return;
+	}
+	*start = (gint64) jd * 1440 + minutes_from_time(e->start_time);
+	*end = last_day * 1440 + minutes_from_time(e->end_time);
+	if(*end <= *start) *end = *start + 1; //zero length events still occupy their start
+}
+
+//make a copy of a recurring event describe one of its occurrences
+static void event_move_to(Event *e, guint32 jd)
+{
+	guint32 span = event_span_days(e);
+	dmy_from_julian(jd, &e->day, &e->month, &e->year);
+	e->end_date = span ? jd + span : 0;
+}
+
+static gboolean event_is_excluded(const Event *e, guint32 jd)
+{
+	for(int i=0; i<e->num_exdates; i++) {
+		if(e->exdates[i]==jd) return TRUE;
+	}
+	return FALSE;
+}
+
+//date of a monthly or yearly occurrence in the given month (0 if none)
+static guint32 recur_period_date(const Event *e, int month, int year)
+{
+	if(e->recur_freq != RECUR_MONTHLY_WEEKDAY) {
+		return julian_from_dmy(e->day, month, year); //31st or 29 Feb may not exist
+	}
 	
- 	if (gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button))){
-	gtk_widget_set_sensitive(spin_button_start_time,FALSE);	
-	gtk_widget_set_sensitive(spin_button_end_time,FALSE);
-	}     
-	else{
-	gtk_widget_set_sensitive(spin_button_start_time,TRUE);	
-	gtk_widget_set_sensitive(spin_button_end_time,TRUE);
+	//nth weekday of the month, a fifth weekday means the last one
+	int weekday = weekday_from_julian(julian_from_dmy(e->day, e->month, e->year));
+	int nth = (e->day - 1) / 7 + 1;
+	guint32 first = julian_from_dmy(1, month, year);
+	int day = 1 + (weekday - weekday_from_julian(first) + 7) % 7;
+	int days_in_month = g_date_get_days_in_month(month, year);
 	
+	if(nth==5) {
+		while(day + 7 <= days_in_month) day = day + 7;
 	}
-  
+	else {
+		day = day + (nth - 1) * 7;
+	}
+	return first + day - 1;
 }
 
-static void callbk_new_event_response(GtkDialog *dialog, gint response_id,  gpointer  user_data)
+//occurrences in monthly/yearly periods before period p (only needed with a count)
+static int recur_count_periods(const Event *e, int p, int step)
 {
+	if(e->recur_freq == RECUR_MONTHLY_WEEKDAY || e->day <= 28) return p;
 	
-	if(!GTK_IS_DIALOG(dialog)) { 
-	//g_print("New Event Response: not a dialog\n");	
-	return;
+	int n=0;
+	int month0 = e->year * 12 + e->month - 1;
+	for(int i=0; i<p; i++) {
+		int mi = month0 + i * step;
+		if(recur_period_date(e, mi % 12 + 1, mi / 12)) n++;
 	}
+	return n;
+}
+
+//call func for every occurrence of e between julian days from and to (inclusive)
+//work is proportional to the occurrences in the window not the length of the series
+static void recur_expand(const Event *e, guint32 from, guint32 to, OccurrenceFunc func, gpointer user_data)
+{
+	guint32 start = julian_from_dmy(e->day, e->month, e->year);
+	if(start==0) return;
 	
+	int interval = MAX(e->recur_interval, 1);
+	int count = e->recur_count;	
+	guint32 last = to;
+	if(e->recur_until && e->recur_until < last) last = e->recur_until;
+	if(from < start) from = start;
+	if(from > last) return;
 	
-	GtkWidget *window = user_data;
-	
-	GtkEntryBuffer *buffer_title; 	
-	GtkWidget *entry_title = g_object_get_data(G_OBJECT(dialog), "entry-title-key");
-	GtkEntryBuffer *buffer_location; 
-	GtkWidget *entry_location = g_object_get_data(G_OBJECT(dialog), "entry-location-key");
+	int k=0; //occurrence number (exception dates still count)
 	
-	  
-	GtkWidget *spin_button_start_time= g_object_get_data(G_OBJECT(dialog), "spin-start-time-key");  
-    GtkWidget *spin_button_end_time= g_object_get_data(G_OBJECT(dialog), "spin-end-time-key");       
-   
-	GtkWidget *check_button_allday= g_object_get_data(G_OBJECT(dialog), "check-button-allday-key"); 
-    GtkWidget *check_button_isyearly= g_object_get_data(G_OBJECT(dialog), "check-button-isyearly-key");  
-    GtkWidget *check_button_priority= g_object_get_data(G_OBJECT(dialog), "check-button-priority-key");
+	switch(e->recur_freq)
+	{
+	case RECUR_NONE:
+		if(start >= from && start <= last) func(e, start, user_data);
+		break;
 		
+	case RECUR_DAILY: {
+		k = (from - start + interval - 1) / interval;
+		for(guint32 jd = start + k * interval; jd <= last; jd = jd + interval, k++) {
+			if(count && k >= count) break;
+			if(!event_is_excluded(e, jd)) func(e, jd, user_data);
+		}
+		break;
+	}
 	
-	if(response_id==GTK_RESPONSE_OK)
-	{
+	case RECUR_WEEKLY: {
+		int start_weekday = weekday_from_julian(start);
+		int mask = e->recur_weekdays & 0x7f;
+		if(mask==0) mask = 1 << (start_weekday - 1);
+		
+		int per_week=0;
+		int skipped=0; //mask days in the first week before the start
+		for(int wd=0; wd<7; wd++) {
+			if(!(mask & (1 << wd))) continue;
+			per_week++;
+			if(wd < start_weekday - 1) skipped++;
+		}
+		
+		guint32 week0 = start - (start_weekday - 1); //monday of first week
+		guint32 p = ((from - week0) / 7 + interval - 1) / interval; //first active week
+		k = p * per_week - (p > 0 ? skipped : 0);
+		
+		for(;; p++) {
+			guint32 week_start = week0 + p * interval * 7;
+			if(week_start > last) return;
+			for(int wd=0; wd<7; wd++) {
+				if(!(mask & (1 << wd))) continue;
+				guint32 jd = week_start + wd;
+				if(jd < start) continue;
+				if(count && k >= count) return;
+				k++;
+				if(jd < from) continue;
+				if(jd > last) return;
+				if(!event_is_excluded(e, jd)) func(e, jd, user_data);
+			}
+		}
+		break;
+	}
 	
-	//set data
-	buffer_title = gtk_entry_get_buffer (GTK_ENTRY(entry_title));	
-	m_title= gtk_entry_buffer_get_text (buffer_title);		
-	buffer_location = gtk_entry_get_buffer (GTK_ENTRY(entry_location));	
-	m_location= gtk_entry_buffer_get_text (buffer_location);
-	int fd;
-	Event event;
-	event.id =m_db_size;	
-	strcpy(event.title,m_title);
-	strcpy(event.location,m_location);
-	event.year=m_year;
-	event.month=m_month;
-	event.day=m_day;
-	//float start_time, end_time;
-	m_start_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_start_time));
-	m_end_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_end_time));
+	case RECUR_MONTHLY:
+	case RECUR_MONTHLY_WEEKDAY:
+	case RECUR_YEARLY: {
+		int step = (e->recur_freq==RECUR_YEARLY) ? 12 * interval : interval;
+		int from_day, from_month, from_year;
+		dmy_from_julian(from, &from_day, &from_month, &from_year);
+		int month0 = e->year * 12 + e->month - 1;
+		int p = (from_year * 12 + from_month - 1 - month0) / step;
+		if(count) k = recur_count_periods(e, p, step);
 		
-	event.start_time=m_start_time;
-	event.end_time=m_end_time;
+		for(;; p++) {
+			int mi = month0 + p * step;
+			int month = mi % 12 + 1;
+			int year = mi / 12;
+			if(julian_from_dmy(1, month, year) > last) return;
+			guint32 jd = recur_period_date(e, month, year);
+			if(jd==0) continue;
+			if(count && k >= count) return;
+			k++;
+			if(jd < from) continue;
+			if(jd > last) return;
+			if(!event_is_excluded(e, jd)) func(e, jd, user_data);
+		}
+		break;
+	}
+	}
+}
+
+typedef struct {
+	GArray *occurrences;
+	Calendar *cal; //holding the expanded events
+} OccurrenceSink;
+
+static void collect_occurrence(const Event *e, guint32 jd, gpointer user_data)
+{
+	OccurrenceSink *sink = user_data;
+	Occurrence o;
+	gint64 end;
+	o.calendar = sink->cal - m_calendars;
+	o.index = e - sink->cal->events;
+	o.jd = jd;
+	event_interval(e, jd, &o.start, &end);
+	g_array_append_val(sink->occurrences, o);
+}
+
+//indices of the recurring events of a calendar
+static GArray* get_series(Calendar *cal)
+{
+	if(cal->series==NULL) {
+		cal->series = g_array_new(FALSE, FALSE, sizeof(int));
+		for(int i=0; i<cal->size; i++) {
+			if(event_is_recurring(&cal->events[i])) g_array_append_val(cal->series, i);
+		}
+	}
+	return cal->series;
+}
+
+//recurring series are expanded a month at a time and cached until the next change
+static GArray* get_month_occurrences(Calendar *cal, int year, int month)
+{
+	if(cal->month_cache==NULL) {
+		cal->month_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+	}
+	
+	gpointer key = GINT_TO_POINTER(year * 12 + month);
+	GArray *occurrences = g_hash_table_lookup(cal->month_cache, key);
+	if(occurrences) return occurrences;
 	
-	if(event.end_time<event.start_time) {
-		event.end_time=event.start_time;
+	GArray *series = get_series(cal);
+	
+	if(g_hash_table_size(cal->month_cache) > 36) {
+		g_hash_table_remove_all(cal->month_cache); //keep the cache small
 	}
-    
-	event.is_yearly=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_isyearly));
-	event.is_allday=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_allday));
-	event.priority=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_priority));
 	
-	db_store[m_db_size] =event;			
-	m_db_size=m_db_size+1;	
-	update_calendar(GTK_WINDOW(window));
-	update_store(m_year,m_month,m_day);
-	m_id_selection=-1;			
-	}		
-	gtk_window_destroy(GTK_WINDOW(dialog));	
+	guint32 from = julian_from_dmy(1, month, year);
+	guint32 to = from + g_date_get_days_in_month(month, year) - 1;
+	occurrences = g_array_new(FALSE, FALSE, sizeof(Occurrence));
+	OccurrenceSink sink = { occurrences, cal };
+	for(guint i=0; i<series->len; i++) {
+		Event *e = &cal->events[g_array_index(series, int, i)];
+		//multi-day occurrences that start last month still show this month
+		recur_expand(e, from - MIN(event_span_days(e), from - 1), to, collect_occurrence, &sink);
+	}
+	g_hash_table_insert(cal->month_cache, key, occurrences);
+	return occurrences;
 }
 
+//---------------------------------------------------------------------
+// interval index
+//---------------------------------------------------------------------
+// One-off events are held in a centered interval tree over minutes since
+// julian day 0. Each node keeps the intervals containing its center sorted
+// by start and by end so a stabbing query visits O(log n) nodes and stops
+// scanning a node at the first miss. Range queries are a stab at the
+// window start plus a binary search for intervals starting inside it.
+// The index is rebuilt lazily after the store changes.
 
-static void callbk_new_event(GtkButton *button, gpointer  user_data){
- 
-  GtkWidget *window =user_data;
-  
-  GtkWidget *dialog;  
-  gint response; 
-  GtkWidget *grid; 
-  GtkWidget *box;  
-  GtkWidget *label_date;  
-  GtkEntryBuffer *buffer; 
-  GtkWidget *label_entry_title; 
-  GtkWidget *entry_title;
-  
-  GtkWidget *label_location; 
-  GtkWidget *entry_location;		
- 
-  //Start time
-  GtkWidget *label_start_time;  
-  GtkWidget *spin_button_start_time;  
-  GtkWidget *box_start_time;
-  
-  //End time
-  GtkWidget *label_end_time;  
-  GtkWidget *spin_button_end_time; 
-  GtkWidget *box_end_time;
-  
-  
-  //Check buttons
-  GtkWidget *check_button_allday;	
-  GtkWidget *check_button_isyearly;
-  GtkWidget *check_button_priority;
+typedef struct {
+	gint64 start;
+	gint64 end; //exclusive
+	int index; //event index in the calendar
+} IndexEntry;
 
-  GDate *event_date; 
-  event_date = g_date_new();
-  event_date = g_date_new_dmy(m_day,m_month,m_year);
-  int event_day= g_date_get_day(event_date);
-  int event_month= g_date_get_month(event_date);
-  int event_year= g_date_get_year(event_date);
-  
-  gchar * date_str="Event Date: ";
-  gchar *day_str = g_strdup_printf("%d",event_day); 
-  gchar *month_str = g_strdup_printf("%d",event_month); 
-  gchar *year_str = g_strdup_printf("%d",event_year);
-  
-  date_str =g_strconcat(date_str,day_str,"-",month_str,"-",year_str,NULL); 
-  
-  dialog = gtk_dialog_new_with_buttons ("New Event", GTK_WINDOW(window),   
-  GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT|GTK_DIALOG_USE_HEADER_BAR,
-  "OK", GTK_RESPONSE_OK, "Cancel", GTK_RESPONSE_CANCEL, NULL);
-  
-  gtk_window_set_title (GTK_WINDOW (dialog), "New Event");
-  gtk_window_set_default_size(GTK_WINDOW(dialog),350,100);  
-  
-  box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
-  gtk_window_set_child (GTK_WINDOW (dialog), box);
-    
-  label_date =gtk_label_new(date_str);  
-  
-  label_entry_title =gtk_label_new("Event Title"); 
-  entry_title =gtk_entry_new(); 
-  gtk_entry_set_max_length(GTK_ENTRY(entry_title),100);
-  
-  label_location =gtk_label_new("Location"); 
-  entry_location =gtk_entry_new(); 
-  gtk_entry_set_max_length(GTK_ENTRY(entry_location),100);
-  
-  
-  gtk_box_append(GTK_BOX(box), label_date);
-  gtk_box_append(GTK_BOX(box), label_entry_title);
-  gtk_box_append(GTK_BOX(box), entry_title);
-  gtk_box_append(GTK_BOX(box), label_location);
-  gtk_box_append(GTK_BOX(box), entry_location);
-     
-  g_object_set_data(G_OBJECT(dialog), "entry-title-key",entry_title);
-  g_object_set_data(G_OBJECT(dialog), "entry-location-key",entry_location);
-  g_object_set_data(G_OBJECT(dialog), "dialog-window-key",window); 
- 
-  //--------------------------------------------------------
-  // Start time spin buttons
-  //--------------------------------------------------------- 
-   
-  GtkAdjustment *adjustment_start;
-  //value,lower,upper,step_increment,page_increment,page_size
-  adjustment_start = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
-  //start time spin
-  label_start_time =gtk_label_new("Start Time (24 hour) "); 
-  spin_button_start_time = gtk_spin_button_new (adjustment_start, 1.0, 2);  
-  box_start_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
-  gtk_box_append (GTK_BOX(box_start_time),label_start_time);
-  gtk_box_append (GTK_BOX(box_start_time),spin_button_start_time);  
-  gtk_box_append(GTK_BOX(box), box_start_time);
-  g_object_set_data(G_OBJECT(dialog), "spin-start-time-key",spin_button_start_time); 
-  
-  //end time spin
-   GtkAdjustment *adjustment_end;
-  //value,lower,upper,step_increment,page_increment,page_size
-  adjustment_end = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
-  label_end_time =gtk_label_new("End Time (24 hour) ");
-  spin_button_end_time = gtk_spin_button_new (adjustment_end, 1.0, 2);  
-  box_end_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
-  gtk_box_append (GTK_BOX(box_end_time),label_end_time);
-  gtk_box_append (GTK_BOX(box_end_time),spin_button_end_time);  
-  gtk_box_append(GTK_BOX(box), box_end_time);
-  g_object_set_data(G_OBJECT(dialog), "spin-end-time-key",spin_button_end_time);   
-  
-  //check buttons 
-  check_button_allday = gtk_check_button_new_with_label ("Is All Day");  
-  
-  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_start_time_key",spin_button_start_time);
-  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_end_time_key",spin_button_end_time); 
+typedef struct {
+	gint64 center;
+	int left; //child nodes (-1 = none)
+	int right;
+	int first; //span in by_start and by_end
+	int count;
+} IndexNode;
+
+struct _IntervalIndex {
+	int calendar; //indexed calendar
+	GArray *entries; //sorted by start
+	GArray *nodes;
+	int *by_start; //entry numbers of each node sorted by start
+	int *by_end; //entry numbers of each node sorted by end (descending)
+	int n_filled;
+	int root;
+	gboolean valid;
+};
 
-  g_signal_connect_swapped (GTK_CHECK_BUTTON(check_button_allday), "toggled", 
-					G_CALLBACK (callbk_check_button_allday_toggled), check_button_allday);
-    
-  check_button_isyearly = gtk_check_button_new_with_label ("Is Yearly");
-  check_button_priority = gtk_check_button_new_with_label ("Is High Priority");
-  gtk_box_append(GTK_BOX(box), check_button_allday);
-  gtk_box_append(GTK_BOX(box), check_button_isyearly);
-  gtk_box_append(GTK_BOX(box), check_button_priority);
-  
-  g_object_set_data(G_OBJECT(dialog), "check-button-allday-key",check_button_allday);
-  g_object_set_data(G_OBJECT(dialog), "check-button-isyearly-key",check_button_isyearly);
-  g_object_set_data(G_OBJECT(dialog), "check-button-priority-key",check_button_priority);
-  
+static int compare_entry_start(gconstpointer a, gconstpointer b)
+{
+	const IndexEntry *entry_a = a;
+	const IndexEntry *entry_b = b;
+	return (entry_a->start > entry_b->start) - (entry_a->start < entry_b->start);
+}
 
-    GtkStyleContext *context_dialog;	
-	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
-	GtkCssProvider *cssProvider;	
-	cssProvider = gtk_css_provider_new();
-	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
-	
-	// get GtkStyleContext from widget
-	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
-	//finally load style provider 
-	gtk_style_context_add_provider(context_dialog,    
-	GTK_STYLE_PROVIDER(cssProvider), 
-	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
-	//gtk_widget_show(dialog);	  
-   
-  
-  g_signal_connect (dialog, "response", G_CALLBACK (callbk_new_event_response),window);
-  
-  gtk_window_present (GTK_WINDOW (dialog)); 
-  
+static int compare_entry_end_desc(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const IndexEntry *entries = user_data;
+	gint64 end_a = entries[*(const int*) a].end;
+	gint64 end_b = entries[*(const int*) b].end;
+	return (end_a < end_b) - (end_a > end_b);
 }
-//----------------------------------------------------------------------
-// Edit event
-//----------------------------------------------------------------------
 
-void callbk_edit_event_response(GtkDialog *dialog, gint response_id,  gpointer  user_data)
+//items are entry numbers in start order, returns the node number
+static int index_build_node(IntervalIndex *idx, int *items, int n)
 {
-	  
-  
-	
-	
-	if(!GTK_IS_DIALOG(dialog)) { 
-	g_print("New Event Response: not a dialog\n");	
-	return;
+	if(n==0) return -1;
+	
+	IndexEntry *entries = (IndexEntry*) idx->entries->data;
+	int *left = g_new(int, n);
+	int *right = g_new(int, n);
+	int n_left=0;
+	int n_right=0;
+	
+	IndexNode node;
+	node.center = entries[items[n/2]].start;
+	node.first = idx->n_filled;
+	node.count = 0;
+	
+	for(int i=0; i<n; i++) {
+		IndexEntry *entry = &entries[items[i]];
+		if(entry->end <= node.center) left[n_left++] = items[i];
+		else if(entry->start > node.center) right[n_right++] = items[i];
+		else idx->by_start[node.first + node.count++] = items[i];
 	}
-		
-	GtkWidget *window = user_data;	
-	GtkEntryBuffer *buffer_title; 	
-	GtkWidget *entry_title = g_object_get_data(G_OBJECT(dialog), "entry-title-key");
-	GtkEntryBuffer *buffer_location; 
-	GtkWidget *entry_location = g_object_get_data(G_OBJECT(dialog), "entry-location-key");
-	
-	GtkWidget *spin_button_start_time= g_object_get_data(G_OBJECT(dialog), "spin-start-time-key");  
-    GtkWidget *spin_button_end_time= g_object_get_data(G_OBJECT(dialog), "spin-end-time-key");       
-    
-    GtkWidget *check_button_allday= g_object_get_data(G_OBJECT(dialog), "check-button-allday-key"); 
-    GtkWidget  *check_button_isyearly= g_object_get_data(G_OBJECT(dialog), "check-button-isyearly-key");  
-    GtkWidget  *check_button_priority= g_object_get_data(G_OBJECT(dialog), "check-button-priority-key");
+	idx->n_filled = idx->n_filled + node.count;
 	
-			
-	if(response_id==GTK_RESPONSE_OK)
-	{
+	memcpy(idx->by_end + node.first, idx->by_start + node.first, node.count * sizeof(int));
+	g_qsort_with_data(idx->by_end + node.first, node.count, sizeof(int), compare_entry_end_desc, entries);
 	
-	//set data
-	buffer_title = gtk_entry_get_buffer (GTK_ENTRY(entry_title));	
-	m_title= gtk_entry_buffer_get_text (buffer_title);	
-		buffer_location = gtk_entry_get_buffer (GTK_ENTRY(entry_location));	
-	m_location= gtk_entry_buffer_get_text (buffer_location);	
-		
-	//insert cahnge into database	
-	Event event;
-    for(int i=0; i<m_db_size; i++)
-    {
-	event=db_store[i];
-	if(event.id==m_id_selection){		
+	int node_num = idx->nodes->len;
+	g_array_append_val(idx->nodes, node);
+	int left_num = index_build_node(idx, left, n_left);
+	int right_num = index_build_node(idx, right, n_right);
+	g_array_index(idx->nodes, IndexNode, node_num).left = left_num;
+	g_array_index(idx->nodes, IndexNode, node_num).right = right_num;
 	
-	strcpy(event.title, m_title); 
-	strcpy(event.location, m_location); 	
-	event.year=m_year;
-	event.month=m_month;
-	event.day=m_day;	
-	//float start_time, end_time;
-	m_start_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_start_time));
-	m_end_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_end_time));		
-		
-	event.start_time=m_start_time;
-	event.end_time=m_end_time;
+	g_free(left);
+	g_free(right);
+	return node_num;
+}
+
+static void index_rebuild(IntervalIndex *idx)
+{
+	if(idx->entries==NULL) {
+		idx->entries = g_array_new(FALSE, FALSE, sizeof(IndexEntry));
+		idx->nodes = g_array_new(FALSE, FALSE, sizeof(IndexNode));
+	}
+	g_array_set_size(idx->entries, 0);
+	g_array_set_size(idx->nodes, 0);
+	
+	Calendar *cal = &m_calendars[idx->calendar];
+	for(int i=0; i<cal->size; i++) {
+		Event *e = &cal->events[i];
+		if(event_is_recurring(e)) continue;
+		guint32 jd = julian_from_dmy(e->day, e->month, e->year);
+		if(jd==0) continue;
+		IndexEntry entry;
+		event_interval(e, jd, &entry.start, &entry.end);
+		entry.index = i;
+		g_array_append_val(idx->entries, entry);
+	}
+	g_array_sort(idx->entries, compare_entry_start);
+	
+	int n = idx->entries->len;
+	int *items = g_new(int, MAX(n, 1));
+	for(int i=0; i<n; i++) items[i] = i;
+	idx->by_start = g_renew(int, idx->by_start, MAX(n, 1));
+	idx->by_end = g_renew(int, idx->by_end, MAX(n, 1));
+	idx->n_filled = 0;
+	idx->root = index_build_node(idx, items, n);
+	g_free(items);
+	idx->valid = TRUE;
+}
+
+static void index_append(IntervalIndex *idx, int entry_num, GArray *out)
+{
+	IndexEntry *entry = &g_array_index(idx->entries, IndexEntry, entry_num);
+	Occurrence o;
+	o.calendar = idx->calendar;
+	o.index = entry->index;
+	o.jd = entry->start / 1440;
+	o.start = entry->start;
+	g_array_append_val(out, o);
+}
+
+//append one-off events overlapping [from, to) minutes to out
+static void index_query(IntervalIndex *idx, gint64 from, gint64 to, GArray *out)
+{
+	if(!idx->valid) index_rebuild(idx);
+	IndexEntry *entries = (IndexEntry*) idx->entries->data;
+	
+	//stabbing query: intervals containing from
+	int node_num = idx->root;
+	while(node_num != -1) {
+		IndexNode *node = &g_array_index(idx->nodes, IndexNode, node_num);
+		if(from < node->center) {
+			for(int i=0; i<node->count; i++) {
+				int entry_num = idx->by_start[node->first + i];
+				if(entries[entry_num].start > from) break;
+				index_append(idx, entry_num, out);
+			}
+			node_num = node->left;
+		}
+		else {
+			for(int i=0; i<node->count; i++) {
+				int entry_num = idx->by_end[node->first + i];
+				if(entries[entry_num].end <= from) break;
+				index_append(idx, entry_num, out);
+			}
+			if(from == node->center) break;
+			node_num = node->right;
+		}
+	}
 	
-	if(event.end_time<event.start_time) {
-		event.end_time=event.start_time;
+	//intervals starting inside (from, to)
+	int lo = 0;
+	int hi = idx->entries->len;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(entries[mid].start <= from) lo = mid + 1;
+		else hi = mid;
 	}
-	//GTK_IS_CHECK_BUTTON
-	event.is_yearly=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_isyearly));
-	event.is_allday=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_allday));
-	event.priority=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_priority));	
-	db_store[i]=event;	
-	break;	
+	for(int i=lo; i<(int) idx->entries->len && entries[i].start < to; i++) {
+		index_append(idx, i, out);
+	}
+}
+
+//queries return occurrences in this order
+static int compare_occurrence(gconstpointer a, gconstpointer b)
+{
+	const Occurrence *o_a = a;
+	const Occurrence *o_b = b;
+	if(o_a->start != o_b->start) return (o_a->start > o_b->start) - (o_a->start < o_b->start);
+	if(o_a->calendar != o_b->calendar) return o_a->calendar - o_b->calendar;
+	return o_a->index - o_b->index;
+}
+
+//occurrences of a calendar's events overlapping julian days jd_from to jd_to
+static GArray* calendar_query_range(Calendar *cal, guint32 jd_from, guint32 jd_to)
+{
+	calendar_page_in(cal, jd_from, jd_to); //cold years with events in the range
+	GArray *out = g_array_new(FALSE, FALSE, sizeof(Occurrence));
+	gint64 from = (gint64) jd_from * 1440;
+	gint64 to = ((gint64) jd_to + 1) * 1440;
+	
+	if(m_headless) {
+		//a single command line query is cheaper as a scan than an index build
+		for(int i=0; i<cal->size; i++) {
+			Event *e = &cal->events[i];
+			if(event_is_recurring(e)) continue;
+			Occurrence o = { cal - m_calendars, i, julian_from_dmy(e->day, e->month, e->year) };
+			if(o.jd==0) continue;
+			gint64 end;
+			event_interval(e, o.jd, &o.start, &end);
+			if(o.start < to && end > from) g_array_append_val(out, o);
+		}
+	}
+	else {
+		if(cal->index==NULL) {
+			cal->index = g_new0(IntervalIndex, 1);
+			cal->index->calendar = cal - m_calendars;
+		}
+		index_query(cal->index, from, to, out);
 	}
 	
-    }
+	//recurring series from the per month occurrence cache
+	int day, month, year;
+	dmy_from_julian(jd_from, &day, &month, &year);
+	for(gboolean first_month=TRUE;; first_month=FALSE) {
+		guint32 month_start = julian_from_dmy(1, month, year);
+		if(month_start > jd_to) break;
+		GArray *occurrences = get_month_occurrences(cal, year, month);
+		for(guint i=0; i<occurrences->len; i++) {
+			Occurrence *o = &g_array_index(occurrences, Occurrence, i);
+			//lookback occurrences are shared by consecutive months
+			if(o->jd < month_start && !first_month) continue;
+			gint64 start, end;
+			event_interval(occurrence_event(o), o->jd, &start, &end);
+			if(start < to && end > from) g_array_append_val(out, *o);
+		}
+		month = month + 1;
+		if(month > 12) {
+			month = 1;
+			year = year + 1;
+		}
+	}
+	g_array_sort(out, compare_occurrence);
+	return out;
+}
+
+//k-way merge of sorted runs, k is at most NUM_CALENDARS so the smallest
+//head is found with a scan rather than a heap
+static GArray* merge_occurrences(GArray **runs, int k)
+{
+	guint total = 0;
+	guint next[NUM_CALENDARS];
+	for(int i=0; i<k; i++) {
+		total = total + runs[i]->len;
+		next[i] = 0;
+	}
+	GArray *out = g_array_sized_new(FALSE, FALSE, sizeof(Occurrence), total);
+	while(out->len < total) {
+		Occurrence *smallest = NULL;
+		int run = 0;
+		for(int i=0; i<k; i++) {
+			if(next[i]==runs[i]->len) continue;
+			Occurrence *head = &g_array_index(runs[i], Occurrence, next[i]);
+			if(smallest==NULL || compare_occurrence(head, smallest) < 0) {
+				smallest = head;
+				run = i;
+			}
+		}
+		g_array_append_val(out, *smallest);
+		next[run]++;
+	}
+	return out;
+}
+
+//occurrences of the events of visible calendars overlapping julian days
+//jd_from to jd_to (inclusive) in start order
+static GArray* query_range(guint32 jd_from, guint32 jd_to)
+{
+	GArray *runs[NUM_CALENDARS];
+	int k = 0;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal = &m_calendars[c];
+		//an empty calendar may still have cold years to page in
+		if(!calendar_is_visible(c) || (cal->size==0 && (cal->segments==NULL || cal->segments->len==0))) continue;
+		runs[k] = calendar_query_range(cal, jd_from, jd_to);
+		k++;
+	}
+	if(k==0) return g_array_new(FALSE, FALSE, sizeof(Occurrence));
+	if(k==1) return runs[0];
+	GArray *out = merge_occurrences(runs, k);
+	for(int i=0; i<k; i++) g_array_unref(runs[i]);
+	return out;
+}
+
+//---------------------------------------------------------------------
+// conflict detection
+//---------------------------------------------------------------------
+// Timed events that overlap are double bookings, all day events are not.
+// Intervals are sorted by start and swept once: a cluster is a run of
+// intervals each starting before the running maximum end, and the number
+// of overlapping pairs is counted with a min-heap of active end times.
+
+typedef struct {
+	gint64 start;
+	gint64 end;
+	int calendar;
+	int index; //event index in the calendar
+	guint32 jd; //occurrence day
+} ConflictInterval;
+
+typedef struct {
+	int num_clusters;
+	int num_pairs;
+	int num_events; //events involved in a conflict
+	GString *details; //first clusters found
+} ConflictReport;
+
+static int compare_conflict_start(gconstpointer a, gconstpointer b)
+{
+	const ConflictInterval *interval_a = a;
+	const ConflictInterval *interval_b = b;
+	return (interval_a->start > interval_b->start) - (interval_a->start < interval_b->start);
+}
+
+static void heap_push(GArray *heap, gint64 value)
+{
+	g_array_append_val(heap, value);
+	gint64 *h = (gint64*) heap->data;
+	int i = heap->len - 1;
+	while(i > 0 && h[(i - 1) / 2] > h[i]) {
+		gint64 tmp = h[i];
+		h[i] = h[(i - 1) / 2];
+		h[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_pop(GArray *heap)
+{
+	gint64 *h = (gint64*) heap->data;
+	int n = heap->len - 1;
+	h[0] = h[n];
+	g_array_set_size(heap, n);
+	int i = 0;
+	for(;;) {
+		int smallest = i;
+		if(2 * i + 1 < n && h[2 * i + 1] < h[smallest]) smallest = 2 * i + 1;
+		if(2 * i + 2 < n && h[2 * i + 2] < h[smallest]) smallest = 2 * i + 2;
+		if(smallest == i) break;
+		gint64 tmp = h[i];
+		h[i] = h[smallest];
+		h[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+static void conflict_add_occurrences(GArray *intervals, GArray *occurrences)
+{
+	for(guint i=0; i<occurrences->len; i++) {
+		Occurrence *o = &g_array_index(occurrences, Occurrence, i);
+		if(occurrence_event(o)->is_allday) continue;
+		ConflictInterval interval;
+		event_interval(occurrence_event(o), o->jd, &interval.start, &interval.end);
+		interval.calendar = o->calendar;
+		interval.index = o->index;
+		interval.jd = o->jd;
+		g_array_append_val(intervals, interval);
+	}
+}
+
+//sorts intervals and sweeps them, details lists up to max_details clusters
+static void find_conflicts(GArray *intervals, ConflictReport *report, int max_details)
+{
+	report->num_clusters = 0;
+	report->num_pairs = 0;
+	report->num_events = 0;
+	
+	g_array_sort(intervals, compare_conflict_start);
+	ConflictInterval *iv = (ConflictInterval*) intervals->data;
+	int n = intervals->len;
+	
+	GArray *active_ends = g_array_new(FALSE, FALSE, sizeof(gint64));
+	int cluster_first = 0;
+	gint64 cluster_end = G_MININT64;
+	
+	for(int i=0; i<=n; i++) {
+		if(i == n || iv[i].start >= cluster_end) {
+			//close the previous cluster
+			int size = i - cluster_first;
+			if(size > 1) {
+				report->num_clusters++;
+				report->num_events = report->num_events + size;
+				if(report->details && report->num_clusters <= max_details) {
+					int day, month, year;
+					dmy_from_julian(iv[cluster_first].jd, &day, &month, &year);
+					g_string_append_printf(report->details, "%d-%d-%d:", day, month, year);
+					for(int j=cluster_first; j<i; j++) {
+						g_string_append_printf(report->details, " %s%s", m_calendars[iv[j].calendar].events[iv[j].index].title, j < i - 1 ? "," : "\n");
+					}
+				}
+			}
+			if(i == n) break;
+			cluster_first = i;
+			cluster_end = iv[i].end;
+		}
+		cluster_end = MAX(cluster_end, iv[i].end);
 		
-	update_calendar(GTK_WINDOW(window));
-	update_store(m_year,m_month,m_day);
-	m_row_index=-1;
-	m_id_selection=-1;
-	
+		while(active_ends->len > 0 && g_array_index(active_ends, gint64, 0) <= iv[i].start) {
+			heap_pop(active_ends);
+		}
+		report->num_pairs = report->num_pairs + active_ends->len;
+		heap_push(active_ends, iv[i].end);
 	}
-			
-	gtk_window_destroy(GTK_WINDOW(dialog));	
+	g_array_unref(active_ends);
 }
 
+//check whether any timed events on a day overlap
+gboolean check_day_events_for_overlap(int year, int month, int day)
+{
+	guint32 jd = julian_from_dmy(day, month, year);
+	if(jd==0) return FALSE;
+	
+	GArray *intervals = g_array_new(FALSE, FALSE, sizeof(ConflictInterval));
+	GArray *occurrences = query_range(jd, jd);
+	conflict_add_occurrences(intervals, occurrences);
+	g_array_unref(occurrences);
+	
+	ConflictReport report = {0};
+	find_conflicts(intervals, &report, 0);
+	g_array_unref(intervals);
+	return report.num_clusters > 0;
+}
 
+#define CONFLICT_SERIES_DAYS 366 //a repeating event is checked this far ahead
 
+//start and end of an occurrence appended to an array of gint64 pairs
+static void collect_interval(const Event *e, guint32 jd, gpointer user_data)
+{
+	gint64 interval[2];
+	event_interval(e, jd, &interval[0], &interval[1]);
+	g_array_append_val((GArray*) user_data, interval);
+}
 
-//----------------------------------------------------------------------
-static void callbk_edit_event(GtkButton *button, gpointer  user_data){
+//titles of events overlapping a newly added or edited event (NULL if none)
+//only the days the event covers are queried so this is cheap per edit, a
+//repeating event is checked on its occurrences from today (or its start)
+static gchar* get_event_conflicts(int id)
+{
+	Event *e = db_find_event(id);
+	if(e==NULL || e->is_allday) return NULL;
+	
+	guint32 from = julian_from_dmy(e->day, e->month, e->year);
+	if(from==0) return NULL;
+	guint32 to = from;
+	if(event_is_recurring(e)) {
+		GDate *current_date = g_date_new();
+		g_date_set_time_t(current_date, time(NULL));
+		from = MAX(from, g_date_get_julian(current_date));
+		g_date_free(current_date);
+		to = from + CONFLICT_SERIES_DAYS;
+		if(e->recur_until && e->recur_until < to) to = e->recur_until;
+		if(to < from) return NULL; //the series has ended
+	}
 	
+	GArray *own = g_array_new(FALSE, FALSE, sizeof(gint64) * 2);
+	recur_expand(e, from, to, collect_interval, own); //in date order
+	GArray *occurrences = query_range(from, to + event_span_days(e));
+	
+	GString *titles = NULL;
+	GHashTable *listed = g_hash_table_new(NULL, NULL); //a series clashes with another many times
+	for(guint i=0; i<occurrences->len; i++) {
+		Occurrence *o = &g_array_index(occurrences, Occurrence, i);
+		Event *other = occurrence_event(o);
+		if(other->id==id || other->is_allday) continue;
+		if(g_hash_table_contains(listed, GINT_TO_POINTER(other->id))) continue;
+		gint64 other_start, other_end;
+		event_interval(other, o->jd, &other_start, &other_end);
+		//occurrences have one length so their ends are sorted as well:
+		//find the first one ending after other starts
+		guint lo = 0;
+		guint hi = own->len;
+		while(lo < hi) {
+			guint mid = (lo + hi) / 2;
+			if(((gint64*) own->data)[mid * 2 + 1] <= other_start) lo = mid + 1;
+			else hi = mid;
+		}
+		if(lo < own->len && ((gint64*) own->data)[lo * 2] < other_end) {
+			g_hash_table_add(listed, GINT_TO_POINTER(other->id));
+			if(titles==NULL) titles = g_string_new("");
+			else g_string_append(titles, ", ");
+			g_string_append(titles, other->title);
+		}
+	}
+	g_hash_table_unref(listed);
+	g_array_unref(own);
+	g_array_unref(occurrences);
+	return titles ? g_string_free(titles, FALSE) : NULL;
+}
+
+//conflicts over the visible calendars (a work meeting can clash with a
+//family event), recurring series are expanded across the dates spanned by
+//one-off events (at most ten years)
+static void get_conflict_report(ConflictReport *report, int max_details)
+{
+	db_load_all_years();
+	GArray *intervals = g_array_new(FALSE, FALSE, sizeof(ConflictInterval));
+	guint32 first = 0;
+	guint32 last = 0;
+	
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(!calendar_is_visible(c)) continue;
+		Calendar *cal = &m_calendars[c];
+		for(int i=0; i<cal->size; i++) {
+			Event *e = &cal->events[i];
+			guint32 jd = julian_from_dmy(e->day, e->month, e->year);
+			if(jd==0) continue;
+			if(first==0 || jd < first) first = jd;
+			if(jd + event_span_days(e) > last) last = jd + event_span_days(e);
+			if(event_is_recurring(e) || e->is_allday) continue;
+			ConflictInterval interval;
+			event_interval(e, jd, &interval.start, &interval.end);
+			interval.calendar = c;
+			interval.index = i;
+			interval.jd = jd;
+			g_array_append_val(intervals, interval);
+		}
+	}
 	
-	if (m_id_selection==-1) return;
-		
-	GtkWindow *window =user_data;
+	if(first && last - first > 3653) first = last - 3653;
+	
+	if(first) {
+		GArray *occurrences = g_array_new(FALSE, FALSE, sizeof(Occurrence));
+		for(int c=0; c<NUM_CALENDARS; c++) {
+			if(!calendar_is_visible(c)) continue;
+			OccurrenceSink sink = { occurrences, &m_calendars[c] };
+			GArray *series = get_series(&m_calendars[c]);
+			for(guint i=0; i<series->len; i++) {
+				recur_expand(&m_calendars[c].events[g_array_index(series, int, i)], first, last, collect_occurrence, &sink);
+			}
+		}
+		conflict_add_occurrences(intervals, occurrences);
+		g_array_unref(occurrences);
+	}
 	
-	GtkWidget *dialog;  
-	gint response; 
-	GtkWidget *grid; 
-	GtkWidget *box;  
-	GtkWidget *label_date;  
-	GtkEntryBuffer *buffer_title; 
-	GtkEntryBuffer *buffer_location; 
+	find_conflicts(intervals, report, max_details);
+	g_array_unref(intervals);
+}
+
+//---------------------------------------------------------------------
+// free slot finder
+//---------------------------------------------------------------------
+// Busy intervals in the range are gathered with one query_range call,
+// which returns them in start order across calendars, then each day's
+// working window is walked in order keeping a running end of the busy
+// time seen so far. All day events block the whole day and recurring
+// events are included through query_range.
+
+typedef struct {
+	gint64 start; //minutes since julian day 0
+	gint64 end;
+} TimeSlot;
+
+//free gaps of at least duration minutes between day_start and day_end
+//(minutes after midnight) on each day from jd_from to jd_to
+//max_slots limits the result (0 = no limit), caller frees the array
+static GArray* find_free_slots(guint32 jd_from, guint32 jd_to, int day_start, int day_end, int duration, int max_slots)
+{
+	GArray *free_slots = g_array_new(FALSE, FALSE, sizeof(TimeSlot));
+	if(jd_from==0 || jd_to < jd_from || day_end <= day_start) return free_slots;
+	if(duration < 1) duration = 1;
+	
+	GArray *busy = g_array_new(FALSE, FALSE, sizeof(TimeSlot));
+	GArray *occurrences = query_range(jd_from, jd_to);
+	for(guint i=0; i<occurrences->len; i++) {
+		Occurrence *o = &g_array_index(occurrences, Occurrence, i);
+		TimeSlot slot;
+		event_interval(occurrence_event(o), o->jd, &slot.start, &slot.end);
+		g_array_append_val(busy, slot);
+	}
+	g_array_unref(occurrences);
 	
-	GtkWidget *label_entry_title; 
-	GtkWidget *entry_title;	
+	TimeSlot *b = (TimeSlot*) busy->data;
+	guint next = 0;
+	gint64 busy_end = G_MININT64;
 	
-	GtkWidget *label_location; 
-    GtkWidget *entry_location;	
-	
-	//Start time
-	GtkWidget *label_start_time;
-	GtkWidget *spin_button_start_time;	
-	GtkWidget *box_start_time;
-	
-	//End time
-	GtkWidget *label_end_time;	
-	GtkWidget *spin_button_end_time;	
-	GtkWidget *box_end_time;
-	
-	//Check buttons
-	GtkWidget *check_button_allday;	
-	GtkWidget *check_button_isyearly;
-	GtkWidget *check_button_priority;
-	
-	GDate *event_date; 
-	event_date = g_date_new();
-	event_date = g_date_new_dmy(m_day,m_month,m_year);
-	int event_day= g_date_get_day(event_date);
-	int event_month= g_date_get_month(event_date);
-	int event_year= g_date_get_year(event_date);
-	
-	gchar * date_str="Event Date: ";
-	gchar *day_str = g_strdup_printf("%d",event_day); 
-	gchar *month_str = g_strdup_printf("%d",event_month); 
-	gchar *year_str = g_strdup_printf("%d",event_year);
-	
-	date_str =g_strconcat(date_str,day_str,"-",month_str,"-",year_str,NULL); 
-	
-    dialog = gtk_dialog_new_with_buttons ("Edit Event", GTK_WINDOW(window), 
-	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT|GTK_DIALOG_USE_HEADER_BAR,
-	"OK", GTK_RESPONSE_OK, "Cancel", GTK_RESPONSE_CANCEL, NULL);
-	
-	gtk_window_set_title (GTK_WINDOW (dialog), "Edit Event");
-	gtk_window_set_default_size(GTK_WINDOW(dialog),350,100);  
-	
-	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
-	gtk_window_set_child (GTK_WINDOW (dialog), box);
+	for(guint32 jd=jd_from; jd<=jd_to; jd++) {
+		gint64 window_start = (gint64) jd * 1440 + day_start;
+		gint64 window_end = (gint64) jd * 1440 + day_end;
+		gint64 cursor = MAX(window_start, busy_end);
 		
-	//find event in database    
-	Event e;
-    for(int i=0; i<m_db_size; i++)
-    {
-	e=db_store[i];	
-	if(e.id==m_id_selection){	
-	m_title =e.title;
-	m_location =e.location;
-	m_year=e.year;
-	m_month=e.month;
-	m_day=e.day;            
-	break;	
-	}	
-    }
-	
-	
-	label_date =gtk_label_new(date_str);  
-	
-	label_entry_title =gtk_label_new("Event Title"); 
-    entry_title =gtk_entry_new(); 
-    gtk_entry_set_max_length(GTK_ENTRY(entry_title),100);
-    buffer_title=gtk_entry_buffer_new(m_title,-1); //show  title
-	gtk_entry_set_buffer(GTK_ENTRY(entry_title),buffer_title);
-	
-    label_location =gtk_label_new("Location"); 
-	entry_location =gtk_entry_new(); 
-	gtk_entry_set_max_length(GTK_ENTRY(entry_location),100);
-	buffer_location=gtk_entry_buffer_new(m_location,-1); //show  title
-	gtk_entry_set_buffer(GTK_ENTRY(entry_location),buffer_location);			
-	
+		while(next < busy->len && b[next].start < window_end) {
+			if(b[next].start - cursor >= duration) {
+				TimeSlot slot = { cursor, b[next].start };
+				g_array_append_val(free_slots, slot);
+			}
+			cursor = MAX(cursor, b[next].end);
+			busy_end = MAX(busy_end, b[next].end);
+			next++;
+		}
+		if(window_end - cursor >= duration) {
+			TimeSlot slot = { cursor, window_end };
+			g_array_append_val(free_slots, slot);
+		}
+		if(max_slots > 0 && free_slots->len >= (guint) max_slots) {
+			g_array_set_size(free_slots, max_slots);
+			break;
+		}
+	}
+	g_array_unref(busy);
+	return free_slots;
+}
+
+//"Monday 26-10-2026 09:00 - 10:30"
+static gchar* free_slot_to_string(const TimeSlot *slot)
+{
+	const char *weekdays[] = {"Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", "Sunday"};
+	guint32 jd = slot->start / 1440;
+	int start = slot->start % 1440;
+	int end = slot->end - (gint64) jd * 1440;
+	int day, month, year;
+	dmy_from_julian(jd, &day, &month, &year);
+	return g_strdup_printf("%s %d-%d-%d %02d:%02d - %02d:%02d", weekdays[weekday_from_julian(jd) - 1],
+	day, month, year, start / 60, start % 60, end / 60, end % 60);
+}
+
+//---------------------------------------------------------------------
+// search index
+//---------------------------------------------------------------------
+// Inverted index of byte trigrams over the lower case title and location.
+// Each field is prefixed with a space so a two letter query can use the
+// word start trigram " xy" and match the beginning of words.
+// Each trigram maps to a posting list of event ids kept sorted so lists
+// can be intersected by merging, starting from the shortest.
+// Candidates are verified with a substring match and ranked title prefix,
+// title word, title, then location, nearest date first. The index is
+// built on the first search after loading and then kept up to date by
+// db_add_event, db_update_event and db_delete_event.
+
+typedef struct {
+	gchar *key; //lower case " title\n location"
+	int title_len;
+	gchar *label; //display text
+	guint32 jd; //event date
+	int calendar; //hidden calendars are left out of results
+} SearchDoc;
+
+typedef struct {
+	int id;
+	int score; //lower is better
+	guint32 distance; //days from today
+} SearchHit;
+
+static GHashTable *m_search_postings=NULL; //trigram -> GArray of ids
+static GPtrArray *m_search_docs=NULL; //SearchDoc indexed by event id
+static gboolean m_search_valid=FALSE;
+
+static void search_doc_free(gpointer data)
+{
+	SearchDoc *doc = data;
+	if(doc==NULL) return; //removed events leave empty slots
+	g_free(doc->key);
+	g_free(doc->label);
+	g_free(doc);
+}
+
+static guint32 search_trigram(const gchar *s)
+{
+	return ((guint32)(guchar) s[0] << 16) | ((guint32)(guchar) s[1] << 8) | (guchar) s[2];
+}
+
+//position of id in a sorted posting list or where it would be inserted
+static guint search_position(GArray *ids, int id)
+{
+	guint low = 0;
+	guint high = ids->len;
+	while(low < high) {
+		guint mid = (low + high) / 2;
+		if(g_array_index(ids, int, mid) < id) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+
+static void search_index_init()
+{
+	if(m_search_docs) return;
+	m_search_postings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+	m_search_docs = g_ptr_array_new_with_free_func(search_doc_free);
+}
+
+static SearchDoc* search_doc_lookup(int id)
+{
+	if(m_search_docs==NULL || id < 0 || (guint) id >= m_search_docs->len) return NULL;
+	return g_ptr_array_index(m_search_docs, id);
+}
+
+static void search_index_remove(int id)
+{
+	if(!m_search_valid) return;
+	SearchDoc *doc = search_doc_lookup(id);
+	if(doc==NULL) return;
+	int len = strlen(doc->key);
+	for(int i=0; i + 3 <= len; i++) {
+		GArray *ids = g_hash_table_lookup(m_search_postings, GUINT_TO_POINTER(search_trigram(doc->key + i)));
+		if(ids==NULL) continue;
+		guint pos = search_position(ids, id);
+		if(pos < ids->len && g_array_index(ids, int, pos)==id) g_array_remove_index(ids, pos);
+		if(ids->len==0) g_hash_table_remove(m_search_postings, GUINT_TO_POINTER(search_trigram(doc->key + i)));
+	}
+	search_doc_free(doc);
+	g_ptr_array_index(m_search_docs, id) = NULL;
+}
+
+static void search_index_add(int calendar, const Event *e)
+{
+	if(!m_search_valid) return;
+	search_index_remove(e->id);
+	
+	SearchDoc *doc = g_new(SearchDoc, 1);
+	gchar *title = g_utf8_strdown(e->title, -1);
+	gchar *location = g_utf8_strdown(e->location, -1);
+	doc->key = g_strdup_printf(" %s\n %s", title, location);
+	doc->title_len = strlen(title) + 1;
+	g_free(title);
+	g_free(location);
+	if(strlen(e->location) > 0) doc->label = g_strdup_printf("%d-%d-%d %s (%s)", e->day, e->month, e->year, e->title, e->location);
+	else doc->label = g_strdup_printf("%d-%d-%d %s", e->day, e->month, e->year, e->title);
+	doc->jd = julian_from_dmy(e->day, e->month, e->year);
+	doc->calendar = calendar;
+	if((guint) e->id >= m_search_docs->len) g_ptr_array_set_size(m_search_docs, e->id + 1);
+	g_ptr_array_index(m_search_docs, e->id) = doc;
+	
+	int len = strlen(doc->key);
+	for(int i=0; i + 3 <= len; i++) {
+		guint32 trigram = search_trigram(doc->key + i);
+		GArray *ids = g_hash_table_lookup(m_search_postings, GUINT_TO_POINTER(trigram));
+		if(ids==NULL) {
+			ids = g_array_new(FALSE, FALSE, sizeof(int));
+			g_hash_table_insert(m_search_postings, GUINT_TO_POINTER(trigram), ids);
+		}
+		guint pos = search_position(ids, e->id);
+		if(pos < ids->len && g_array_index(ids, int, pos)==e->id) continue; //repeated trigram
+		g_array_insert_val(ids, pos, e->id);
+	}
+}
+
+//drop the index, it is rebuilt by the next search
+static void search_index_invalidate()
+{
+	search_index_init();
+	g_hash_table_remove_all(m_search_postings);
+	g_ptr_array_set_size(m_search_docs, 0);
+	m_search_valid=FALSE;
+}
+
+//free the index while no window is open, the next search rebuilds it
+static void search_index_release()
+{
+	if(m_search_docs==NULL) return;
+	g_hash_table_unref(m_search_postings);
+	g_ptr_array_unref(m_search_docs);
+	m_search_postings=NULL;
+	m_search_docs=NULL;
+	m_search_valid=FALSE;
+}
+
+//bulk build, calendars are merged in id order so postings are appends
+static void search_index_rebuild()
+{
+	db_load_all_years();
+	search_index_invalidate();
+	m_search_valid=TRUE;
+	int next[NUM_CALENDARS] = {0};
+	for(;;) {
+		int calendar=-1;
+		for(int c=0; c<NUM_CALENDARS; c++) {
+			if(next[c]==m_calendars[c].size) continue;
+			if(calendar<0 || m_calendars[c].events[next[c]].id < m_calendars[calendar].events[next[calendar]].id) calendar=c;
+		}
+		if(calendar<0) break;
+		search_index_add(calendar, &m_calendars[calendar].events[next[calendar]]);
+		next[calendar]++;
+	}
+}
+
+static int compare_search_hit(gconstpointer a, gconstpointer b)
+{
+	const SearchHit *hit_a = a;
+	const SearchHit *hit_b = b;
+	if(hit_a->score != hit_b->score) return hit_a->score - hit_b->score;
+	if(hit_a->distance != hit_b->distance) return (hit_a->distance > hit_b->distance) - (hit_a->distance < hit_b->distance);
+	return hit_a->id - hit_b->id;
+}
+
+static int compare_posting_length(gconstpointer a, gconstpointer b)
+{
+	GArray *ids_a = *(GArray**) a;
+	GArray *ids_b = *(GArray**) b;
+	return (int) ids_a->len - (int) ids_b->len;
+}
+
+//rank a document against a lower case query (-1 = no match)
+static int search_score(const SearchDoc *doc, const gchar *query)
+{
+	const gchar *match = strstr(doc->key, query);
+	if(match==NULL) return -1;
+	int pos = match - doc->key;
+	if(pos >= doc->title_len) return 3;
+	if(pos==1) return 0;
+	if(!g_ascii_isalnum(doc->key[pos - 1])) return 1;
+	//a later match may still start a word
+	while((match = strstr(match + 1, query)) != NULL && match - doc->key < doc->title_len) {
+		if(!g_ascii_isalnum(match[-1])) return 1;
+	}
+	return 2;
+}
+
+static void search_add_hit(GArray *hits, int id, const SearchDoc *doc, const gchar *query, guint32 today)
+{
+	if(!calendar_is_visible(doc->calendar)) return;
+	int score = search_score(doc, query);
+	if(score < 0) return;
+	SearchHit hit;
+	hit.id = id;
+	hit.score = score;
+	hit.distance = doc->jd > today ? doc->jd - today : today - doc->jd;
+	g_array_append_val(hits, hit);
+}
+
+//ranked matches for text, *total is set to the number of matches before
+//the result is cut to max_results, caller frees the array
+static GArray* search_events(const gchar *text, int max_results, int *total)
+{
+	if(!m_search_valid) search_index_rebuild();
+	GArray *hits = g_array_new(FALSE, FALSE, sizeof(SearchHit));
+	*total = 0;
+	gchar *query = g_strstrip(g_utf8_strdown(text, -1));
+	if(strlen(query) < 2 || strchr(query, '\n')) {
+		g_free(query);
+		return hits;
+	}
+	//two letters only match word starts
+	gchar *trigrams = strlen(query)==2 ? g_strdup_printf(" %s", query) : g_strdup(query);
+	int len = strlen(trigrams);
+	
+	GDate *current_date = g_date_new();
+	g_date_set_time_t(current_date, time(NULL));
+	guint32 today = g_date_get_julian(current_date);
+	g_date_free(current_date);
+	
+	GArray *lists = g_array_new(FALSE, FALSE, sizeof(GArray*));
+	gboolean missing = FALSE;
+	for(int i=0; i + 3 <= len && !missing; i++) {
+		GArray *ids = g_hash_table_lookup(m_search_postings, GUINT_TO_POINTER(search_trigram(trigrams + i)));
+		if(ids==NULL) missing = TRUE;
+		else g_array_append_val(lists, ids);
+	}
+	if(!missing) {
+		//merge the sorted lists starting from the shortest
+		g_array_sort(lists, compare_posting_length);
+		GArray *shortest = g_array_index(lists, GArray*, 0);
+		GArray *candidates = g_array_sized_new(FALSE, FALSE, sizeof(int), shortest->len);
+		g_array_append_vals(candidates, shortest->data, shortest->len);
+		for(guint j=1; j<lists->len && candidates->len > 0; j++) {
+			GArray *ids = g_array_index(lists, GArray*, j);
+			int *c = (int*) candidates->data;
+			guint kept = 0;
+			guint pos = 0;
+			for(guint i=0; i<candidates->len; i++) {
+				while(pos < ids->len && g_array_index(ids, int, pos) < c[i]) pos++;
+				if(pos < ids->len && g_array_index(ids, int, pos)==c[i]) c[kept++] = c[i];
+			}
+			g_array_set_size(candidates, kept);
+		}
+		for(guint i=0; i<candidates->len; i++) {
+			int id = g_array_index(candidates, int, i);
+			search_add_hit(hits, id, search_doc_lookup(id), query, today);
+		}
+		g_array_unref(candidates);
+	}
+	g_array_unref(lists);
+	g_free(trigrams);
+	g_free(query);
+	
+	g_array_sort(hits, compare_search_hit);
+	*total = hits->len;
+	if(max_results > 0 && hits->len > (guint) max_results) g_array_set_size(hits, max_results);
+	return hits;
+}
+
+//---------------------------------------------------------------------
+// calculate easter
+//---------------------------------------------------------------------
+
+GDate* calculate_easter(gint year) {
+
+	GDate *edate;
 	
-	 gtk_box_append(GTK_BOX(box), label_date);
-     gtk_box_append(GTK_BOX(box), label_entry_title);
-     gtk_box_append(GTK_BOX(box), entry_title);
-     gtk_box_append(GTK_BOX(box), label_location);
-     gtk_box_append(GTK_BOX(box), entry_location);
-     
-  g_object_set_data(G_OBJECT(dialog), "entry-title-key",entry_title);
-  g_object_set_data(G_OBJECT(dialog), "entry-location-key",entry_location);
-  g_object_set_data(G_OBJECT(dialog), "dialog-window-key",window); 
+	gint Yr = year;
+    gint a = Yr % 19;
+    gint b = Yr / 100;
+    gint c = Yr % 100;
+    gint d = b / 4;
+    gint e = b % 4;
+    gint f = (b + 8) / 25;
+    gint g = (b - f + 1) / 3;
+    gint h = (19 * a + b - d - g + 15) % 30;
+    gint i = c / 4;
+    gint k = c % 4;
+    gint L = (32 + 2 * e + 2 * i - h - k) % 7;
+    gint m = (a + 11 * h + 22 * L) / 451;
+    gint month = (h + L - 7 * m + 114) / 31;
+    gint day = ((h + L - 7 * m + 114) % 31) + 1;	
+	edate = g_date_new_dmy(day, month, year);
+
+	return edate;
+}
+
+//--------------------------------------------------------------------
+// new event
+//---------------------------------------------------------------------
+
+static void callbk_check_button_allday_toggled (GtkCheckButton *check_button, gpointer user_data)
+{
+ 	
+ 	GtkWidget *spin_button_start_time; 	
+ 	GtkWidget *spin_button_end_time;
+ 	
+ 	spin_button_start_time =g_object_get_data(G_OBJECT(user_data), "cb_allday_spin_start_time_key");	
+	spin_button_end_time= g_object_get_data(G_OBJECT(user_data), "cb_allday_spin_end_time_key");
 	
+ 	if (gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button))){
+	gtk_widget_set_sensitive(spin_button_start_time,FALSE);	
+	gtk_widget_set_sensitive(spin_button_end_time,FALSE);
+	}     
+	else{
+	gtk_widget_set_sensitive(spin_button_start_time,TRUE);	
+	gtk_widget_set_sensitive(spin_button_end_time,TRUE);
 	
-  //start time spin
-  GtkAdjustment *adjustment_start;
-  //value,lower,upper,step_increment,page_increment,page_size
-  adjustment_start = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
-  //start time spin
-  label_start_time =gtk_label_new("Start Time (24 hour) "); 
-  spin_button_start_time = gtk_spin_button_new (adjustment_start, 1.0, 2); 
-  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_button_start_time),e.start_time);	 
-  box_start_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
-  gtk_box_append (GTK_BOX(box_start_time),label_start_time);
-  gtk_box_append (GTK_BOX(box_start_time),spin_button_start_time);  
-  gtk_box_append(GTK_BOX(box), box_start_time);
-  g_object_set_data(G_OBJECT(dialog), "spin-start-time-key",spin_button_start_time); 
+	}
   
-  //end time spin
-   GtkAdjustment *adjustment_end;
+}
+
+//--------------------------------------------------------------------
+// days and repeat widgets (shared by new and edit event dialogs)
+//---------------------------------------------------------------------
+
+static void add_days_widget(GtkWidget *dialog, GtkWidget *box, const Event *e)
+{
+  GtkWidget *label_days;
+  GtkWidget *spin_button_days;
+  GtkWidget *box_days;
+  
+  int days=1;
+  if(e!=NULL) {
+  days=event_span_days(e) + 1;
+  if(!e->is_allday && e->end_time<e->start_time && days>1) days=days-1; //overnight
+  }
+  
+  GtkAdjustment *adjustment_days;
   //value,lower,upper,step_increment,page_increment,page_size
-  adjustment_end = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
-  label_end_time =gtk_label_new("End Time (24 hour) ");
-  spin_button_end_time = gtk_spin_button_new (adjustment_end, 1.0, 2); 
-  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_button_end_time),e.end_time);	 
-  box_end_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
-  gtk_box_append (GTK_BOX(box_end_time),label_end_time);
-  gtk_box_append (GTK_BOX(box_end_time),spin_button_end_time);  
-  gtk_box_append(GTK_BOX(box), box_end_time);
-  g_object_set_data(G_OBJECT(dialog), "spin-end-time-key",spin_button_end_time);  
+  adjustment_days = gtk_adjustment_new (days, 1.0, 366.0, 1.0, 7.0, 0.0);
+  label_days =gtk_label_new("Number of Days ");
+  spin_button_days = gtk_spin_button_new (adjustment_days, 1.0, 0);
+  box_days=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_days),label_days);
+  gtk_box_append (GTK_BOX(box_days),spin_button_days);
+  gtk_box_append(GTK_BOX(box), box_days);
+  g_object_set_data(G_OBJECT(dialog), "spin-days-key",spin_button_days);
+}
+
+//sets the end date, an end time before the start time runs past midnight
+static void read_days_widget(GtkDialog *dialog, Event *event)
+{
+	GtkWidget *spin_button_days= g_object_get_data(G_OBJECT(dialog), "spin-days-key");
+	int days=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_days));
+	if(!event->is_allday && event->end_time<event->start_time) days=days+1;
+	
+	guint32 start=julian_from_dmy(event->day, event->month, event->year);
+	event->end_date=(days>1) ? start + days - 1 : 0;
+}
+
+static void add_repeat_widgets(GtkWidget *dialog, GtkWidget *box, const Event *e)
+{
+  GtkWidget *label_repeat;
+  GtkWidget *dropdown_repeat;
+  GtkWidget *box_repeat;
+  GtkWidget *label_interval;
+  GtkWidget *spin_button_interval;
+  GtkWidget *box_interval;
+  GtkWidget *label_count;
+  GtkWidget *spin_button_count;
+  GtkWidget *box_count;
+  GtkWidget *label_until;
+  GtkWidget *entry_until;
+  GtkWidget *box_until;
   
+  const char *repeat_options[] = {"Never", "Daily", "Weekly", "Monthly (same day)",
+	  "Monthly (same weekday)", "Yearly", NULL};
   
-  //check buttons 
-  check_button_allday = gtk_check_button_new_with_label ("Is All Day");
-  gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_allday), e.is_allday);  
+  label_repeat =gtk_label_new("Repeat ");
+  dropdown_repeat =gtk_drop_down_new_from_strings(repeat_options);
+  box_repeat=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_repeat),label_repeat);
+  gtk_box_append (GTK_BOX(box_repeat),dropdown_repeat);
+  gtk_box_append(GTK_BOX(box), box_repeat);
   
-  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_start_time_key",spin_button_start_time);
-  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_end_time_key",spin_button_end_time); 
+  GtkAdjustment *adjustment_interval;
+  //value,lower,upper,step_increment,page_increment,page_size
+  adjustment_interval = gtk_adjustment_new (1.0, 1.0, 99.0, 1.0, 1.0, 0.0);
+  label_interval =gtk_label_new("Repeat Every ");
+  spin_button_interval = gtk_spin_button_new (adjustment_interval, 1.0, 0);
+  box_interval=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_interval),label_interval);
+  gtk_box_append (GTK_BOX(box_interval),spin_button_interval);
+  gtk_box_append(GTK_BOX(box), box_interval);
   
-  g_signal_connect_swapped (GTK_CHECK_BUTTON(check_button_allday), "toggled", 
-  G_CALLBACK (callbk_check_button_allday_toggled), check_button_allday);
+  GtkAdjustment *adjustment_count;
+  adjustment_count = gtk_adjustment_new (0.0, 0.0, 999.0, 1.0, 10.0, 0.0);
+  label_count =gtk_label_new("Occurrences (0 no limit) ");
+  spin_button_count = gtk_spin_button_new (adjustment_count, 1.0, 0);
+  box_count=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_count),label_count);
+  gtk_box_append (GTK_BOX(box_count),spin_button_count);
+  gtk_box_append(GTK_BOX(box), box_count);
   
-  if(e.is_allday) {
-  gtk_widget_set_sensitive(spin_button_start_time,FALSE);	   
-  gtk_widget_set_sensitive(spin_button_end_time,FALSE);	    
+  label_until =gtk_label_new("Until (YYYY-MM-DD) ");
+  entry_until =gtk_entry_new();
+  gtk_entry_set_max_length(GTK_ENTRY(entry_until),10);
+  box_until=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_until),label_until);
+  gtk_box_append (GTK_BOX(box_until),entry_until);
+  gtk_box_append(GTK_BOX(box), box_until);
+  
+  if(e!=NULL) {
+  gtk_drop_down_set_selected(GTK_DROP_DOWN(dropdown_repeat), e->recur_freq);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_button_interval), MAX(e->recur_interval,1));
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_button_count), e->recur_count);
+  if(e->recur_until) {
+  int day, month, year;
+  dmy_from_julian(e->recur_until, &day, &month, &year);
+  gchar *until_str = g_strdup_printf("%04d-%02d-%02d", year, month, day);
+  GtkEntryBuffer *buffer_until=gtk_entry_buffer_new(until_str,-1);
+  gtk_entry_set_buffer(GTK_ENTRY(entry_until),buffer_until);
+  g_free(until_str);
   }
-  else {
-  gtk_widget_set_sensitive(spin_button_start_time,TRUE);		
-  gtk_widget_set_sensitive(spin_button_end_time,TRUE);		
   }
-    
-  check_button_isyearly = gtk_check_button_new_with_label("Is Yearly");
-  check_button_priority = gtk_check_button_new_with_label ("Is High Priority");
-  gtk_box_append(GTK_BOX(box), check_button_allday);
-  gtk_box_append(GTK_BOX(box), check_button_isyearly);
-  gtk_box_append(GTK_BOX(box), check_button_priority);
-  
-  gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_isyearly), e.is_yearly);
+  
+  g_object_set_data(G_OBJECT(dialog), "dropdown-repeat-key",dropdown_repeat);
+  g_object_set_data(G_OBJECT(dialog), "spin-interval-key",spin_button_interval);
+  g_object_set_data(G_OBJECT(dialog), "spin-count-key",spin_button_count);
+  g_object_set_data(G_OBJECT(dialog), "entry-until-key",entry_until);
+}
+
+static void read_repeat_widgets(GtkDialog *dialog, Event *event)
+{
+	GtkWidget *dropdown_repeat= g_object_get_data(G_OBJECT(dialog), "dropdown-repeat-key");
+	GtkWidget *spin_button_interval= g_object_get_data(G_OBJECT(dialog), "spin-interval-key");
+	GtkWidget *spin_button_count= g_object_get_data(G_OBJECT(dialog), "spin-count-key");
+	GtkWidget *entry_until= g_object_get_data(G_OBJECT(dialog), "entry-until-key");
+	
+	int freq =gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown_repeat));
+	if(freq!=RECUR_WEEKLY || event->recur_freq!=RECUR_WEEKLY) {
+		event->recur_weekdays=0; //weekday mask only kept for an unchanged weekly rule
+	}
+	if(freq!=event->recur_freq) event->num_exdates=0;
+	
+	event->recur_freq=freq;
+	event->recur_interval=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_interval));
+	event->recur_count=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_count));
+	event->is_yearly=(freq==RECUR_YEARLY && event->recur_interval==1);
+	
+	GtkEntryBuffer *buffer_until = gtk_entry_get_buffer (GTK_ENTRY(entry_until));
+	const char *until_str = gtk_entry_buffer_get_text (buffer_until);
+	int year=0, month=0, day=0;
+	event->recur_until=0;
+	if(sscanf(until_str, "%d-%d-%d", &year, &month, &day)==3) {
+		event->recur_until=julian_from_dmy(day, month, year);
+	}
+}
+
+static void callbk_new_event_response(GtkDialog *dialog, gint response_id,  gpointer  user_data)
+{
+	
+	if(!GTK_IS_DIALOG(dialog)) { 
+	//g_print("New Event Response: not a dialog\n");	
+	return;
+	}
+	
+	
+	GtkWidget *window = user_data;
+	
+	GtkEntryBuffer *buffer_title; 	
+	GtkWidget *entry_title = g_object_get_data(G_OBJECT(dialog), "entry-title-key");
+	GtkEntryBuffer *buffer_location; 
+	GtkWidget *entry_location = g_object_get_data(G_OBJECT(dialog), "entry-location-key");
+	
+	  
+	GtkWidget *spin_button_start_time= g_object_get_data(G_OBJECT(dialog), "spin-start-time-key");  
+    GtkWidget *spin_button_end_time= g_object_get_data(G_OBJECT(dialog), "spin-end-time-key");       
+   
+	GtkWidget *check_button_allday= g_object_get_data(G_OBJECT(dialog), "check-button-allday-key"); 
+    GtkWidget *check_button_priority= g_object_get_data(G_OBJECT(dialog), "check-button-priority-key");
+    GtkWidget *dropdown_calendar= g_object_get_data(G_OBJECT(dialog), "dropdown-calendar-key");
+		
+	
+	if(response_id==GTK_RESPONSE_OK)
+	{
+	
+	//set data
+	buffer_title = gtk_entry_get_buffer (GTK_ENTRY(entry_title));	
+	m_title= gtk_entry_buffer_get_text (buffer_title);		
+	buffer_location = gtk_entry_get_buffer (GTK_ENTRY(entry_location));	
+	m_location= gtk_entry_buffer_get_text (buffer_location);
+	int fd;
+	Event event;
+	memset(&event, 0, sizeof(Event));
+	csv_copy_text(event.title, sizeof(event.title), m_title);
+	csv_copy_text(event.location, sizeof(event.location), m_location);
+	event.year=m_year;
+	event.month=m_month;
+	event.day=m_day;
+	//float start_time, end_time;
+	m_start_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_start_time));
+	m_end_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_end_time));
+		
+	event.start_time=m_start_time;
+	event.end_time=m_end_time;
+    
+	event.is_allday=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_allday));
+	event.priority=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_priority));
+	read_days_widget(dialog, &event);
+	read_repeat_widgets(dialog, &event);
+	
+	m_calendar=gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown_calendar));
+	int id=db_add_event(m_calendar, &event);
+	update_calendar(GTK_WINDOW(window));
+	update_store(m_year,m_month,m_day);
+	m_id_selection=-1;			
+	warn_event_conflicts(GTK_WINDOW(window), id);
+	}		
+	gtk_window_destroy(GTK_WINDOW(dialog));	
+}
+
+
+static void callbk_new_event(GtkButton *button, gpointer  user_data){
+ 
+  GtkWidget *window =user_data;
+  
+  GtkWidget *dialog;  
+  gint response; 
+  GtkWidget *grid; 
+  GtkWidget *box;  
+  GtkWidget *label_date;  
+  GtkEntryBuffer *buffer; 
+  GtkWidget *label_entry_title; 
+  GtkWidget *entry_title;
+  
+  GtkWidget *label_location; 
+  GtkWidget *entry_location;		
+  
+  GtkWidget *label_calendar;
+  GtkWidget *dropdown_calendar;
+  GtkWidget *box_calendar;
+ 
+  //Start time
+  GtkWidget *label_start_time;  
+  GtkWidget *spin_button_start_time;  
+  GtkWidget *box_start_time;
+  
+  //End time
+  GtkWidget *label_end_time;  
+  GtkWidget *spin_button_end_time; 
+  GtkWidget *box_end_time;
+  
+  
+  //Check buttons
+  GtkWidget *check_button_allday;	
+  GtkWidget *check_button_priority;
+
+  GDate *event_date; 
+  event_date = g_date_new();
+  event_date = g_date_new_dmy(m_day,m_month,m_year);
+  int event_day= g_date_get_day(event_date);
+  int event_month= g_date_get_month(event_date);
+  int event_year= g_date_get_year(event_date);
+  
+  gchar * date_str="Event Date: ";
+  gchar *day_str = g_strdup_printf("%d",event_day); 
+  gchar *month_str = g_strdup_printf("%d",event_month); 
+  gchar *year_str = g_strdup_printf("%d",event_year);
+  
+  date_str =g_strconcat(date_str,day_str,"-",month_str,"-",year_str,NULL); 
+  
+  dialog = gtk_dialog_new_with_buttons ("New Event", GTK_WINDOW(window),   
+  GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT|GTK_DIALOG_USE_HEADER_BAR,
+  "OK", GTK_RESPONSE_OK, "Cancel", GTK_RESPONSE_CANCEL, NULL);
+  
+  gtk_window_set_title (GTK_WINDOW (dialog), "New Event");
+  gtk_window_set_default_size(GTK_WINDOW(dialog),350,100);  
+  
+  box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+  gtk_window_set_child (GTK_WINDOW (dialog), box);
+    
+  label_date =gtk_label_new(date_str);  
+  
+  label_entry_title =gtk_label_new("Event Title"); 
+  entry_title =gtk_entry_new(); 
+  gtk_entry_set_max_length(GTK_ENTRY(entry_title),100);
+  
+  label_location =gtk_label_new("Location"); 
+  entry_location =gtk_entry_new(); 
+  gtk_entry_set_max_length(GTK_ENTRY(entry_location),100);
+  
+  
+  gtk_box_append(GTK_BOX(box), label_date);
+  gtk_box_append(GTK_BOX(box), label_entry_title);
+  gtk_box_append(GTK_BOX(box), entry_title);
+  gtk_box_append(GTK_BOX(box), label_location);
+  gtk_box_append(GTK_BOX(box), entry_location);
+  
+  label_calendar =gtk_label_new("Calendar ");
+  dropdown_calendar =gtk_drop_down_new_from_strings(get_calendar_names());
+  gtk_drop_down_set_selected(GTK_DROP_DOWN(dropdown_calendar), m_calendar);
+  box_calendar=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_calendar),label_calendar);
+  gtk_box_append (GTK_BOX(box_calendar),dropdown_calendar);
+  gtk_box_append(GTK_BOX(box), box_calendar);
+     
+  g_object_set_data(G_OBJECT(dialog), "entry-title-key",entry_title);
+  g_object_set_data(G_OBJECT(dialog), "entry-location-key",entry_location);
+  g_object_set_data(G_OBJECT(dialog), "dropdown-calendar-key",dropdown_calendar);
+  g_object_set_data(G_OBJECT(dialog), "dialog-window-key",window); 
+ 
+  //--------------------------------------------------------
+  // Start time spin buttons
+  //--------------------------------------------------------- 
+   
+  GtkAdjustment *adjustment_start;
+  //value,lower,upper,step_increment,page_increment,page_size
+  adjustment_start = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
+  //start time spin
+  label_start_time =gtk_label_new("Start Time (24 hour) "); 
+  spin_button_start_time = gtk_spin_button_new (adjustment_start, 1.0, 2);  
+  box_start_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_start_time),label_start_time);
+  gtk_box_append (GTK_BOX(box_start_time),spin_button_start_time);  
+  gtk_box_append(GTK_BOX(box), box_start_time);
+  g_object_set_data(G_OBJECT(dialog), "spin-start-time-key",spin_button_start_time); 
+  
+  //end time spin
+   GtkAdjustment *adjustment_end;
+  //value,lower,upper,step_increment,page_increment,page_size
+  adjustment_end = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
+  label_end_time =gtk_label_new("End Time (24 hour) ");
+  spin_button_end_time = gtk_spin_button_new (adjustment_end, 1.0, 2);  
+  box_end_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_end_time),label_end_time);
+  gtk_box_append (GTK_BOX(box_end_time),spin_button_end_time);  
+  gtk_box_append(GTK_BOX(box), box_end_time);
+  g_object_set_data(G_OBJECT(dialog), "spin-end-time-key",spin_button_end_time);   
+  
+  //check buttons 
+  check_button_allday = gtk_check_button_new_with_label ("Is All Day");  
+  
+  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_start_time_key",spin_button_start_time);
+  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_end_time_key",spin_button_end_time); 
+
+  g_signal_connect_swapped (GTK_CHECK_BUTTON(check_button_allday), "toggled", 
+					G_CALLBACK (callbk_check_button_allday_toggled), check_button_allday);
+    
+  check_button_priority = gtk_check_button_new_with_label ("Is High Priority");
+  gtk_box_append(GTK_BOX(box), check_button_allday);
+  gtk_box_append(GTK_BOX(box), check_button_priority);
+  
+  g_object_set_data(G_OBJECT(dialog), "check-button-allday-key",check_button_allday);
+  g_object_set_data(G_OBJECT(dialog), "check-button-priority-key",check_button_priority);
+  
+  add_days_widget(dialog, box, NULL);
+  add_repeat_widgets(dialog, box, NULL);
+  
+
+    GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	
+	// get GtkStyleContext from widget
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	//finally load style provider 
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
+	//gtk_widget_show(dialog);	  
+   
+  
+  g_signal_connect (dialog, "response", G_CALLBACK (callbk_new_event_response),window);
+  
+  gtk_window_present (GTK_WINDOW (dialog)); 
+  
+}
+//----------------------------------------------------------------------
+// Edit event
+//----------------------------------------------------------------------
+
+void callbk_edit_event_response(GtkDialog *dialog, gint response_id,  gpointer  user_data)
+{
+	  
+  
+	
+	
+	if(!GTK_IS_DIALOG(dialog)) { 
+	g_print("New Event Response: not a dialog\n");	
+	return;
+	}
+		
+	GtkWidget *window = user_data;	
+	GtkEntryBuffer *buffer_title; 	
+	GtkWidget *entry_title = g_object_get_data(G_OBJECT(dialog), "entry-title-key");
+	GtkEntryBuffer *buffer_location; 
+	GtkWidget *entry_location = g_object_get_data(G_OBJECT(dialog), "entry-location-key");
+	
+	GtkWidget *spin_button_start_time= g_object_get_data(G_OBJECT(dialog), "spin-start-time-key");  
+    GtkWidget *spin_button_end_time= g_object_get_data(G_OBJECT(dialog), "spin-end-time-key");       
+    
+    GtkWidget *check_button_allday= g_object_get_data(G_OBJECT(dialog), "check-button-allday-key"); 
+    GtkWidget  *check_button_priority= g_object_get_data(G_OBJECT(dialog), "check-button-priority-key");
+	
+			
+	if(response_id==GTK_RESPONSE_OK)
+	{
+	
+	//set data
+	buffer_title = gtk_entry_get_buffer (GTK_ENTRY(entry_title));	
+	m_title= gtk_entry_buffer_get_text (buffer_title);	
+		buffer_location = gtk_entry_get_buffer (GTK_ENTRY(entry_location));	
+	m_location= gtk_entry_buffer_get_text (buffer_location);	
+		
+	//insert cahnge into database	
+	Event event;
+	Event *found=db_find_event(m_id_selection);
+	if(found!=NULL){
+	event=*found;
+	
+	csv_copy_text(event.title, sizeof(event.title), m_title);
+	csv_copy_text(event.location, sizeof(event.location), m_location);
+	if(!event_is_recurring(found)) {
+	event.year=m_year;
+	event.month=m_month;
+	event.day=m_day;	
+	} //a series keeps its first date
+	//float start_time, end_time;
+	m_start_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_start_time));
+	m_end_time =gtk_spin_button_get_value (GTK_SPIN_BUTTON(spin_button_end_time));		
+		
+	event.start_time=m_start_time;
+	event.end_time=m_end_time;
+	
+	//GTK_IS_CHECK_BUTTON
+	event.is_allday=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_allday));
+	event.priority=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_priority));	
+	read_days_widget(dialog, &event);
+	read_repeat_widgets(dialog, &event);
+	
+	if(event_is_recurring(found)) {
+	//ask whether to change one occurrence or the series
+	GtkWidget *dialog_series;
+	dialog_series = GTK_WIDGET (gtk_message_dialog_new (GTK_WINDOW(window),
+	                                             GTK_DIALOG_MODAL|
+	                                             GTK_DIALOG_DESTROY_WITH_PARENT|
+	                                             GTK_DIALOG_USE_HEADER_BAR,
+	                                             GTK_MESSAGE_QUESTION,
+	                                             GTK_BUTTONS_NONE,
+	                                             "Edit Repeating Event"));
+	gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog_series),
+	                                          "Change this occurrence or every occurrence?");
+	gtk_dialog_add_buttons (GTK_DIALOG (dialog_series),
+	                        "Cancel", GTK_RESPONSE_CANCEL,
+	                        "This Occurrence", GTK_RESPONSE_YES,
+	                        "All Occurrences", GTK_RESPONSE_OK,
+	                        NULL);
+	
+	GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog_series), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog_series));	
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+	
+	Event *edited=g_new(Event, 1);
+	*edited=event;
+	g_object_set_data_full(G_OBJECT(dialog_series), "event-key", edited, g_free);
+	g_object_set_data(G_OBJECT(dialog_series), "occurrence-key", GUINT_TO_POINTER(julian_from_dmy(m_day, m_month, m_year)));
+	g_signal_connect (dialog_series, "response", G_CALLBACK (callbk_edit_occurrence_response),window);
+	gtk_window_present (GTK_WINDOW (dialog_series));
+	gtk_window_destroy(GTK_WINDOW(dialog));
+	return;
+	}
+	
+	db_update_event(&event);
+	}
+		
+	int id=m_id_selection;
+	update_calendar(GTK_WINDOW(window));
+	update_store(m_year,m_month,m_day);
+	m_row_index=-1;
+	m_id_selection=-1;
+	warn_event_conflicts(GTK_WINDOW(window), id);
+	
+	}
+			
+	gtk_window_destroy(GTK_WINDOW(dialog));	
+}
+
+
+
+
+//----------------------------------------------------------------------
+static void callbk_edit_event(GtkButton *button, gpointer  user_data){
+	
+	
+	if (m_id_selection==-1) return;
+		
+	GtkWindow *window =user_data;
+	
+	GtkWidget *dialog;  
+	gint response; 
+	GtkWidget *grid; 
+	GtkWidget *box;  
+	GtkWidget *label_date;  
+	GtkEntryBuffer *buffer_title; 
+	GtkEntryBuffer *buffer_location; 
+	
+	GtkWidget *label_entry_title; 
+	GtkWidget *entry_title;	
+	
+	GtkWidget *label_location; 
+    GtkWidget *entry_location;	
+	
+	//Start time
+	GtkWidget *label_start_time;
+	GtkWidget *spin_button_start_time;	
+	GtkWidget *box_start_time;
+	
+	//End time
+	GtkWidget *label_end_time;	
+	GtkWidget *spin_button_end_time;	
+	GtkWidget *box_end_time;
+	
+	//Check buttons
+	GtkWidget *check_button_allday;	
+	GtkWidget *check_button_priority;
+	
+	GDate *event_date; 
+	event_date = g_date_new();
+	event_date = g_date_new_dmy(m_day,m_month,m_year);
+	int event_day= g_date_get_day(event_date);
+	int event_month= g_date_get_month(event_date);
+	int event_year= g_date_get_year(event_date);
+	
+	gchar * date_str="Event Date: ";
+	gchar *day_str = g_strdup_printf("%d",event_day); 
+	gchar *month_str = g_strdup_printf("%d",event_month); 
+	gchar *year_str = g_strdup_printf("%d",event_year);
+	
+	date_str =g_strconcat(date_str,day_str,"-",month_str,"-",year_str,NULL); 
+	
+    dialog = gtk_dialog_new_with_buttons ("Edit Event", GTK_WINDOW(window), 
+	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT|GTK_DIALOG_USE_HEADER_BAR,
+	"OK", GTK_RESPONSE_OK, "Cancel", GTK_RESPONSE_CANCEL, NULL);
+	
+	gtk_window_set_title (GTK_WINDOW (dialog), "Edit Event");
+	gtk_window_set_default_size(GTK_WINDOW(dialog),350,100);  
+	
+	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+	gtk_window_set_child (GTK_WINDOW (dialog), box);
+		
+	//find event in database    
+	Event e;
+	Event *found=db_find_event(m_id_selection);
+	if(found!=NULL){
+	e=*found;
+	m_title =e.title;
+	m_location =e.location;
+	if(!event_is_recurring(found)) {
+	m_year=e.year;
+	m_month=e.month;
+	m_day=e.day;
+	} //the selected day is the occurrence being edited
+	}
+	
+	
+	label_date =gtk_label_new(date_str);  
+	
+	label_entry_title =gtk_label_new("Event Title"); 
+    entry_title =gtk_entry_new(); 
+    gtk_entry_set_max_length(GTK_ENTRY(entry_title),100);
+    buffer_title=gtk_entry_buffer_new(m_title,-1); //show  title
+	gtk_entry_set_buffer(GTK_ENTRY(entry_title),buffer_title);
+	
+    label_location =gtk_label_new("Location"); 
+	entry_location =gtk_entry_new(); 
+	gtk_entry_set_max_length(GTK_ENTRY(entry_location),100);
+	buffer_location=gtk_entry_buffer_new(m_location,-1); //show  title
+	gtk_entry_set_buffer(GTK_ENTRY(entry_location),buffer_location);			
+	
+	
+	 gtk_box_append(GTK_BOX(box), label_date);
+     gtk_box_append(GTK_BOX(box), label_entry_title);
+     gtk_box_append(GTK_BOX(box), entry_title);
+     gtk_box_append(GTK_BOX(box), label_location);
+     gtk_box_append(GTK_BOX(box), entry_location);
+     
+  g_object_set_data(G_OBJECT(dialog), "entry-title-key",entry_title);
+  g_object_set_data(G_OBJECT(dialog), "entry-location-key",entry_location);
+  g_object_set_data(G_OBJECT(dialog), "dialog-window-key",window); 
+	
+	
+  //start time spin
+  GtkAdjustment *adjustment_start;
+  //value,lower,upper,step_increment,page_increment,page_size
+  adjustment_start = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
+  //start time spin
+  label_start_time =gtk_label_new("Start Time (24 hour) "); 
+  spin_button_start_time = gtk_spin_button_new (adjustment_start, 1.0, 2); 
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_button_start_time),e.start_time);	 
+  box_start_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_start_time),label_start_time);
+  gtk_box_append (GTK_BOX(box_start_time),spin_button_start_time);  
+  gtk_box_append(GTK_BOX(box), box_start_time);
+  g_object_set_data(G_OBJECT(dialog), "spin-start-time-key",spin_button_start_time); 
+  
+  //end time spin
+   GtkAdjustment *adjustment_end;
+  //value,lower,upper,step_increment,page_increment,page_size
+  adjustment_end = gtk_adjustment_new (8.00, 0.0, 23.59, 1.0, 1.0, 0.0);
+  label_end_time =gtk_label_new("End Time (24 hour) ");
+  spin_button_end_time = gtk_spin_button_new (adjustment_end, 1.0, 2); 
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin_button_end_time),e.end_time);	 
+  box_end_time=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+  gtk_box_append (GTK_BOX(box_end_time),label_end_time);
+  gtk_box_append (GTK_BOX(box_end_time),spin_button_end_time);  
+  gtk_box_append(GTK_BOX(box), box_end_time);
+  g_object_set_data(G_OBJECT(dialog), "spin-end-time-key",spin_button_end_time);  
+  
+  
+  //check buttons 
+  check_button_allday = gtk_check_button_new_with_label ("Is All Day");
+  gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_allday), e.is_allday);  
+  
+  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_start_time_key",spin_button_start_time);
+  g_object_set_data(G_OBJECT(check_button_allday), "cb_allday_spin_end_time_key",spin_button_end_time); 
+  
+  g_signal_connect_swapped (GTK_CHECK_BUTTON(check_button_allday), "toggled", 
+  G_CALLBACK (callbk_check_button_allday_toggled), check_button_allday);
+  
+  if(e.is_allday) {
+  gtk_widget_set_sensitive(spin_button_start_time,FALSE);	   
+  gtk_widget_set_sensitive(spin_button_end_time,FALSE);	    
+  }
+  else {
+  gtk_widget_set_sensitive(spin_button_start_time,TRUE);		
+  gtk_widget_set_sensitive(spin_button_end_time,TRUE);		
+  }
+    
+  check_button_priority = gtk_check_button_new_with_label ("Is High Priority");
+  gtk_box_append(GTK_BOX(box), check_button_allday);
+  gtk_box_append(GTK_BOX(box), check_button_priority);
   
   gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_priority), e.priority);
 	
-  g_object_set_data(G_OBJECT(dialog), "check-button-allday-key",check_button_allday);
-  g_object_set_data(G_OBJECT(dialog), "check-button-isyearly-key",check_button_isyearly);
-  g_object_set_data(G_OBJECT(dialog), "check-button-priority-key",check_button_priority);
-    
-   GtkStyleContext *context_dialog;	
+  g_object_set_data(G_OBJECT(dialog), "check-button-allday-key",check_button_allday);
+  g_object_set_data(G_OBJECT(dialog), "check-button-priority-key",check_button_priority);
+  
+  add_days_widget(dialog, box, &e);
+  add_repeat_widgets(dialog, box, &e);
+    
+   GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	
+	// get GtkStyleContext from widget
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	//finally load style provider 
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
+	//gtk_widget_show(dialog);	    
+  
+  g_signal_connect (dialog, "response", G_CALLBACK (callbk_edit_event_response),window);
+  
+  gtk_window_present (GTK_WINDOW (dialog)); 
+
+}
+ 
+//leave the occurrence on jd out of a series, tells the user when the series is full
+static gboolean series_exclude_date(GtkWindow *window, Event *e, guint32 jd)
+{
+	if(e->num_exdates<MAX_EXDATES) {
+	e->exdates[e->num_exdates]=jd;
+	e->num_exdates=e->num_exdates+1;
+	return TRUE;
+	}
+	
+	GtkWidget *dialog;
+	dialog = GTK_WIDGET (gtk_message_dialog_new (window,
+	                                             GTK_DIALOG_MODAL|
+	                                             GTK_DIALOG_DESTROY_WITH_PARENT,
+	                                             GTK_MESSAGE_ERROR,
+	                                             GTK_BUTTONS_CLOSE,
+	                                             "Too Many Changed Occurrences"));
+	gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog),
+	                                          "A repeating event can have at most %d deleted or changed occurrences. "
+	                                          "Change or delete the whole series instead.", MAX_EXDATES);
+	g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
+	gtk_window_present (GTK_WINDOW (dialog));
+	return FALSE;
+}
+
+static void callbk_edit_occurrence_response(GtkDialog *dialog, gint response_id, gpointer user_data)
+{
+	GtkWindow *window = user_data;
+	Event *event=g_object_get_data(G_OBJECT(dialog), "event-key");
+	guint32 jd=GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(dialog), "occurrence-key"));
+	int id=-1;
+	
+	if(response_id==GTK_RESPONSE_YES)
+	{
+	//the occurrence leaves the series and becomes an event of its own
+	Event *series=db_find_event(event->id);
+	Calendar *cal=db_find_calendar(event->id);
+	if(series!=NULL && series_exclude_date(window, series, jd)) {
+	db_store_changed(cal);
+	Event single=*event;
+	guint32 start=julian_from_dmy(event->day, event->month, event->year);
+	if(single.end_date) single.end_date=jd + (single.end_date - start);
+	dmy_from_julian(jd, &single.day, &single.month, &single.year);
+	single.recur_freq=RECUR_NONE;
+	single.recur_interval=0;
+	single.recur_weekdays=0;
+	single.recur_count=0;
+	single.recur_until=0;
+	single.is_yearly=0;
+	single.num_exdates=0;
+	id=db_add_event(cal - m_calendars, &single);
+	}
+	}
+	else if(response_id==GTK_RESPONSE_OK)
+	{
+	//the whole series, from its first date
+	if(db_update_event(event)) id=event->id;
+	}
+	
+	if(response_id==GTK_RESPONSE_YES || response_id==GTK_RESPONSE_OK)
+	{
+	m_id_selection=-1;
+	m_row_index=-1;
+	update_calendar(GTK_WINDOW(window));
+	update_store(m_year, m_month, m_day);
+	}
+	gtk_window_destroy(GTK_WINDOW(dialog));
+	if(id>=0) warn_event_conflicts(window, id);
+}
+
+static void callbk_delete_occurrence_response(GtkDialog *dialog, gint response_id, gpointer  user_data)
+{
+	GtkWindow *window = user_data;
+	
+	if(response_id==GTK_RESPONSE_YES)
+	{
+	//delete this occurrence only
+	Event *e=db_find_event(m_id_selection);
+	if(e!=NULL && series_exclude_date(window, e, julian_from_dmy(m_day, m_month, m_year))) {
+	db_store_changed(db_find_calendar(m_id_selection));
+	}
+	}
+	else if(response_id==GTK_RESPONSE_OK)
+	{
+	//delete the whole series
+	db_delete_event(m_id_selection);
+	}
+	
+	if(response_id==GTK_RESPONSE_YES || response_id==GTK_RESPONSE_OK)
+	{
+	m_id_selection=-1;
+	m_row_index=-1;
+	update_calendar(GTK_WINDOW(window));
+	update_store(m_year, m_month, m_day);
+	}
+	gtk_window_destroy(GTK_WINDOW(dialog));
+}
+
+static void callbk_delete_selected(GtkButton *button, gpointer  user_data){
+		
+	if (m_row_index==-1) return;
+	
+	GtkWindow *window =user_data;
+	
+	Event *e=db_find_event(m_id_selection);
+	if(e==NULL) return;
+	
+	if(event_is_recurring(e))
+	{
+	//ask whether to remove one occurrence or the series
+	GtkWidget *dialog;
+	dialog = GTK_WIDGET (gtk_message_dialog_new (window,
+	                                             GTK_DIALOG_MODAL|
+	                                             GTK_DIALOG_DESTROY_WITH_PARENT|
+	                                             GTK_DIALOG_USE_HEADER_BAR,
+	                                             GTK_MESSAGE_QUESTION,
+	                                             GTK_BUTTONS_NONE,
+	                                             "Delete Repeating Event"));
+	gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog),
+	                                          "Delete this occurrence or every occurrence?");
+	gtk_dialog_add_buttons (GTK_DIALOG (dialog),
+	                        "Cancel", GTK_RESPONSE_CANCEL,
+	                        "This Occurrence", GTK_RESPONSE_YES,
+	                        "All Occurrences", GTK_RESPONSE_OK,
+	                        NULL);
+	
+	GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+	
+	g_signal_connect (dialog, "response", G_CALLBACK (callbk_delete_occurrence_response),window);
+	gtk_window_present (GTK_WINDOW (dialog));
+	return;
+	}
+	
+	//remove event from db  
+	db_delete_event(m_id_selection);
+	m_id_selection=-1;
+	m_row_index=-1;
+	
+	update_calendar(GTK_WINDOW(window));
+	update_store(m_year, m_month, m_day); 
+	
+}
+
+//----------------------------------------------------------------------
+// frame scheduler
+//----------------------------------------------------------------------
+
+// Main thread work that builds widgets or fills models (the month grid,
+// the day's event list, prefetching) is split into resumable steps run
+// from an idle source below input and redraw priority. Each dispatch
+// runs steps for at most FRAME_BUDGET ms, so pending input and the next
+// frame are handled between slices however much work is queued. Urgent
+// work (what the user is looking at) runs before normal work. A step
+// returns TRUE while more remains. The owner keeps a FrameWork pointer
+// that is cleared when the work finishes or is cancelled, and adding work
+// for an owner replaces its unfinished work.
+
+#define FRAME_BUDGET 4 //ms of work between frames
+
+enum {
+	FRAME_URGENT=0,
+	FRAME_NORMAL,
+	FRAME_NUM_PRIORITIES
+};
+
+typedef gboolean (*FrameStep)(gpointer data);
+
+typedef struct _FrameWork FrameWork;
+
+struct _FrameWork {
+	int priority; //FRAME_ class
+	FrameStep step;
+	gpointer data;
+	GDestroyNotify destroy; //data, when finished or cancelled
+	FrameWork **owner; //cleared when finished or cancelled
+	gboolean cancelled; //while its step runs
+};
+
+static GQueue m_frame_queues[FRAME_NUM_PRIORITIES];
+static FrameWork *m_frame_running=NULL; //its step is running
+static guint m_frame_source=0;
+
+static void frame_work_free(FrameWork *work)
+{
+	if(work->owner && *work->owner==work) *work->owner=NULL;
+	if(work->destroy) work->destroy(work->data);
+	g_free(work);
+}
+
+static gboolean callbk_frame_work(gpointer user_data)
+{
+	gint64 start=g_get_monotonic_time();
+	while(g_get_monotonic_time() - start < FRAME_BUDGET * 1000) {
+		FrameWork *work=NULL;
+		for(int p=0; p<FRAME_NUM_PRIORITIES && work==NULL; p++) work=g_queue_pop_head(&m_frame_queues[p]);
+		if(work==NULL) break;
+		m_frame_running=work;
+		gboolean more=work->step(work->data);
+		m_frame_running=NULL;
+		if(more && !work->cancelled) g_queue_push_head(&m_frame_queues[work->priority], work);
+		else frame_work_free(work);
+	}
+	for(int p=0; p<FRAME_NUM_PRIORITIES; p++) {
+		if(!g_queue_is_empty(&m_frame_queues[p])) return G_SOURCE_CONTINUE;
+	}
+	m_frame_source=0;
+	return G_SOURCE_REMOVE;
+}
+
+//drop the owner's unfinished work (safe from its own step)
+static void frame_work_cancel(FrameWork **owner)
+{
+	FrameWork *work=*owner;
+	if(work==NULL) return;
+	*owner=NULL;
+	if(work==m_frame_running) {
+		work->cancelled=TRUE; //freed when the step returns
+		return;
+	}
+	g_queue_remove(&m_frame_queues[work->priority], work);
+	frame_work_free(work);
+}
+
+//run step(data) in slices until it returns FALSE, replacing the owner's work
+static void frame_work_add(int priority, FrameStep step, gpointer data, GDestroyNotify destroy, FrameWork **owner)
+{
+	frame_work_cancel(owner);
+	FrameWork *work=g_new0(FrameWork, 1);
+	work->priority=priority;
+	work->step=step;
+	work->data=data;
+	work->destroy=destroy;
+	work->owner=owner;
+	*owner=work;
+	g_queue_push_tail(&m_frame_queues[priority], work);
+	if(m_frame_source==0) m_frame_source=g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, callbk_frame_work, NULL, NULL);
+}
+
+//----------------------------------------------------------------------
+// store snapshots
+//----------------------------------------------------------------------
+
+// Threads other than the main one (saves, and anything added later) read
+// the events through immutable snapshots instead of the calendars, which
+// the main thread keeps changing. A StoreVersion is a reference counted
+// copy of one calendar's events, and a StoreSnapshot holds the current
+// version of every calendar so unchanged calendars share their copy
+// between snapshots. A change only drops the calendar's version: copies
+// are made when work for another thread is handed out, which calls
+// store_publish to copy the calendars changed since and swap
+// m_store_snapshot, so a burst of edits with no save in between costs
+// no copy. Readers take a reference without any lock
+// (store_snapshot_acquire): while a reader is between loading the pointer
+// and taking its reference m_store_readers is non zero, and the publisher
+// waits for that before dropping the old snapshot. A version is freed by
+// whoever drops its last reference.
+
+static StoreSnapshot *m_store_snapshot=NULL; //published, read atomically
+static gint m_store_readers=0; //readers taking a reference to m_store_snapshot
+
+static void store_snapshot_clear(gpointer data)
+{
+	StoreSnapshot *snapshot=data;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(snapshot->calendars[c]) g_atomic_rc_box_release(snapshot->calendars[c]);
+	}
+}
+
+//any thread: the published snapshot (NULL before the first), release when done
+static StoreSnapshot* store_snapshot_acquire()
+{
+	g_atomic_int_inc(&m_store_readers);
+	StoreSnapshot *snapshot=g_atomic_pointer_get(&m_store_snapshot);
+	if(snapshot) g_atomic_rc_box_acquire(snapshot);
+	g_atomic_int_dec_and_test(&m_store_readers);
+	return snapshot;
+}
+
+static void store_snapshot_release(StoreSnapshot *snapshot)
+{
+	g_atomic_rc_box_release_full(snapshot, store_snapshot_clear);
+}
+
+static void store_version_build(Calendar *cal)
+{
+	cal->version=g_atomic_rc_box_alloc(sizeof(StoreVersion) + cal->size * sizeof(Event));
+	cal->version->size=cal->size;
+	if(cal->size>0) memcpy(cal->version->events, cal->events, cal->size * sizeof(Event));
+}
+
+//swap in a snapshot of the built versions unless it would be the same
+static void store_swap()
+{
+	StoreSnapshot *old=m_store_snapshot; //only written here
+	gboolean changed=(old==NULL);
+	for(int c=0; c<NUM_CALENDARS && !changed; c++) {
+		if(old->calendars[c]!=m_calendars[c].version) changed=TRUE;
+	}
+	if(!changed) return;
+	
+	StoreSnapshot *snapshot=g_atomic_rc_box_new0(StoreSnapshot);
+	for(int c=0; c<NUM_CALENDARS; c++) snapshot->calendars[c]=g_atomic_rc_box_acquire(m_calendars[c].version);
+	snapshot->serial=old ? old->serial + 1 : 1;
+	g_atomic_pointer_set(&m_store_snapshot, snapshot);
+	//a reader may have loaded the old pointer without holding it yet
+	while(g_atomic_int_get(&m_store_readers)>0) g_thread_yield();
+	if(old) store_snapshot_release(old);
+}
+
+//main thread: a version of every calendar that changed, then swap
+static void store_publish()
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(m_calendars[c].version==NULL) store_version_build(&m_calendars[c]);
+	}
+	store_swap();
+}
+
+//main thread: the calendar's events changed, copied by the next publish
+static void store_version_drop(Calendar *cal)
+{
+	if(cal->version) g_atomic_rc_box_release(cal->version);
+	cal->version=NULL;
+}
+
+//at shutdown, readers still holding a snapshot keep it
+static void store_close()
+{
+	StoreSnapshot *old=m_store_snapshot;
+	g_atomic_pointer_set(&m_store_snapshot, NULL);
+	while(g_atomic_int_get(&m_store_readers)>0) g_thread_yield();
+	if(old) store_snapshot_release(old);
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(m_calendars[c].version) g_atomic_rc_box_release(m_calendars[c].version);
+		m_calendars[c].version=NULL;
+	}
+}
+
+//----------------------------------------------------------------------
+// event database
+//----------------------------------------------------------------------
+
+//every change to a calendar goes through here so its derived data is rebuilt
+static void db_store_changed(Calendar *cal)
+{
+	if(cal->series) {
+		g_array_unref(cal->series);
+		cal->series=NULL;
+	}
+	if(cal->month_cache) g_hash_table_remove_all(cal->month_cache);
+	if(cal->index) cal->index->valid=FALSE;
+	prefetch_clear();
+	store_version_drop(cal);
+	agenda_shm_schedule();
+	reminder_schedule();
+	autosave_schedule();
+}
+
+//make room for size records
+static gboolean db_reserve(Calendar *cal, int size)
+{
+	if(size<=cal->capacity) return TRUE;
+	int capacity=MAX(cal->capacity, 256);
+	while(capacity<size) capacity=capacity*2;
+	Event *events=realloc(cal->events, capacity*sizeof(Event));
+	if(events==NULL) {
+		g_print("memory allocation failed -not enough RAM\n");
+		return FALSE;
+	}
+	cal->events=events;
+	cal->capacity=capacity;
+	return TRUE;
+}
+
+//give memory back after many events were dropped
+static void db_shrink(Calendar *cal)
+{
+	int capacity=MAX(cal->capacity, 256);
+	while(capacity>256 && capacity/2>=cal->size*2) capacity=capacity/2;
+	if(capacity>=cal->capacity) return;
+	Event *events=realloc(cal->events, capacity*sizeof(Event));
+	if(events==NULL) return; //keep the larger block
+	cal->events=events;
+	cal->capacity=capacity;
+}
+
+//add events read from a file after the others, numbered in order
+static void db_append_events(Calendar *cal, GArray *events)
+{
+	if(events->len==0 || !db_reserve(cal, cal->size + events->len)) return;
+	for(guint i=0; i<events->len; i++) {
+		Event *e=&g_array_index(events, Event, i);
+		e->id=m_next_id;
+		m_next_id=m_next_id+1;
+		cal->events[cal->size]=*e;
+		cal->size++;
+	}
+	db_store_changed(cal);
+	search_index_invalidate();
+}
+
+static int db_add_event(int calendar, Event *event)
+{
+	Calendar *cal=&m_calendars[calendar];
+	if(!db_reserve(cal, cal->size+1)) return -1;
+	event->id=m_next_id;
+	m_next_id=m_next_id+1;
+	cal->events[cal->size]=*event;
+	cal->size=cal->size+1;
+	db_store_changed(cal);
+	search_index_add(calendar, event);
+	return event->id;
+}
+
+//replace the record with the same id
+static gboolean db_update_event(const Event *event)
+{
+	Calendar *cal=db_find_calendar(event->id);
+	if(cal==NULL) return FALSE;
+	*db_find_event(event->id)=*event;
+	db_store_changed(cal);
+	search_index_add(cal - m_calendars, event);
+	return TRUE;
+}
+
+//records stay in id order: ids ascend on load and add, deletes keep order
+static Event* calendar_find_event(const Calendar *cal, int id)
+{
+	int low=0;
+	int high=cal->size-1;
+	while(low<=high) {
+		int mid=(low+high)/2;
+		if(cal->events[mid].id==id) return &cal->events[mid];
+		if(cal->events[mid].id<id) low=mid+1;
+		else high=mid-1;
+	}
+	return NULL;
+}
+
+//calendar holding the event with id (NULL if none)
+static Calendar* db_find_calendar(int id)
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(calendar_find_event(&m_calendars[c], id)) return &m_calendars[c];
+	}
+	return NULL;
+}
+
+static Event* db_find_event(int id)
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Event *e=calendar_find_event(&m_calendars[c], id);
+		if(e) return e;
+	}
+	return NULL;
+}
+
+static gboolean db_delete_event(int id)
+{
+	Calendar *cal=db_find_calendar(id);
+	if(cal==NULL) return FALSE;
+	Event *e=calendar_find_event(cal, id);
+	memmove(e, e + 1, (cal->events + cal->size - (e + 1)) * sizeof(Event));
+	cal->size=cal->size-1;
+	db_store_changed(cal);
+	search_index_remove(id);
+	return TRUE;
+}
+
+//remove every event of a calendar (the file is emptied on save)
+static void db_clear_calendar(Calendar *cal)
+{
+	cal->size=0;
+	segments_clear(cal);
+	db_store_changed(cal);
+	search_index_invalidate();
+}
+
+//events (including recurring occurrences) on a date, caller frees the array
+//recurring events are returned as copies moved to the occurrence date
+static GArray* get_day_events(int year, int month, int day)
+{
+	GArray *day_events = g_array_new(FALSE, FALSE, sizeof(Event));
+	guint32 jd=julian_from_dmy(day, month, year);
+	if(jd==0) return day_events;
+	
+	GArray *occurrences=query_range(jd, jd);
+	for(guint i=0; i<occurrences->len; i++) {
+		Occurrence *o=&g_array_index(occurrences, Occurrence, i);
+		Event e=*occurrence_event(o);
+		if(event_is_recurring(&e)) event_move_to(&e, o->jd);
+		g_array_append_val(day_events, e);
+	}
+	g_array_unref(occurrences);
+	return day_events;
+}
+
+typedef struct {
+	guint32 jd; //day listed under
+	guint32 start_jd; //day the occurrence starts
+	const Event *event;
+	int order; //position in the merged query result
+} AgendaEntry;
+
+static int compare_agenda_entry(gconstpointer a, gconstpointer b)
+{
+	const AgendaEntry *entry_a = a;
+	const AgendaEntry *entry_b = b;
+	if(entry_a->jd != entry_b->jd) return (entry_a->jd > entry_b->jd) - (entry_a->jd < entry_b->jd);
+	//continued events first, the rest are in start order already
+	int continued_a = entry_a->start_jd < entry_a->jd;
+	int continued_b = entry_b->start_jd < entry_b->jd;
+	if(continued_a != continued_b) return continued_b - continued_a;
+	return entry_a->order - entry_b->order;
+}
+
+//events from jd_from to jd_to sorted by day, multi-day events are listed
+//on each day they cover (one query for the whole range), caller frees
+//query_range merges the calendars in start order (all day events start at
+//midnight) so only days covered by multi-day events need sorting
+static GArray* get_agenda(guint32 jd_from, guint32 jd_to)
+{
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(AgendaEntry));
+	GArray *occurrences = query_range(jd_from, jd_to);
+	gboolean sorted = TRUE;
+	for(guint i=0; i<occurrences->len; i++) {
+		Occurrence *o = &g_array_index(occurrences, Occurrence, i);
+		const Event *e = occurrence_event(o);
+		guint32 last = o->jd + event_span_days(e);
+		if(last > o->jd || o->jd < jd_from) sorted = FALSE;
+		for(guint32 jd=MAX(o->jd, jd_from); jd<=MIN(last, jd_to); jd++) {
+			AgendaEntry entry = { jd, o->jd, e, i };
+			g_array_append_val(entries, entry);
+		}
+	}
+	g_array_unref(occurrences);
+	if(!sorted) g_array_sort(entries, compare_agenda_entry);
+	return entries;
+}
+
+//----------------------------------------------------------------------
+// flat csv database functions
+//----------------------------------------------------------------------
+
+// A calendar file starts with a "#generation,<n>" line counting the saves
+// made by any process. Files are written to a temporary file and renamed,
+// so readers map either the old or the new file and take no lock. Writers
+// hold an exclusive flock on a .<file>.lock file while they check the
+// generation, merge in the rows another process saved since this one last
+// read the file (see external changes) and write generation + 1.
+// Saves are written on a thread, see background saves.
+
+#define CSV_HEADER "#generation,"
+
+int break_fields(char *s, char** data, int n)
+{
+	//n = number of fields
+	//assumes comma delimiter
+	//fields point into s (commas are overwritten) so nothing is allocated
+	
+	int fields=0;
+	int i;
+	char *start=s; //start at begiining of string
+	char *end=s; //walking pointer
+	
+	for(i=0; i<n; i++)
+	{
+		while(*end !=',' && *end != '\0') {
+			end++;			
+		}
+		
+		if(*end =='\0') {
+			
+			data[i]=start;
+			fields++;
+			break;
+		}
+		else if (*end ==',') {
+			*end ='\0';
+			data[i]=start;
+			start=end+1;
+			end=start;
+			fields++;
+		}
+		
+	}
+		
+	return fields;
+	
+} 
+
+static guint32 julian_from_yyyymmdd(int value)
+{
+	if(value<=0) return 0;
+	return julian_from_dmy(value % 100, (value / 100) % 100, value / 10000);
+}
+
+static int yyyymmdd_from_julian(guint32 jd)
+{
+	if(jd==0) return 0;
+	int day, month, year;
+	dmy_from_julian(jd, &day, &month, &year);
+	return year * 10000 + month * 100 + day;
+}
+
+//exception dates are stored as yyyymmdd values separated by ';'
+static void parse_exdates(Event *e, const char *str)
+{
+	gchar **tokens = g_strsplit(str, ";", MAX_EXDATES);
+	for(int i=0; tokens[i]!=NULL && e->num_exdates<MAX_EXDATES; i++) {
+		guint32 jd = julian_from_yyyymmdd(atoi(tokens[i]));
+		if(jd) {
+			e->exdates[e->num_exdates] = jd;
+			e->num_exdates++;
+		}
+	}
+	g_strfreev(tokens);
+}
+
+static gchar* exdates_to_string(const Event *e)
+{
+	GString *str = g_string_new("");
+	for(int i=0; i<e->num_exdates; i++) {
+		if(i>0) g_string_append_c(str, ';');
+		g_string_append_printf(str, "%d", yyyymmdd_from_julian(e->exdates[i]));
+	}
+	return g_string_free(str, FALSE);
+}
+
+//fill e from one events.csv line (fields are split in place), FALSE if blank
+static gboolean csv_parse_record(char *line, Event *e)
+{
+	int field_num =18;
+	char *data[field_num]; // fields
+	if(*line=='\0' || *line=='#') return FALSE; //blank or header
+	
+	int ret=break_fields(line,data,field_num);
+	memset(e, 0, sizeof(Event));
+	
+	for (int j=0; j<ret;j++) {
+		
+		//j==0 is the id, assigned when the record is added to the store
+		if (j==1) g_strlcpy(e->title,data[j],sizeof(e->title));
+		if (j==2) g_strlcpy(e->location,data[j],sizeof(e->location));
+		if (j==3) e->year=atoi(data[j]);
+		if (j==4) e->month=atoi(data[j]);
+		if (j==5) e->day=atoi(data[j]);				          
+		          
+		if (j==6) e->start_time=atof(data[j]);
+		if (j==7) e->end_time=atof(data[j]);          
+		
+		if (j==8) e->priority=atoi(data[j]);
+		if (j==9) e->is_yearly=atoi(data[j]);
+		if (j==10) e->is_allday=atoi(data[j]);
+		
+		//recurrence fields (absent in older files)
+		if (j==11) e->recur_freq=atoi(data[j]);
+		if (j==12) e->recur_interval=atoi(data[j]);
+		if (j==13) e->recur_weekdays=atoi(data[j]);
+		if (j==14) e->recur_count=atoi(data[j]);
+		if (j==15) e->recur_until=julian_from_yyyymmdd(atoi(data[j]));
+		if (j==16) parse_exdates(e, data[j]);
+		if (j==17) e->end_date=julian_from_yyyymmdd(atoi(data[j]));
+	}
+	
+	if (e->is_yearly && e->recur_freq==RECUR_NONE) e->recur_freq=RECUR_YEARLY;
+	return TRUE;
+}
+
+//generation in a csv header line, 0 if data does not start with one
+static guint64 csv_header_generation(const gchar *data, gsize length)
+{
+	gsize prefix=strlen(CSV_HEADER);
+	if(length<=prefix || strncmp(data, CSV_HEADER, prefix)!=0) return 0;
+	if(memchr(data, '\n', MIN(length, 64))==NULL) return 0;
+	return g_ascii_strtoull(data + prefix, NULL, 10);
+}
+
+static guint64 csv_file_generation(const char *file_name)
+{
+	char line[64];
+	guint64 generation=0;
+	FILE *file=fopen(file_name, "r");
+	if(file==NULL) return 0;
+	if(fgets(line, sizeof(line), file)) generation=csv_header_generation(line, strlen(line));
+	fclose(file);
+	return generation;
+}
+
+//exclusive lock for writing a calendar file, -1 if it cannot be taken
+static int calendar_lock(const Calendar *cal)
+{
+	gchar *lock_name=g_strdup_printf(".%s.lock", cal->file_name);
+	int fd=open(lock_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	g_free(lock_name);
+	if(fd<0) return -1;
+	while(flock(fd, LOCK_EX)<0) {
+		if(errno==EINTR) continue;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void calendar_unlock(int fd)
+{
+	if(fd<0) return;
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+void load_csv_file(){
+	//parsed in chunks on a thread pool (see parallel import)
+	int this_year=current_year();
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		ImportResult result;
+		if(file_exists(cal->file_name)) {
+			if(import_file(cal->file_name, IMPORT_CSV, c, DUPLICATES_UNCHECKED, &result)) {
+				cal->file_generation=result.generation;
+				if(!m_headless) calendar_file_synced(cal); //for the file watcher
+			}
+			else g_print("error: unable to open database %s\n", cal->file_name);
+		}
+		segments_open(cal, this_year); //older years stay on disk
+	}
+}
+
+//user text into a record field, commas and line breaks would split
+//the csv record so they are replaced
+static void csv_copy_text(gchar *dest, gsize size, const gchar *text)
+{
+	g_strlcpy(dest, text, size);
+	const gchar *end;
+	if(!g_utf8_validate(dest, -1, &end)) dest[end - dest]='\0'; //cut inside a character
+	for(gchar *p=dest; *p!='\0'; p++) {
+		if(*p==',') *p=';';
+		if(*p=='\r' || *p=='\n') *p=' ';
+	}
+}
+
+//one events.csv line
+static gboolean csv_put_record(GDataOutputStream *data_stream, const Event *event)
+{
+	char *line="";  
+	Event e;
+	e=*event;     
+	//g_print("Save CSV: e.id =%d e.title =%s date =%d-%d-%d\n",e.id,e.title,e.day,e.month,e.year);
+	
+	gchar *id_str = g_strdup_printf("%d", e.id); 
+	gchar *year_str = g_strdup_printf("%d", e.year); 
+	gchar *month_str = g_strdup_printf("%d", e.month);
+	gchar *day_str = g_strdup_printf("%d", e.day); 
+	
+	gchar *starttime_str = g_strdup_printf("%0.2f", e.start_time); 
+	gchar *endtime_str = g_strdup_printf("%0.2f", e.end_time);
+	
+	gchar *priority_str = g_strdup_printf("%d", e.priority); 
+	gchar *isyearly_str = g_strdup_printf("%d", e.is_yearly); 
+	gchar *isallday_str = g_strdup_printf("%d", e.is_allday); 
+	
+	gchar *recur_str = g_strdup_printf("%d,%d,%d,%d,%d", e.recur_freq, e.recur_interval,
+	e.recur_weekdays, e.recur_count, yyyymmdd_from_julian(e.recur_until));
+	gchar *exdates_str = exdates_to_string(&e);
+	gchar *enddate_str = g_strdup_printf("%d", yyyymmdd_from_julian(e.end_date));
+	
+	line =g_strconcat(line,
+	id_str,",",
+	e.title,",",
+	e.location,",",
+	year_str,",",
+	month_str,",",
+	day_str,",",
+	starttime_str,",",
+	endtime_str,",",	
+	priority_str,",",
+	isyearly_str,",",
+	isallday_str,",",
+	recur_str,",",
+	exdates_str,",",
+	enddate_str,",",
+	"\n", NULL);
+	
+	gboolean written = g_data_output_stream_put_string (data_stream, line, NULL, NULL);
+	
+	g_free(id_str);
+	g_free(year_str);
+	g_free(month_str);
+	g_free(day_str);
+	g_free(starttime_str);
+	g_free(endtime_str);
+	g_free(priority_str);
+	g_free(isyearly_str);
+	g_free(isallday_str);
+	g_free(recur_str);
+	g_free(exdates_str);
+	g_free(enddate_str);
+	g_free(line);
+	return written;
+}
+
+//replace file_name with the header lines and rows (Event pointers)
+static gboolean csv_write_file(const gchar *file_name, guint64 generation, const gchar *summary, GPtrArray *rows)
+{
+	GFile *file;
+	GFileOutputStream *file_stream;
+	GDataOutputStream *data_stream;
+	
+	file = g_file_new_for_path (file_name);
+	file_stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL);
+	
+	if (file_stream == NULL) {
+		g_object_unref (file);
+		g_print("error: unable to open abd save database file %s\n", file_name);
+		return FALSE;
+	}
+
+	data_stream = g_data_output_stream_new (G_OUTPUT_STREAM (file_stream));
+	
+	gchar *header = g_strdup_printf("%s%" G_GUINT64_FORMAT "\n", CSV_HEADER, generation);
+	gboolean written = g_data_output_stream_put_string (data_stream, header, NULL, NULL);
+	g_free(header);
+	if(written && summary) written = g_data_output_stream_put_string (data_stream, summary, NULL, NULL);
+	
+	for (guint i=0; written && i<rows->len; i++) written = csv_put_record(data_stream, g_ptr_array_index(rows, i));
+	
+	//the new file is renamed into place on close, a cancelled close
+	//after a failed write (disk full) keeps the old file instead
+	GCancellable *cancellable = g_cancellable_new();
+	if(!written) g_cancellable_cancel(cancellable);
+	gboolean saved = g_output_stream_close (G_OUTPUT_STREAM (data_stream), cancellable, NULL) && written;
+	g_object_unref (cancellable);
+	g_object_unref (data_stream);
+	g_object_unref (file_stream);
+	g_object_unref (file);
+	if(!saved) g_print("error: unable to save database file %s\n", file_name);
+	return saved;
+}
+
+//----------------------------------------------------------------------
+// icalendar import and export
+//----------------------------------------------------------------------
+
+// The importer unfolds one content line at a time from a chunk of the
+// mapped file (lines longer than ICS_MAX_LINE are cut), so no component
+// tree is built and the heap does not grow with the file. Each VEVENT is
+// mapped onto an Event as its properties arrive and appended to the
+// chunk's events at END:VEVENT (see parallel import). Repeat rules the
+// recurrence code cannot express are imported as their first occurrence.
+// The exporter writes each record straight from its calendar, repeating
+// events as one VEVENT with an RRULE.
+
+#define ICS_MAX_LINE 8192 //longer content lines are truncated
+
+static const char *ics_weekdays[] = {"MO", "TU", "WE", "TH", "FR", "SA", "SU"};
+
+typedef struct {
+	const gchar *data;
+	gsize pos;
+	gsize len;
+	GString *line; //current unfolded content line
+} IcsReader;
+
+//VEVENT being read, times are resolved when it ends
+typedef struct {
+	Event event;
+	gboolean has_start;
+	gboolean start_is_date;
+	guint32 start_jd;
+	int start_minutes;
+	gboolean has_end;
+	guint32 end_jd;
+	int end_minutes;
+	gboolean has_duration;
+	gint64 duration; //minutes
+	gchar rrule[256];
+	gchar uid[256];
+	guint32 recurrence_id; //julian day of the occurrence this VEVENT replaces
+	gboolean cancelled;
+} IcsEvent;
+
+//an occurrence replaced or cancelled by a RECURRENCE-ID VEVENT
+typedef struct {
+	gchar *uid;
+	guint32 jd;
+} IcsOverride;
+
+//a repeating event that overrides may refer to
+typedef struct {
+	gchar *uid;
+	int index; //in the chunk's events
+} IcsSeries;
+
+static int ics_peek(IcsReader *r)
+{
+	if(r->pos==r->len) return -1;
+	return (guchar) r->data[r->pos];
+}
+
+//next unfolded content line in r->line, FALSE at the end of the file
+static gboolean ics_read_line(IcsReader *r)
+{
+	g_string_truncate(r->line, 0);
+	int c;
+	while((c=ics_peek(r))!=-1) {
+		r->pos++;
+		if(c=='\r') continue;
+		if(c=='\n') {
+			c=ics_peek(r);
+			if(c==' ' || c=='\t') {
+				r->pos++; //folded, the line continues
+				continue;
+			}
+			if(r->line->len > 0) return TRUE;
+			continue; //blank line
+		}
+		if(r->line->len < ICS_MAX_LINE) g_string_append_c(r->line, c);
+	}
+	return r->line->len > 0;
+}
+
+//split NAME;PARAM=VALUE:value in place, returns the value (NULL if malformed)
+static gchar* ics_split_line(gchar *line, gchar **params)
+{
+	gchar *p=line;
+	*params=NULL;
+	while(*p!='\0' && *p!=';' && *p!=':') p++;
+	if(*p==';') {
+		*p='\0';
+		p++;
+		*params=p;
+		gboolean quoted=FALSE;
+		while(*p!='\0' && (quoted || *p!=':')) {
+			if(*p=='"') quoted=!quoted;
+			p++;
+		}
+	}
+	if(*p!=':') return NULL;
+	*p='\0';
+	return p+1;
+}
+
+//copy the value of parameter name (e.g. TZID) into value
+static gboolean ics_param(const gchar *params, const char *name, gchar *value, gsize size)
+{
+	if(params==NULL) return FALSE;
+	gsize len=strlen(name);
+	const gchar *p=params;
+	while(*p!='\0') {
+		if(g_ascii_strncasecmp(p, name, len)==0 && p[len]=='=') {
+			p=p+len+1;
+			gboolean quoted=(*p=='"');
+			if(quoted) p++;
+			gsize i=0;
+			while(*p!='\0' && (quoted ? *p!='"' : *p!=';')) {
+				if(i+1<size) value[i++]=*p;
+				p++;
+			}
+			value[i]='\0';
+			return TRUE;
+		}
+		gboolean quoted=FALSE;
+		while(*p!='\0' && (quoted || *p!=';')) {
+			if(*p=='"') quoted=!quoted;
+			p++;
+		}
+		if(*p==';') p++;
+	}
+	return FALSE;
+}
+
+//unescape a TEXT value into a record field, commas and line breaks
+//would split the csv record so they are replaced
+static void ics_copy_text(gchar *dest, gsize size, const gchar *value)
+{
+	gsize i=0;
+	for(const gchar *p=value; *p!='\0' && i+1<size; p++) {
+		gchar c=*p;
+		if(c=='\\' && p[1]!='\0') {
+			p++;
+			c=(*p=='n' || *p=='N') ? ' ' : *p;
+		}
+		if(c==',') c=';';
+		if(c=='\r' || c=='\n') c=' ';
+		dest[i++]=c;
+	}
+	dest[i]='\0';
+	const gchar *end;
+	if(!g_utf8_validate(dest, -1, &end)) dest[end - dest]='\0'; //cut inside a character
+}
+
+//DATE or DATE-TIME value as a local julian day and minutes after midnight,
+//UTC and TZID times are converted, floating times are taken as local
+static gboolean ics_parse_date(const gchar *value, const gchar *tzid, guint32 *jd, int *minutes, gboolean *is_date)
+{
+	int year, month, day, hour, minute, second;
+	int n=sscanf(value, "%4d%2d%2dT%2d%2d%2d", &year, &month, &day, &hour, &minute, &second);
+	if(n==3) {
+		*jd=julian_from_dmy(day, month, year);
+		*minutes=0;
+		*is_date=TRUE;
+		return *jd!=0;
+	}
+	if(n!=6 || hour>23 || minute>59) return FALSE;
+	*is_date=FALSE;
+	
+	GTimeZone *tz=NULL;
+	if(strlen(value)>15 && value[15]=='Z') tz=g_time_zone_new_utc();
+	else if(tzid!=NULL && tzid[0]!='\0') tz=g_time_zone_new_identifier(tzid); //NULL if unknown
+	if(tz) {
+		GDateTime *date_time=g_date_time_new(tz, year, month, day, hour, minute, second);
+		g_time_zone_unref(tz);
+		if(date_time==NULL) return FALSE;
+		GDateTime *local=g_date_time_to_local(date_time);
+		g_date_time_get_ymd(local, &year, &month, &day);
+		hour=g_date_time_get_hour(local);
+		minute=g_date_time_get_minute(local);
+		g_date_time_unref(local);
+		g_date_time_unref(date_time);
+	}
+	*jd=julian_from_dmy(day, month, year);
+	*minutes=hour * 60 + minute;
+	return *jd!=0;
+}
+
+//DURATION value such as P1D, PT1H30M or P2W in minutes
+static gboolean ics_parse_duration(const gchar *value, gint64 *minutes)
+{
+	const gchar *p=value;
+	int sign=1;
+	if(*p=='+' || *p=='-') {
+		if(*p=='-') sign=-1;
+		p++;
+	}
+	if(*p!='P') return FALSE;
+	p++;
+	gint64 total=0;
+	while(*p!='\0') {
+		if(*p=='T') {
+			p++;
+			continue;
+		}
+		gchar *end;
+		gint64 n=g_ascii_strtoll(p, &end, 10);
+		if(end==p) return FALSE;
+		switch(*end) {
+		case 'W': total=total + n * 7 * 1440; break;
+		case 'D': total=total + n * 1440; break;
+		case 'H': total=total + n * 60; break;
+		case 'M': total=total + n; break;
+		case 'S': total=total + n / 60; break;
+		default: return FALSE;
+		}
+		p=end+1;
+	}
+	*minutes=sign * total;
+	return TRUE;
+}
+
+//map an RRULE onto the recurrence fields of e (start date already set),
+//FALSE if the rule cannot be expressed
+static gboolean ics_parse_rrule(const gchar *value, Event *e)
+{
+	int freq=RECUR_NONE;
+	int weekdays=0;
+	int nth=0;
+	int num_byday=0;
+	int bymonth=0;
+	int bymonthday=0;
+	gboolean supported=TRUE;
+	
+	gchar **parts=g_strsplit(value, ";", -1);
+	for(int i=0; parts[i]!=NULL; i++) {
+		gchar *key=parts[i];
+		gchar *val=strchr(key, '=');
+		if(val==NULL) continue;
+		*val='\0';
+		val++;
+		if(g_ascii_strcasecmp(key, "FREQ")==0) {
+			if(g_ascii_strcasecmp(val, "DAILY")==0) freq=RECUR_DAILY;
+			else if(g_ascii_strcasecmp(val, "WEEKLY")==0) freq=RECUR_WEEKLY;
+			else if(g_ascii_strcasecmp(val, "MONTHLY")==0) freq=RECUR_MONTHLY;
+			else if(g_ascii_strcasecmp(val, "YEARLY")==0) freq=RECUR_YEARLY;
+			else supported=FALSE; //hourly and shorter
+		}
+		else if(g_ascii_strcasecmp(key, "INTERVAL")==0) e->recur_interval=atoi(val);
+		else if(g_ascii_strcasecmp(key, "COUNT")==0) e->recur_count=atoi(val);
+		else if(g_ascii_strcasecmp(key, "UNTIL")==0) {
+			int minutes;
+			gboolean is_date;
+			if(!ics_parse_date(val, NULL, &e->recur_until, &minutes, &is_date)) supported=FALSE;
+		}
+		else if(g_ascii_strcasecmp(key, "BYDAY")==0) {
+			gchar **days=g_strsplit(val, ",", -1);
+			for(int j=0; days[j]!=NULL; j++) {
+				gchar *weekday;
+				int n=(int) g_ascii_strtoll(days[j], &weekday, 10);
+				int k=0;
+				while(k<7 && g_ascii_strcasecmp(weekday, ics_weekdays[k])!=0) k++;
+				if(k==7) supported=FALSE;
+				else weekdays=weekdays | (1 << k);
+				if(n) nth=n;
+				num_byday++;
+			}
+			g_strfreev(days);
+		}
+		else if(g_ascii_strcasecmp(key, "BYMONTH")==0) {
+			if(strchr(val, ',')) supported=FALSE;
+			bymonth=atoi(val);
+		}
+		else if(g_ascii_strcasecmp(key, "BYMONTHDAY")==0) {
+			if(strchr(val, ',')) supported=FALSE;
+			bymonthday=atoi(val);
+		}
+		else if(g_ascii_strcasecmp(key, "WKST")!=0) supported=FALSE; //BYSETPOS, BYWEEKNO etc.
+	}
+	g_strfreev(parts);
+	
+	if(e->recur_interval<1) e->recur_interval=1;
+	if(bymonth && bymonth!=e->month) supported=FALSE;
+	if(bymonthday && bymonthday!=e->day) supported=FALSE;
+	
+	//an nth weekday rule must pick the start date the way recur_period_date does
+	int start_weekday=weekday_from_julian(julian_from_dmy(e->day, e->month, e->year));
+	int start_nth=(e->day - 1) / 7 + 1;
+	gboolean nth_matches=(num_byday==1 && weekdays==(1 << (start_weekday - 1))
+	&& (nth==start_nth || (nth==-1 && start_nth==5)));
+	
+	switch(freq) {
+	case RECUR_DAILY:
+		if(num_byday) supported=FALSE;
+		break;
+	case RECUR_WEEKLY:
+		if(nth) supported=FALSE;
+		e->recur_weekdays=weekdays;
+		break;
+	case RECUR_MONTHLY:
+		if(num_byday) {
+			if(!nth_matches || bymonthday) supported=FALSE;
+			freq=RECUR_MONTHLY_WEEKDAY;
+		}
+		break;
+	case RECUR_YEARLY:
+		if(num_byday) {
+			//e.g. fourth Thursday of November: same weekday every 12 months
+			if(!nth_matches || bymonthday) supported=FALSE;
+			freq=RECUR_MONTHLY_WEEKDAY;
+			e->recur_interval=e->recur_interval * 12;
+		}
+		break;
+	default:
+		supported=FALSE;
+	}
+	e->recur_freq=freq;
+	e->is_yearly=(freq==RECUR_YEARLY && e->recur_interval==1);
+	return supported;
+}
+
+static void ics_event_property(IcsEvent *ie, const gchar *name, const gchar *params, gchar *value)
+{
+	Event *e=&ie->event;
+	gchar tzid[64]="";
+	ics_param(params, "TZID", tzid, sizeof(tzid));
+	gboolean is_date;
+	int minutes;
+	
+	if(g_ascii_strcasecmp(name, "SUMMARY")==0) ics_copy_text(e->title, sizeof(e->title), value);
+	else if(g_ascii_strcasecmp(name, "LOCATION")==0) ics_copy_text(e->location, sizeof(e->location), value);
+	else if(g_ascii_strcasecmp(name, "DTSTART")==0) {
+		ie->has_start=ics_parse_date(value, tzid, &ie->start_jd, &ie->start_minutes, &ie->start_is_date);
+	}
+	else if(g_ascii_strcasecmp(name, "DTEND")==0) {
+		ie->has_end=ics_parse_date(value, tzid, &ie->end_jd, &ie->end_minutes, &is_date);
+	}
+	else if(g_ascii_strcasecmp(name, "DURATION")==0) {
+		ie->has_duration=ics_parse_duration(value, &ie->duration);
+	}
+	else if(g_ascii_strcasecmp(name, "RRULE")==0) g_strlcpy(ie->rrule, value, sizeof(ie->rrule));
+	else if(g_ascii_strcasecmp(name, "EXDATE")==0) {
+		gchar **dates=g_strsplit(value, ",", -1);
+		for(int i=0; dates[i]!=NULL && e->num_exdates<MAX_EXDATES; i++) {
+			guint32 jd;
+			if(ics_parse_date(dates[i], tzid, &jd, &minutes, &is_date)) {
+				e->exdates[e->num_exdates]=jd;
+				e->num_exdates++;
+			}
+		}
+		g_strfreev(dates);
+	}
+	else if(g_ascii_strcasecmp(name, "RECURRENCE-ID")==0) {
+		if(!ics_parse_date(value, tzid, &ie->recurrence_id, &minutes, &is_date)) ie->recurrence_id=0;
+	}
+	else if(g_ascii_strcasecmp(name, "UID")==0) g_strlcpy(ie->uid, value, sizeof(ie->uid));
+	else if(g_ascii_strcasecmp(name, "PRIORITY")==0) {
+		int priority=atoi(value);
+		e->priority=(priority>=1 && priority<=4); //1-4 high, 5 medium, 6-9 low
+	}
+	else if(g_ascii_strcasecmp(name, "STATUS")==0) {
+		ie->cancelled=(g_ascii_strcasecmp(value, "CANCELLED")==0);
+	}
+}
+
+//append the finished VEVENT to events
+static void ics_finish_event(IcsEvent *ie, GArray *events, GArray *series, GArray *overrides, ImportResult *result)
+{
+	Event *e=&ie->event;
+	
+	if(ie->recurrence_id && ie->uid[0]!='\0') {
+		//remove the occurrence from the series, a replacement is a single event
+		IcsOverride override={g_strdup(ie->uid), ie->recurrence_id};
+		g_array_append_val(overrides, override);
+		ie->rrule[0]='\0';
+		e->num_exdates=0;
+		if(ie->cancelled) return;
+	}
+	if(ie->cancelled || !ie->has_start) {
+		result->skipped++;
+		return;
+	}
+	
+	dmy_from_julian(ie->start_jd, &e->day, &e->month, &e->year);
+	if(e->title[0]=='\0') g_strlcpy(e->title, "(no title)", sizeof(e->title));
+	
+	gint64 start=(gint64) ie->start_jd * 1440 + ie->start_minutes;
+	gint64 end=start;
+	if(ie->has_end) end=(gint64) ie->end_jd * 1440 + ie->end_minutes;
+	else if(ie->has_duration) end=start + ie->duration;
+	else if(ie->start_is_date) end=start + 1440;
+	if(end<start) end=start;
+	
+	if(ie->start_is_date) {
+		e->is_allday=1;
+		guint32 last_day=(end > start) ? (guint32) ((end - 1) / 1440) : ie->start_jd; //DTEND is exclusive
+		if(last_day > ie->start_jd) e->end_date=last_day;
+	}
+	else {
+		e->start_time=ie->start_minutes / 60 + (ie->start_minutes % 60) / 100.0;
+		guint32 end_jd=(guint32) (end / 1440);
+		int end_minutes=(int) (end % 1440);
+		e->end_time=end_minutes / 60 + (end_minutes % 60) / 100.0;
+		if(end_jd > ie->start_jd) e->end_date=end_jd;
+	}
+	
+	if(ie->rrule[0]!='\0') {
+		if(ics_parse_rrule(ie->rrule, e)) {
+			if(ie->uid[0]!='\0') {
+				IcsSeries entry={g_strdup(ie->uid), events->len};
+				g_array_append_val(series, entry);
+			}
+		}
+		else {
+			e->recur_freq=RECUR_NONE;
+			e->recur_interval=0;
+			e->recur_weekdays=0;
+			e->recur_count=0;
+			e->recur_until=0;
+			e->is_yearly=0;
+			result->simplified++;
+		}
+	}
+	if(!event_is_recurring(e)) e->num_exdates=0;
+	g_array_append_vals(events, e, 1);
+	result->imported++;
+}
+
+//parse the VEVENTs of one chunk of a .ics file, chunks are split at
+//BEGIN:VEVENT lines so every VEVENT is read by one worker
+//parse a chunk, stopping early when task (may be NULL) is cancelled
+static void ics_parse_chunk(struct _Task *task, const gchar *data, gsize size, GArray *events, GArray *series, GArray *overrides, ImportResult *result)
+{
+	IcsReader reader={data, 0, size, g_string_sized_new(256)};
+	IcsEvent *ie=g_new0(IcsEvent, 1);
+	gboolean in_event=FALSE;
+	int depth=0; //components nested in the VEVENT (VALARM)
+	
+	while(ics_read_line(&reader)) {
+		gchar *params;
+		gchar *name=reader.line->str;
+		gchar *value=ics_split_line(name, &params);
+		if(value==NULL) continue;
+		
+		if(g_ascii_strcasecmp(name, "BEGIN")==0) {
+			if(in_event) depth++;
+			else if(g_ascii_strcasecmp(value, "VEVENT")==0) {
+				memset(ie, 0, sizeof(IcsEvent));
+				in_event=TRUE;
+				depth=0;
+			}
+			continue;
+		}
+		if(!in_event) continue;
+		if(g_ascii_strcasecmp(name, "END")==0) {
+			if(depth>0) depth--;
+			else {
+				in_event=FALSE;
+				ics_finish_event(ie, events, series, overrides, result);
+				if(task && events->len % 256==0 && task_is_cancelled(task)) break;
+			}
+			continue;
+		}
+		if(depth==0) ics_event_property(ie, name, params, value);
+	}
+	
+	g_free(ie);
+	g_string_free(reader.line, TRUE);
+}
+
+//append a content line folded at 75 octets without splitting characters
+static void ics_fold_line(GString *out, const gchar *line)
+{
+	gsize len=strlen(line);
+	gsize column=0;
+	gsize i=0;
+	while(i<len) {
+		gsize n=g_utf8_skip[(guchar) line[i]];
+		if(i+n>len) n=len-i;
+		if(column+n>75) {
+			g_string_append(out, "\r\n ");
+			column=1;
+		}
+		g_string_append_len(out, line+i, n);
+		column=column+n;
+		i=i+n;
+	}
+	g_string_append(out, "\r\n");
+}
+
+static void ics_append_text(GString *line, const gchar *text)
+{
+	for(const gchar *p=text; *p!='\0'; p++) {
+		if(*p=='\\' || *p==';' || *p==',') g_string_append_c(line, '\\');
+		if(*p=='\n') g_string_append(line, "\\n");
+		else g_string_append_c(line, *p);
+	}
+}
+
+static void ics_append_date(GString *line, guint32 jd)
+{
+	int day, month, year;
+	dmy_from_julian(jd, &day, &month, &year);
+	g_string_append_printf(line, "%04d%02d%02d", year, month, day);
+}
+
+//one VEVENT, times are floating (local) as stored
+static void ics_append_event(GString *out, GString *line, const Event *e, const gchar *stamp)
+{
+	guint32 jd=julian_from_dmy(e->day, e->month, e->year);
+	if(jd==0) return;
+	gint64 start, end;
+	event_interval(e, jd, &start, &end);
+	int start_minutes=minutes_from_time(e->start_time);
+	
+	g_string_append(out, "BEGIN:VEVENT\r\n");
+	g_string_append_printf(out, "UID:%d-%04d%02d%02d@talkcalendar\r\n", e->id, e->year, e->month, e->day);
+	g_string_append_printf(out, "DTSTAMP:%s\r\n", stamp);
+	if(e->is_allday) {
+		g_string_append_printf(out, "DTSTART;VALUE=DATE:%04d%02d%02d\r\n", e->year, e->month, e->day);
+		g_string_append(out, "DTEND;VALUE=DATE:");
+		ics_append_date(out, (guint32) (end / 1440));
+		g_string_append(out, "\r\n");
+	}
+	else {
+		g_string_append_printf(out, "DTSTART:%04d%02d%02dT%02d%02d00\r\n", e->year, e->month, e->day,
+		start_minutes / 60, start_minutes % 60);
+		if(end > start + 1) {
+			g_string_append(out, "DTEND:");
+			ics_append_date(out, (guint32) (end / 1440));
+			g_string_append_printf(out, "T%02d%02d00\r\n", (int) (end % 1440) / 60, (int) (end % 1440) % 60);
+		}
+	}
+	
+	if(event_is_recurring(e)) {
+		const char *freq_names[] = {"", "DAILY", "WEEKLY", "MONTHLY", "MONTHLY", "YEARLY"};
+		g_string_assign(line, "RRULE:FREQ=");
+		g_string_append(line, freq_names[e->recur_freq]);
+		if(e->recur_interval>1) g_string_append_printf(line, ";INTERVAL=%d", e->recur_interval);
+		if(e->recur_freq==RECUR_WEEKLY && e->recur_weekdays) {
+			g_string_append(line, ";BYDAY=");
+			for(int k=0, n=0; k<7; k++) {
+				if(!(e->recur_weekdays & (1 << k))) continue;
+				g_string_append_printf(line, "%s%s", n ? "," : "", ics_weekdays[k]);
+				n++;
+			}
+		}
+		if(e->recur_freq==RECUR_MONTHLY_WEEKDAY) {
+			int nth=(e->day - 1) / 7 + 1;
+			g_string_append_printf(line, ";BYDAY=%d%s", nth==5 ? -1 : nth, ics_weekdays[weekday_from_julian(jd) - 1]);
+		}
+		if(e->recur_count) g_string_append_printf(line, ";COUNT=%d", e->recur_count);
+		else if(e->recur_until) {
+			g_string_append(line, ";UNTIL=");
+			ics_append_date(line, e->recur_until);
+			if(!e->is_allday) g_string_append(line, "T235959"); //same value type as DTSTART
+		}
+		ics_fold_line(out, line->str);
+		
+		if(e->num_exdates) {
+			g_string_assign(line, e->is_allday ? "EXDATE;VALUE=DATE:" : "EXDATE:");
+			for(int i=0; i<e->num_exdates; i++) {
+				if(i) g_string_append_c(line, ',');
+				ics_append_date(line, e->exdates[i]);
+				if(!e->is_allday) g_string_append_printf(line, "T%02d%02d00", start_minutes / 60, start_minutes % 60);
+			}
+			ics_fold_line(out, line->str);
+		}
+	}
+	
+	g_string_assign(line, "SUMMARY:");
+	ics_append_text(line, e->title);
+	ics_fold_line(out, line->str);
+	if(e->location[0]!='\0') {
+		g_string_assign(line, "LOCATION:");
+		ics_append_text(line, e->location);
+		ics_fold_line(out, line->str);
+	}
+	if(e->priority) g_string_append(out, "PRIORITY:1\r\n");
+	g_string_append(out, "END:VEVENT\r\n");
+}
+
+//write the records of the visible calendars to file as they are
+//formatted, FALSE on a write error
+static gboolean ics_export_file(FILE *file)
+{
+	GDateTime *now=g_date_time_new_now_utc();
+	gchar *stamp=g_date_time_format(now, "%Y%m%dT%H%M%SZ");
+	g_date_time_unref(now);
+	db_load_all_years();
+	
+	GString *out=g_string_sized_new(1024);
+	GString *line=g_string_sized_new(256);
+	g_string_append(out, "BEGIN:VCALENDAR\r\nVERSION:2.0\r\n");
+	g_string_append(out, "PRODID:-//Talk Calendar//Talk Calendar Gtk4//EN\r\nCALSCALE:GREGORIAN\r\n");
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(!calendar_is_visible(c)) continue;
+		for(int i=0; i<m_calendars[c].size; i++) {
+			ics_append_event(out, line, &m_calendars[c].events[i], stamp);
+			fwrite(out->str, 1, out->len, file);
+			g_string_truncate(out, 0);
+		}
+	}
+	g_string_append(out, "END:VCALENDAR\r\n");
+	fwrite(out->str, 1, out->len, file);
+	
+	g_string_free(line, TRUE);
+	g_string_free(out, TRUE);
+	g_free(stamp);
+	return !ferror(file);
+}
+
+//----------------------------------------------------------------------
+// duplicate detection
+//----------------------------------------------------------------------
+
+// Imports compare records by a 64-bit FNV-1a hash of the date, start
+// time, title and location. Text is hashed trimmed, with runs of white
+// space collapsed and ASCII letters lowercased, so "Dentist " and
+// "dentist" match. Integers are hashed as little-endian bytes and the
+// fields are separated, so the hash is the same on every machine and
+// run. The set is open addressing with linear probing over two flat
+// arrays at most half full, so a lookup during a large import is a
+// probe or two with no allocation. Different events sharing a hash are
+// unlikely enough at 64 bits to treat as the same event.
+
+#define RECORD_HASH_OFFSET G_GUINT64_CONSTANT(0xcbf29ce484222325)
+#define RECORD_HASH_PRIME G_GUINT64_CONSTANT(0x100000001b3)
+#define RECORD_HASH_SEPARATOR 0x1f
+
+typedef struct {
+	guint64 *hashes; //0 = empty slot
+	int *indices; //event index of the first record with the hash
+	guint mask; //capacity - 1, capacity is a power of two
+	guint size;
+} RecordSet;
+
+static guint64 record_hash_byte(guint64 hash, guchar byte)
+{
+	return (hash ^ byte) * RECORD_HASH_PRIME;
+}
+
+static guint64 record_hash_int(guint64 hash, gint32 value)
+{
+	guint32 bits=(guint32) value;
+	for(int i=0; i<4; i++) {
+		hash=record_hash_byte(hash, bits & 0xff);
+		bits=bits >> 8;
+	}
+	return record_hash_byte(hash, RECORD_HASH_SEPARATOR);
+}
+
+static guint64 record_hash_text(guint64 hash, const char *text)
+{
+	const char *p=text;
+	while(g_ascii_isspace(*p)) p++;
+	gboolean space=FALSE;
+	for(; *p; p++) {
+		if(g_ascii_isspace(*p)) {
+			space=TRUE;
+			continue;
+		}
+		if(space) hash=record_hash_byte(hash, ' '); //trailing space is dropped
+		space=FALSE;
+		hash=record_hash_byte(hash, g_ascii_tolower(*p));
+	}
+	return record_hash_byte(hash, RECORD_HASH_SEPARATOR);
+}
+
+static guint64 record_hash(const Event *e)
+{
+	guint64 hash=RECORD_HASH_OFFSET;
+	hash=record_hash_int(hash, julian_from_dmy(e->day, e->month, e->year));
+	hash=record_hash_int(hash, e->is_allday ? -1 : minutes_from_time(e->start_time));
+	hash=record_hash_text(hash, e->title);
+	hash=record_hash_text(hash, e->location);
+	return hash ? hash : 1; //0 marks empty slots
+}
+
+static void record_set_init(RecordSet *set, guint expected)
+{
+	guint capacity=16;
+	while(capacity < expected * 2) capacity=capacity * 2;
+	set->hashes=g_new0(guint64, capacity);
+	set->indices=g_new(int, capacity);
+	set->mask=capacity - 1;
+	set->size=0;
+}
+
+static void record_set_clear(RecordSet *set)
+{
+	g_free(set->hashes);
+	g_free(set->indices);
+}
+
+static guint record_set_slot(const RecordSet *set, guint64 hash)
+{
+	guint slot=(guint) (hash ^ (hash >> 29)) & set->mask;
+	while(set->hashes[slot]!=0 && set->hashes[slot]!=hash) slot=(slot + 1) & set->mask;
+	return slot;
+}
+
+//event index of the record with hash, -1 if none
+static int record_set_lookup(const RecordSet *set, guint64 hash)
+{
+	guint slot=record_set_slot(set, hash);
+	return set->hashes[slot] ? set->indices[slot] : -1;
+}
+
+static void record_set_grow(RecordSet *set)
+{
+	RecordSet bigger;
+	record_set_init(&bigger, (set->mask + 1));
+	for(guint i=0; i<=set->mask; i++) {
+		if(set->hashes[i]==0) continue;
+		guint slot=record_set_slot(&bigger, set->hashes[i]);
+		bigger.hashes[slot]=set->hashes[i];
+		bigger.indices[slot]=set->indices[i];
+	}
+	bigger.size=set->size;
+	record_set_clear(set);
+	*set=bigger;
+}
+
+//keeps the first index added for a hash
+static void record_set_insert(RecordSet *set, guint64 hash, int index)
+{
+	if((set->size + 1) * 2 > set->mask + 1) record_set_grow(set);
+	guint slot=record_set_slot(set, hash);
+	if(set->hashes[slot]) return;
+	set->hashes[slot]=hash;
+	set->indices[slot]=index;
+	set->size++;
+}
+
+//fold an imported duplicate into the existing event
+static void event_merge_duplicate(Event *existing, const Event *e)
+{
+	if(e->priority) existing->priority=e->priority;
+	if(!existing->is_allday && existing->end_time==existing->start_time) {
+		existing->end_time=e->end_time;
+	}
+	if(existing->end_date==0) existing->end_date=e->end_date;
+	if(!event_is_recurring(existing) && event_is_recurring(e)) {
+		existing->is_yearly=e->is_yearly;
+		existing->recur_freq=e->recur_freq;
+		existing->recur_interval=e->recur_interval;
+		existing->recur_weekdays=e->recur_weekdays;
+		existing->recur_count=e->recur_count;
+		existing->recur_until=e->recur_until;
+	}
+	for(int i=0; i<e->num_exdates && existing->num_exdates<MAX_EXDATES; i++) {
+		if(event_is_excluded(existing, e->exdates[i])) continue;
+		existing->exdates[existing->num_exdates]=e->exdates[i];
+		existing->num_exdates++;
+	}
+}
+
+//-1 if str is not skip, merge or keep
+static int duplicates_from_string(const char *str)
+{
+	if(g_ascii_strcasecmp(str, "skip")==0) return DUPLICATES_SKIP;
+	if(g_ascii_strcasecmp(str, "merge")==0) return DUPLICATES_MERGE;
+	if(g_ascii_strcasecmp(str, "keep")==0) return DUPLICATES_KEEP;
+	return -1;
+}
+
+//----------------------------------------------------------------------
+// worker pool
+//----------------------------------------------------------------------
+
+// Background work (parsing imports and changed files, writing saves,
+// converting archived years, memory compaction) runs as tasks on one
+// GThreadPool with a thread per processor, so the number of threads
+// stays bounded however much is queued. Queued tasks are ordered by
+// priority class and then by submission: normal tasks (parsing, saving)
+// before idle ones (compaction, archiving). Nothing the user waits on
+// interactively runs here: speech is played by subprocesses driven from
+// the main loop, and search stays on the main thread because a query of
+// the trigram index takes well under a millisecond, less than handing it
+// to a worker, and the index is updated in place with every edit. A
+// task's func runs on a worker and its done always runs afterwards on
+// the main loop, also when the task was cancelled before it started (its
+// func is then skipped), so the owner can drop its pointer there. Tasks
+// are submitted, cancelled and waited for on the main thread; waiting
+// for a task that has not started runs it on the waiting thread, so a
+// synchronous wait never queues behind unrelated work.
+
+enum {
+	TASK_NORMAL=0,
+	TASK_IDLE
+};
+
+typedef struct _Task Task;
+typedef void (*TaskFunc)(Task *task, gpointer data);
+
+struct _Task {
+	int priority; //TASK_ class
+	guint order; //submission order
+	TaskFunc func; //on a worker
+	TaskFunc done; //on the main thread, may be NULL
+	gpointer data;
+	gint cancelled; //atomic
+	gint claimed; //atomic, set by whoever runs func (a worker or task_wait)
+	GMutex mutex;
+	GCond cond;
+	gboolean finished; //func returned or skipped
+	guint done_source; //posted to the main loop
+};
+
+static GThreadPool *m_task_pool=NULL;
+static guint m_task_order=0;
+
+static int compare_task(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const Task *task_a = a;
+	const Task *task_b = b;
+	if(task_a->priority!=task_b->priority) return task_a->priority - task_b->priority;
+	return (task_a->order > task_b->order) - (task_a->order < task_b->order);
+}
+
+static void task_clear(gpointer data)
+{
+	Task *task=data;
+	g_mutex_clear(&task->mutex);
+	g_cond_clear(&task->cond);
+}
+
+static gboolean callbk_task_done(gpointer user_data)
+{
+	Task *task=user_data;
+	if(task->done) task->done(task, task->data);
+	g_atomic_rc_box_release_full(task, task_clear);
+	return G_SOURCE_REMOVE;
+}
+
+//pool worker, the task may have been run by task_wait already
+static void task_run(gpointer data, gpointer user_data)
+{
+	Task *task=data;
+	if(g_atomic_int_compare_and_exchange(&task->claimed, 0, 1)) {
+		if(!g_atomic_int_get(&task->cancelled)) task->func(task, task->data);
+		g_mutex_lock(&task->mutex);
+		task->finished=TRUE;
+		task->done_source=g_idle_add(callbk_task_done, task);
+		g_cond_broadcast(&task->cond);
+		g_mutex_unlock(&task->mutex);
+	}
+	g_atomic_rc_box_release_full(task, task_clear); //the pool's reference
+}
+
+//queue func(task, data) on the pool, the task is freed after done
+static Task* task_submit(int priority, TaskFunc func, TaskFunc done, gpointer data)
+{
+	if(m_task_pool==NULL) {
+		m_task_pool=g_thread_pool_new(task_run, NULL, g_get_num_processors(), FALSE, NULL);
+		g_thread_pool_set_sort_function(m_task_pool, compare_task, NULL);
+	}
+	Task *task=g_atomic_rc_box_new0(Task); //released after done
+	task->priority=priority;
+	task->order=m_task_order;
+	m_task_order++;
+	task->func=func;
+	task->done=done;
+	task->data=data;
+	g_mutex_init(&task->mutex);
+	g_cond_init(&task->cond);
+	g_thread_pool_push(m_task_pool, g_atomic_rc_box_acquire(task), NULL);
+	return task;
+}
+
+//a task not started yet skips its func, a running one can poll task_is_cancelled
+static void task_cancel(Task *task)
+{
+	g_atomic_int_set(&task->cancelled, 1);
+}
+
+static gboolean task_is_cancelled(Task *task)
+{
+	return g_atomic_int_get(&task->cancelled);
+}
+
+//block until func has returned and call done now (the task is freed),
+//a task still queued is run here instead of waiting behind the queue
+static void task_wait(Task *task)
+{
+	if(g_atomic_int_compare_and_exchange(&task->claimed, 0, 1)) {
+		if(!g_atomic_int_get(&task->cancelled)) task->func(task, task->data);
+	}
+	else {
+		g_mutex_lock(&task->mutex);
+		while(!task->finished) g_cond_wait(&task->cond, &task->mutex);
+		guint done_source=task->done_source;
+		g_mutex_unlock(&task->mutex);
+		g_source_remove(done_source);
+	}
+	callbk_task_done(task);
+}
+
+//----------------------------------------------------------------------
+// parallel import
+//----------------------------------------------------------------------
+
+// Files are mapped and split at record boundaries (lines for csv,
+// BEGIN:VEVENT lines for ics) into chunks that are parsed as tasks on
+// the worker pool, each into its own array of events. Workers never touch
+// a calendar: when every chunk is parsed the main thread appends the arrays in file
+// order in one batch, assigns ids, resolves RECURRENCE-ID overrides and
+// invalidates derived data once so the indexes are rebuilt in bulk.
+// Duplicates are detected in the merge, against the target calendar and the
+// events merged before them, so the result does not depend on chunking.
+// Without a progress callback the caller waits for the tasks, with one
+// each parsed chunk is reported on the main loop and the merge runs there.
+// A cancelled job stops parsing (chunks poll task_is_cancelled) and is
+// not merged.
+
+#define IMPORT_CHUNK_MIN (1024*1024) //smaller files are parsed as one chunk
+#define CSV_MAX_LINE 2048 //longer records are truncated
+
+typedef struct _ImportJob ImportJob;
+typedef void (*ImportFunc)(ImportJob *job, gpointer user_data);
+
+typedef struct {
+	ImportJob *job; //the chunk belongs to
+	const gchar *data;
+	gsize size;
+	GArray *events; //Event, ids are assigned in the merge
+	GArray *series; //IcsSeries
+	GArray *overrides; //IcsOverride
+	ImportResult result;
+} ImportChunk;
+
+struct _ImportJob {
+	int format;
+	int calendar; //events are added to
+	int duplicates; //DUPLICATES_ mode
+	GMappedFile *file;
+	GPtrArray *chunks; //ImportChunk in file order
+	GPtrArray *tasks; //Task parsing each chunk, until its done
+	guint chunks_done; //counted on the main thread
+	gboolean cancelled;
+	ImportResult result; //totals after the merge
+	ImportFunc progress; //NULL = the caller waits
+	ImportFunc done;
+	gpointer user_data;
+	gboolean parse_only; //no merge, done reads the chunks (external changes)
+};
+
+static void import_chunk_free(gpointer data)
+{
+	ImportChunk *chunk=data;
+	for(guint i=0; i<chunk->series->len; i++) {
+		g_free(g_array_index(chunk->series, IcsSeries, i).uid);
+	}
+	for(guint i=0; i<chunk->overrides->len; i++) {
+		g_free(g_array_index(chunk->overrides, IcsOverride, i).uid);
+	}
+	g_array_unref(chunk->events);
+	g_array_unref(chunk->series);
+	g_array_unref(chunk->overrides);
+	g_free(chunk);
+}
+
+static void import_job_free(ImportJob *job)
+{
+	g_ptr_array_unref(job->tasks);
+	g_ptr_array_unref(job->chunks);
+	g_mapped_file_unref(job->file);
+	g_free(job);
+}
+
+//end of a chunk of about size bytes from start, at the next record boundary
+static gsize import_chunk_end(const gchar *data, gsize length, gsize start, gsize size, int format)
+{
+	if(start + size >= length) return length;
+	const gchar *from=data + start + size;
+	const gchar *boundary;
+	if(format==IMPORT_CSV) boundary=memchr(from, '\n', length - start - size);
+	else boundary=g_strstr_len(from, length - start - size, "\nBEGIN:VEVENT");
+	if(boundary==NULL) return length;
+	return boundary - data + 1;
+}
+
+//csv lines in data, returns the number of events appended, stops early
+//when task (may be NULL) is cancelled
+static int csv_parse_lines(Task *task, const gchar *data, gsize size, GArray *events)
+{
+	gchar record[CSV_MAX_LINE];
+	const gchar *p=data;
+	const gchar *end=data + size;
+	int count=0;
+	while(p<end) {
+		const gchar *newline=memchr(p, '\n', end - p);
+		const gchar *line_end=newline ? newline : end;
+		gsize len=MIN((gsize) (line_end - p), CSV_MAX_LINE - 1);
+		memcpy(record, p, len);
+		record[len]='\0';
+		Event e;
+		if(csv_parse_record(record, &e)) {
+			g_array_append_val(events, e);
+			count++;
+			if(task && count % 1024==0 && task_is_cancelled(task)) break;
+		}
+		p=newline ? newline + 1 : end;
+	}
+	return count;
+}
+
+static void csv_parse_chunk(Task *task, ImportChunk *chunk)
+{
+	chunk->result.imported=chunk->result.imported + csv_parse_lines(task, chunk->data, chunk->size, chunk->events);
+}
+
+//append every chunk to the calendar in file order (main thread)
+static void import_job_merge(ImportJob *job)
+{
+	Calendar *cal=&m_calendars[job->calendar];
+	gboolean check=(job->duplicates!=DUPLICATES_UNCHECKED);
+	guint total=0;
+	guint32 first=0, last=0;
+	for(guint i=0; i<job->chunks->len; i++) {
+		ImportChunk *chunk=g_ptr_array_index(job->chunks, i);
+		total=total + chunk->events->len;
+		for(guint j=0; check && j<chunk->events->len; j++) {
+			Event *e=&g_array_index(chunk->events, Event, j);
+			guint32 jd=julian_from_dmy(e->day, e->month, e->year);
+			if(jd==0) continue;
+			if(first==0 || jd<first) first=jd;
+			last=MAX(last, jd);
+		}
+	}
+	if(check) calendar_page_in(cal, first, last); //duplicates in cold years are found too
+	if(!db_reserve(cal, cal->size + total)) return;
+	
+	RecordSet records;
+	if(check) {
+		record_set_init(&records, cal->size + total);
+		for(int i=0; i<cal->size; i++) record_set_insert(&records, record_hash(&cal->events[i]), i);
+	}
+	
+	GHashTable *series=g_hash_table_new(g_str_hash, g_str_equal); //uid -> event index
+	GArray *placed=g_array_new(FALSE, FALSE, sizeof(int)); //chunk event -> event index, -1 = skipped
+	for(guint i=0; i<job->chunks->len; i++) {
+		ImportChunk *chunk=g_ptr_array_index(job->chunks, i);
+		g_array_set_size(placed, chunk->events->len);
+		for(guint j=0; j<chunk->events->len; j++) {
+			Event *e=&g_array_index(chunk->events, Event, j);
+			guint64 hash=0;
+			int existing=-1;
+			if(check) {
+				hash=record_hash(e);
+				existing=record_set_lookup(&records, hash);
+			}
+			if(existing>=0) {
+				job->result.duplicates++;
+				if(job->duplicates==DUPLICATES_SKIP) {
+					g_array_index(placed, int, j)=-1;
+					continue;
+				}
+				if(job->duplicates==DUPLICATES_MERGE) {
+					event_merge_duplicate(&cal->events[existing], e);
+					g_array_index(placed, int, j)=existing;
+					continue;
+				}
+			}
+			e->id=m_next_id;
+			m_next_id=m_next_id+1;
+			cal->events[cal->size]=*e;
+			if(check && existing<0) record_set_insert(&records, hash, cal->size);
+			g_array_index(placed, int, j)=cal->size;
+			cal->size++;
+			job->result.imported++;
+		}
+		for(guint j=0; j<chunk->series->len; j++) {
+			IcsSeries *entry=&g_array_index(chunk->series, IcsSeries, j);
+			int index=g_array_index(placed, int, entry->index);
+			if(index>=0) g_hash_table_insert(series, entry->uid, GINT_TO_POINTER(index));
+		}
+		job->result.simplified=job->result.simplified + chunk->result.simplified;
+		job->result.skipped=job->result.skipped + chunk->result.skipped;
+	}
+	g_array_unref(placed);
+	if(check) record_set_clear(&records);
+	
+	//overrides may come before or after their series in the file
+	for(guint i=0; i<job->chunks->len; i++) {
+		ImportChunk *chunk=g_ptr_array_index(job->chunks, i);
+		for(guint j=0; j<chunk->overrides->len; j++) {
+			IcsOverride *override=&g_array_index(chunk->overrides, IcsOverride, j);
+			gpointer index;
+			if(!g_hash_table_lookup_extended(series, override->uid, NULL, &index)) continue;
+			Event *e=&cal->events[GPOINTER_TO_INT(index)];
+			if(e->num_exdates<MAX_EXDATES && !event_is_excluded(e, override->jd)) {
+				e->exdates[e->num_exdates]=override->jd;
+				e->num_exdates++;
+			}
+		}
+	}
+	g_hash_table_unref(series);
+	
+	db_store_changed(cal);
+	search_index_invalidate();
+}
+
+//main thread, for each chunk parsed (or skipped)
+static void import_chunk_done(Task *task, gpointer data)
+{
+	ImportChunk *chunk=data;
+	ImportJob *job=chunk->job;
+	g_ptr_array_remove_fast(job->tasks, task);
+	job->chunks_done++;
+	if(job->progress==NULL) return; //the caller waits
+	job->progress(job, job->user_data);
+	if(job->chunks_done==job->chunks->len) {
+		if(!job->parse_only && !job->cancelled) import_job_merge(job);
+		job->done(job, job->user_data);
+		import_job_free(job);
+	}
+}
+
+//task func
+static void import_parse_chunk(Task *task, gpointer data)
+{
+	ImportChunk *chunk=data;
+	ImportJob *job=chunk->job;
+	if(job->format==IMPORT_CSV) csv_parse_chunk(task, chunk);
+	else ics_parse_chunk(task, chunk->data, chunk->size, chunk->events, chunk->series, chunk->overrides, &chunk->result);
+}
+
+//main thread: stop parsing, done is still called
+static void import_job_cancel(ImportJob *job)
+{
+	job->cancelled=TRUE;
+	for(guint i=0; i<job->tasks->len; i++) task_cancel(g_ptr_array_index(job->tasks, i));
+}
+
+//main thread: until every chunk is parsed
+static void import_job_wait(ImportJob *job)
+{
+	while(job->tasks->len>0) task_wait(g_ptr_array_index(job->tasks, 0));
+}
+
+//map file_name and start parsing its chunks, NULL if it cannot be opened
+static ImportJob* import_job_start(const char *file_name, int format, int calendar, int duplicates, ImportFunc progress, ImportFunc done, gpointer user_data)
+{
+	GMappedFile *file=g_mapped_file_new(file_name, FALSE, NULL);
+	if(file==NULL) return NULL;
+	
+	ImportJob *job=g_new0(ImportJob, 1);
+	job->format=format;
+	job->calendar=calendar;
+	job->duplicates=duplicates;
+	job->result.duplicate_mode=duplicates;
+	job->file=file;
+	job->progress=progress;
+	job->done=done;
+	job->user_data=user_data;
+	job->chunks=g_ptr_array_new_with_free_func(import_chunk_free);
+	job->tasks=g_ptr_array_new();
+	
+	const gchar *data=g_mapped_file_get_contents(file);
+	gsize length=g_mapped_file_get_length(file);
+	if(format==IMPORT_CSV && data) job->result.generation=csv_header_generation(data, length);
+	guint threads=g_get_num_processors();
+	gsize size=MAX(IMPORT_CHUNK_MIN, length / (threads * 4)); //a few chunks per thread to balance
+	gsize start=0;
+	do {
+		gsize end=(length==0) ? 0 : import_chunk_end(data, length, start, size, format);
+		ImportChunk *chunk=g_new0(ImportChunk, 1);
+		chunk->job=job;
+		chunk->data=data ? data + start : "";
+		chunk->size=end - start;
+		chunk->events=g_array_new(FALSE, FALSE, sizeof(Event));
+		chunk->series=g_array_new(FALSE, FALSE, sizeof(IcsSeries));
+		chunk->overrides=g_array_new(FALSE, FALSE, sizeof(IcsOverride));
+		g_ptr_array_add(job->chunks, chunk);
+		start=end;
+	} while(start<length);
+	
+	if(progress==NULL && job->chunks->len==1) {
+		import_parse_chunk(NULL, g_ptr_array_index(job->chunks, 0)); //not worth a task
+		return job;
+	}
+	for(guint i=0; i<job->chunks->len; i++) {
+		g_ptr_array_add(job->tasks, task_submit(TASK_NORMAL, import_parse_chunk, import_chunk_done, g_ptr_array_index(job->chunks, i)));
+	}
+	return job;
+}
+
+//import and merge before returning, FALSE if the file cannot be opened
+static gboolean import_file(const char *file_name, int format, int calendar, int duplicates, ImportResult *result)
+{
+	ImportJob *job=import_job_start(file_name, format, calendar, duplicates, NULL, NULL, NULL);
+	if(job==NULL) return FALSE;
+	import_job_wait(job);
+	import_job_merge(job);
+	*result=job->result;
+	import_job_free(job);
+	return TRUE;
+}
+
+static int import_format_from_name(const char *file_name)
+{
+	gchar *name=g_ascii_strdown(file_name, -1);
+	int format=g_str_has_suffix(name, ".csv") ? IMPORT_CSV : IMPORT_ICS;
+	g_free(name);
+	return format;
+}
+
+static gchar* import_summary(const ImportResult *result)
+{
+	GString *summary=g_string_new("");
+	g_string_append_printf(summary, "Imported %d events.", result->imported);
+	if(result->simplified) {
+		g_string_append_printf(summary, " %d repeat rules were not supported and only the first occurrence was imported.", result->simplified);
+	}
+	if(result->skipped) {
+		g_string_append_printf(summary, " %d cancelled or undated events were skipped.", result->skipped);
+	}
+	if(result->duplicates) {
+		if(result->duplicate_mode==DUPLICATES_SKIP) {
+			g_string_append_printf(summary, " %d duplicates were skipped.", result->duplicates);
+		} else if(result->duplicate_mode==DUPLICATES_MERGE) {
+			g_string_append_printf(summary, " %d duplicates were merged into existing events.", result->duplicates);
+		} else {
+			g_string_append_printf(summary, " %d duplicates were added again.", result->duplicates);
+		}
+	}
+	return g_string_free(summary, FALSE);
+}
+
+//----------------------------------------------------------------------
+// external changes
+//----------------------------------------------------------------------
+
+// Calendar files are watched with a GFileMonitor so edits made by a file
+// sync tool (or another copy of the program) are picked up while running.
+// After the writer has been quiet for RECONCILE_DELAY ms the file is
+// parsed on the import thread pool and compared with the hashes of the
+// rows last read or written: rows that disappeared are deleted from the
+// calendar and new rows are added, so local changes made since then are
+// kept and only the months and days touching a changed event are redrawn.
+// A file rewritten by save_calendar_file hashes the same and changes
+// nothing. Pending changes are applied before the calendars are saved
+// at shutdown so they are not overwritten.
+
+#define RECONCILE_DELAY 250 //ms
+
+typedef struct {
+	guint64 hash;
+	const Event *event;
+} RowHash;
+
+//every field of a record as it is written to the file
+static guint64 event_content_hash(const Event *e)
+{
+	guint64 hash=RECORD_HASH_OFFSET;
+	for(const char *p=e->title; *p; p++) hash=record_hash_byte(hash, *p);
+	hash=record_hash_byte(hash, RECORD_HASH_SEPARATOR);
+	for(const char *p=e->location; *p; p++) hash=record_hash_byte(hash, *p);
+	hash=record_hash_byte(hash, RECORD_HASH_SEPARATOR);
+	
+	//yearly without a rule is read back as a yearly rule (see csv_parse_record)
+	int recur_freq=(e->is_yearly && e->recur_freq==RECUR_NONE) ? RECUR_YEARLY : e->recur_freq;
+	int fields[] = { e->year, e->month, e->day, minutes_from_time(e->start_time),
+		minutes_from_time(e->end_time), e->priority, e->is_yearly, e->is_allday,
+		recur_freq, e->recur_interval, e->recur_weekdays, e->recur_count,
+		e->recur_until, e->end_date, e->num_exdates };
+	for(guint i=0; i<G_N_ELEMENTS(fields); i++) hash=record_hash_int(hash, fields[i]);
+	for(int i=0; i<e->num_exdates; i++) hash=record_hash_int(hash, e->exdates[i]);
+	return hash;
+}
+
+static int compare_row_hash(gconstpointer a, gconstpointer b)
+{
+	const RowHash *row_a = a;
+	const RowHash *row_b = b;
+	return (row_a->hash > row_b->hash) - (row_a->hash < row_b->hash);
+}
+
+static int compare_hash(gconstpointer a, gconstpointer b)
+{
+	guint64 hash_a = *(const guint64*) a;
+	guint64 hash_b = *(const guint64*) b;
+	return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+//content hashes of events sorted, caller frees
+static GArray* calendar_row_hashes(const Event *events, int size)
+{
+	GArray *rows=g_array_sized_new(FALSE, FALSE, sizeof(RowHash), size);
+	for(int i=0; i<size; i++) {
+		RowHash row = { event_content_hash(&events[i]), &events[i] };
+		g_array_append_val(rows, row);
+	}
+	g_array_sort(rows, compare_row_hash);
+	return rows;
+}
+
+//content hashes of rows (Event pointers) sorted, caller frees
+static GArray* sorted_row_hashes(GPtrArray *rows)
+{
+	GArray *hashes=g_array_sized_new(FALSE, FALSE, sizeof(guint64), rows->len);
+	g_array_set_size(hashes, rows->len);
+	for(guint i=0; i<rows->len; i++) {
+		g_array_index(hashes, guint64, i)=event_content_hash(g_ptr_array_index(rows, i));
+	}
+	g_array_sort(hashes, compare_hash);
+	return hashes;
+}
+
+//a file now holds rows
+static void calendar_set_file_hashes(GArray **hashes, GPtrArray *rows)
+{
+	if(*hashes) g_array_unref(*hashes);
+	*hashes=sorted_row_hashes(rows);
+}
+
+//the file now holds exactly the calendar's events
+static void calendar_file_synced(Calendar *cal)
+{
+	if(cal->file_hashes==NULL) cal->file_hashes=g_array_new(FALSE, FALSE, sizeof(guint64));
+	g_array_set_size(cal->file_hashes, cal->size);
+	for(int i=0; i<cal->size; i++) {
+		g_array_index(cal->file_hashes, guint64, i)=event_content_hash(&cal->events[i]);
+	}
+	g_array_sort(cal->file_hashes, compare_hash);
+	cal->file_version++;
+}
+
+//does the event touch julian days from to to (recurring events may)
+static gboolean event_touches(const Event *e, guint32 from, guint32 to)
+{
+	if(event_is_recurring(e)) return TRUE;
+	guint32 jd=julian_from_dmy(e->day, e->month, e->year);
+	return jd<=to && jd + event_span_days(e)>=from;
+}
+
+//content hashes of the rows of a parsed csv file sorted, caller frees
+static GArray* import_job_rows(ImportJob *job)
+{
+	guint total=0;
+	for(guint i=0; i<job->chunks->len; i++) {
+		ImportChunk *chunk=g_ptr_array_index(job->chunks, i);
+		total=total + chunk->events->len;
+	}
+	GArray *rows=g_array_sized_new(FALSE, FALSE, sizeof(RowHash), total);
+	for(guint i=0; i<job->chunks->len; i++) {
+		ImportChunk *chunk=g_ptr_array_index(job->chunks, i);
+		for(guint j=0; j<chunk->events->len; j++) {
+			const Event *e=&g_array_index(chunk->events, Event, j);
+			RowHash row = { event_content_hash(e), e };
+			g_array_append_val(rows, row);
+		}
+	}
+	g_array_sort(rows, compare_row_hash);
+	return rows;
+}
+
+//apply the rows added to and removed from a file since *synced (the
+//sorted hashes of its rows when last read or written), *synced is
+//updated to rows
+static void calendar_apply_rows(int calendar, GArray *rows, GArray **synced_hashes)
+{
+	Calendar *cal=&m_calendars[calendar];
+	
+	//both sides sorted: walk them together, equal hashes cancel
+	GArray *added=g_array_new(FALSE, FALSE, sizeof(RowHash));
+	GArray *removed=g_array_new(FALSE, FALSE, sizeof(guint64));
+	GArray *synced=*synced_hashes;
+	guint n_synced=synced ? synced->len : 0;
+	guint r=0, s=0;
+	while(r<rows->len || s<n_synced) {
+		RowHash *row=(r<rows->len) ? &g_array_index(rows, RowHash, r) : NULL;
+		guint64 *hash=(s<n_synced) ? &g_array_index(synced, guint64, s) : NULL;
+		if(row && hash && row->hash==*hash) {
+			r++;
+			s++;
+		}
+		else if(row && (hash==NULL || row->hash<*hash)) {
+			g_array_append_val(added, *row);
+			r++;
+		}
+		else {
+			g_array_append_val(removed, *hash);
+			s++;
+		}
+	}
+	
+	if(added->len==0 && removed->len==0) {
+		g_array_unref(added);
+		g_array_unref(removed);
+		return;
+	}
+	
+	//match the changes against the events in memory, also sorted by hash
+	GArray *held=calendar_row_hashes(cal->events, cal->size);
+	gboolean *gone=g_new0(gboolean, MAX(cal->size, 1));
+	guint h=0;
+	for(guint i=0; i<removed->len; i++) {
+		guint64 hash=g_array_index(removed, guint64, i);
+		while(h<held->len && g_array_index(held, RowHash, h).hash<hash) h++;
+		if(h<held->len && g_array_index(held, RowHash, h).hash==hash) {
+			gone[g_array_index(held, RowHash, h).event - cal->events]=TRUE;
+			h++;
+		}
+		//else deleted here as well
+	}
+	GArray *adding=g_array_new(FALSE, FALSE, sizeof(Event));
+	h=0;
+	for(guint i=0; i<added->len; i++) {
+		RowHash *row=&g_array_index(added, RowHash, i);
+		while(h<held->len && g_array_index(held, RowHash, h).hash<row->hash) h++;
+		if(h<held->len && g_array_index(held, RowHash, h).hash==row->hash) continue; //added here as well
+		g_array_append_val(adding, *row->event);
+	}
+	g_array_unref(held);
+	
+	//the visible month and selected day are redrawn only if touched
+	GtkWindow *window=gtk_application_get_active_window(GTK_APPLICATION(g_application_get_default()));
+	guint32 month_from=1, month_to=0, selected=0;
+	if(window) {
+		month_from=julian_from_dmy(1, m_month, m_year);
+		month_to=month_from + g_date_get_days_in_month(m_month, m_year) - 1;
+		selected=julian_from_dmy(m_day, m_month, m_year);
+	}
+	gboolean recurring=FALSE;
+	gboolean month_changed=FALSE;
+	gboolean day_changed=FALSE;
+	
+	int size=0;
+	for(int i=0; i<cal->size; i++) {
+		Event *e=&cal->events[i];
+		if(gone[i]) {
+			recurring=recurring || event_is_recurring(e);
+			month_changed=month_changed || event_touches(e, month_from, month_to);
+			day_changed=day_changed || event_touches(e, selected, selected);
+			search_index_remove(e->id);
+			if(e->id==m_id_selection) {
+				m_id_selection=-1;
+				m_row_index=-1;
+			}
+			continue;
+		}
+		cal->events[size]=*e;
+		size++;
+	}
+	cal->size=size;
+	g_free(gone);
+	
+	if(db_reserve(cal, cal->size + adding->len)) {
+		for(guint i=0; i<adding->len; i++) {
+			Event *e=&g_array_index(adding, Event, i);
+			e->id=m_next_id;
+			m_next_id=m_next_id+1;
+			cal->events[cal->size]=*e;
+			cal->size++;
+			recurring=recurring || event_is_recurring(e);
+			month_changed=month_changed || event_touches(e, month_from, month_to);
+			day_changed=day_changed || event_touches(e, selected, selected);
+			search_index_add(calendar, e);
+		}
+	}
+	
+	if(recurring) db_store_changed(cal);
+	else {
+		//no series changed so the month occurrence cache is still valid
+		if(cal->index) cal->index->valid=FALSE;
+		store_version_drop(cal);
+		agenda_shm_schedule();
+		reminder_schedule();
+	}
+	
+	//the file is what memory now agrees with
+	if(*synced_hashes==NULL) *synced_hashes=g_array_new(FALSE, FALSE, sizeof(guint64));
+	g_array_set_size(*synced_hashes, rows->len);
+	for(guint i=0; i<rows->len; i++) {
+		g_array_index(*synced_hashes, guint64, i)=g_array_index(rows, RowHash, i).hash;
+	}
+	g_array_unref(adding);
+	g_array_unref(added);
+	g_array_unref(removed);
+	
+	if(window==NULL || !calendar_is_visible(calendar)) return;
+	if(month_changed) update_calendar(window);
+	if(day_changed) update_store(m_year,m_month,m_day);
+}
+
+//apply the rows added and removed in the parsed file (main thread)
+//user_data is the file_version the job started at
+static void calendar_reconcile(ImportJob *job, gpointer user_data)
+{
+	Calendar *cal=&m_calendars[job->calendar];
+	cal->reconcile_job=NULL;
+	if(job->cancelled) return; //changed again or merged at save
+	if(GPOINTER_TO_UINT(user_data)!=cal->file_version) return; //saved or applied since
+	cal->file_generation=job->result.generation;
+	GArray *rows=import_job_rows(job);
+	calendar_apply_rows(job->calendar, rows, &cal->file_hashes);
+	g_array_unref(rows);
+	cal->file_version++;
+}
+
+//nothing is shown while an external change is parsed
+static void reconcile_progress(ImportJob *job, gpointer user_data)
+{
+}
+
+static gboolean callbk_reconcile_timeout(gpointer user_data)
+{
+	int calendar=GPOINTER_TO_INT(user_data);
+	Calendar *cal=&m_calendars[calendar];
+	if(cal->reconcile_job) return G_SOURCE_CONTINUE; //one parse at a time
+	cal->reconcile_source=0;
+	ImportJob *job=import_job_start(cal->file_name, IMPORT_CSV, calendar, DUPLICATES_UNCHECKED,
+		reconcile_progress, calendar_reconcile, GUINT_TO_POINTER(cal->file_version));
+	if(job==NULL) return G_SOURCE_REMOVE; //removed, the events stay until saved
+	//set before any parsed chunk is posted back to the main loop
+	job->parse_only=TRUE;
+	cal->reconcile_job=job;
+	return G_SOURCE_REMOVE;
+}
+
+static void callbk_calendar_file_changed(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
+{
+	//replacing a file (write and rename) is reported as created
+	if(event_type!=G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT && event_type!=G_FILE_MONITOR_EVENT_CREATED) return;
+	Calendar *cal=&m_calendars[GPOINTER_TO_INT(user_data)];
+	if(cal->reconcile_job) import_job_cancel(cal->reconcile_job); //parsing an older file
+	//sync tools often write a file in several steps
+	if(cal->reconcile_source) g_source_remove(cal->reconcile_source);
+	cal->reconcile_source=g_timeout_add(RECONCILE_DELAY, callbk_reconcile_timeout, user_data);
+}
+
+static void calendar_watch_start()
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		GFile *file=g_file_new_for_path(cal->file_name);
+		cal->monitor=g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+		g_object_unref(file);
+		if(cal->monitor==NULL) {
+			g_print("error: unable to watch %s for changes\n", cal->file_name);
+			continue;
+		}
+		g_signal_connect(cal->monitor, "changed", G_CALLBACK(callbk_calendar_file_changed), GINT_TO_POINTER(c));
+	}
+}
+
+//parse file_name and apply its changes since *synced before returning
+static gboolean csv_merge_file(int calendar, const char *file_name, GArray **synced, guint64 *generation)
+{
+	ImportJob *job=import_job_start(file_name, IMPORT_CSV, calendar, DUPLICATES_UNCHECKED, NULL, NULL, NULL);
+	if(job==NULL) return FALSE;
+	import_job_wait(job);
+	GArray *rows=import_job_rows(job);
+	calendar_apply_rows(calendar, rows, synced);
+	*generation=job->result.generation;
+	g_array_unref(rows);
+	import_job_free(job);
+	return TRUE;
+}
+
+//apply a change still waiting (or being parsed) before returning
+static void calendar_reconcile_now(int calendar)
+{
+	Calendar *cal=&m_calendars[calendar];
+	if(cal->reconcile_source) g_source_remove(cal->reconcile_source);
+	cal->reconcile_source=0;
+	if(cal->reconcile_job) import_job_cancel(cal->reconcile_job);
+	csv_merge_file(calendar, cal->file_name, &cal->file_hashes, &cal->file_generation);
+	cal->file_version++; //a parse in flight is dropped when it returns
+}
+
+//changes still waiting are applied by save_calendar_file
+static void calendar_watch_stop()
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		if(cal->monitor==NULL) continue;
+		g_file_monitor_cancel(cal->monitor);
+		g_object_unref(cal->monitor);
+		cal->monitor=NULL;
+	}
+}
+
+//----------------------------------------------------------------------
+// archived years
+//----------------------------------------------------------------------
+
+// A year file can be archived: <year>.csvz keeps the same generation and
+// summary lines as <year>.csv, then a block index and the csv lines of
+// each month compressed with zlib as a separate block. The index gives
+// each block's offset (from the end of the index line), compressed and
+// plain size, number of events and the last month its events run into,
+// so a query pages in only the months it needs and decompresses only
+// their blocks. Completed years are rarely read and compress well, and
+// being out of the calendar file they are no longer rewritten by every
+// save. Archiving is done with --archive YEAR (see year conversion).
+
+#define ARCHIVE_SUFFIX "csvz"
+#define ARCHIVE_BLOCKS_HEADER "#blocks,"
+#define ARCHIVE_ALL_MONTHS 0xfff
+#define ARCHIVE_LEVEL 9 //written once, read many times
+
+typedef struct {
+	guint64 offset; //from the end of the index line
+	guint64 size; //compressed
+	guint64 raw_size;
+	int events;
+	int reach; //last month (0-11) its events run into
+} ArchiveBlock;
+
+typedef struct {
+	guint64 generation;
+	gsize data_start; //first byte after the index line
+	ArchiveBlock blocks[12];
+} ArchiveIndex;
+
+//month (1-12) of the last day of an event
+static int event_last_month(const Event *e)
+{
+	guint32 jd=julian_from_dmy(e->day, e->month, e->year);
+	if(jd==0) return e->month;
+	int day, month, year;
+	dmy_from_julian(jd + event_span_days(e), &day, &month, &year);
+	return (year==e->year) ? month : 12;
+}
+
+//"<offset>:<size>:<raw size>:<events>:<reach>" per month after ARCHIVE_BLOCKS_HEADER
+static gboolean archive_parse_blocks(const char *line, ArchiveBlock blocks[12])
+{
+	memset(blocks, 0, 12 * sizeof(ArchiveBlock));
+	gchar **entries=g_strsplit(line + strlen(ARCHIVE_BLOCKS_HEADER), ",", 12);
+	guint parsed=0;
+	for(guint m=0; m<12 && entries[m]; m++) {
+		ArchiveBlock *block=&blocks[m];
+		if(sscanf(entries[m], "%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%d:%d",
+			&block->offset, &block->size, &block->raw_size, &block->events, &block->reach)==5) parsed++;
+	}
+	g_strfreev(entries);
+	return parsed==12;
+}
+
+//header lines of a mapped archive
+static gboolean archive_read_index(const gchar *data, gsize len, ArchiveIndex *index)
+{
+	memset(index, 0, sizeof(ArchiveIndex));
+	const gchar *p=data;
+	const gchar *end=data + len;
+	while(p<end && *p=='#') {
+		const gchar *newline=memchr(p, '\n', end - p);
+		if(newline==NULL) return FALSE;
+		gchar *line=g_strndup(p, newline - p);
+		p=newline + 1;
+		if(g_str_has_prefix(line, CSV_HEADER)) {
+			index->generation=g_ascii_strtoull(line + strlen(CSV_HEADER), NULL, 10);
+		}
+		else if(g_str_has_prefix(line, ARCHIVE_BLOCKS_HEADER)) {
+			gboolean parsed=archive_parse_blocks(line, index->blocks);
+			g_free(line);
+			if(!parsed) return FALSE;
+			index->data_start=p - data;
+			for(int m=0; m<12; m++) {
+				ArchiveBlock *block=&index->blocks[m];
+				if(block->offset + block->size > len - index->data_start) return FALSE;
+			}
+			return TRUE;
+		}
+		g_free(line);
+	}
+	return FALSE;
+}
+
+//compress data into a zlib block, NULL on error
+static GByteArray* archive_deflate(const gchar *data, gsize len)
+{
+	GConverter *converter=G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, ARCHIVE_LEVEL));
+	GByteArray *block=g_byte_array_sized_new(len / 4 + 64);
+	guchar buffer[16384];
+	gsize read_total=0;
+	GConverterResult result;
+	do {
+		gsize bytes_read=0, bytes_written=0;
+		result=g_converter_convert(converter, data + read_total, len - read_total, buffer, sizeof(buffer),
+			G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_written, NULL);
+		read_total=read_total + bytes_read;
+		g_byte_array_append(block, buffer, bytes_written);
+	} while(result==G_CONVERTER_CONVERTED);
+	g_object_unref(converter);
+	if(result!=G_CONVERTER_FINISHED) {
+		g_byte_array_unref(block);
+		return NULL;
+	}
+	return block;
+}
+
+//decompress a zlib block of raw_size bytes, NULL if damaged, caller frees
+static gchar* archive_inflate(const guchar *data, gsize size, gsize raw_size)
+{
+	GConverter *converter=G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+	gchar *text=g_malloc(raw_size + 1); //room to detect a longer block
+	gsize read_total=0, written_total=0;
+	gsize bytes_read, bytes_written;
+	GConverterResult result;
+	do {
+		bytes_read=0;
+		bytes_written=0;
+		result=g_converter_convert(converter, data + read_total, size - read_total,
+			text + written_total, raw_size + 1 - written_total,
+			G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_written, NULL);
+		read_total=read_total + bytes_read;
+		written_total=written_total + bytes_written;
+	} while(result==G_CONVERTER_CONVERTED && written_total<=raw_size && (bytes_read>0 || bytes_written>0));
+	g_object_unref(converter);
+	if(result!=G_CONVERTER_FINISHED || written_total!=raw_size) {
+		g_free(text);
+		return NULL;
+	}
+	text[raw_size]='\0';
+	return text;
+}
+
+//rows (Event pointers) as csv lines
+static GBytes* archive_csv_text(GPtrArray *rows)
+{
+	GOutputStream *memory=g_memory_output_stream_new_resizable();
+	GDataOutputStream *data_stream=g_data_output_stream_new(memory);
+	for(guint i=0; i<rows->len; i++) csv_put_record(data_stream, g_ptr_array_index(rows, i));
+	g_output_stream_close(G_OUTPUT_STREAM(data_stream), NULL, NULL);
+	GBytes *text=g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(memory));
+	g_object_unref(data_stream);
+	g_object_unref(memory);
+	return text;
+}
+
+//replace file_name with an archive of rows (Event pointers of one year)
+static gboolean archive_write_file(const gchar *file_name, guint64 generation, const gchar *summary, GPtrArray *rows)
+{
+	GPtrArray *months[12];
+	for(int m=0; m<12; m++) months[m]=g_ptr_array_new();
+	for(guint i=0; i<rows->len; i++) {
+		Event *e=g_ptr_array_index(rows, i);
+		g_ptr_array_add(months[CLAMP(e->month, 1, 12) - 1], e);
+	}
+	
+	GString *index=g_string_new(ARCHIVE_BLOCKS_HEADER);
+	GByteArray *blocks=g_byte_array_new();
+	gboolean compressed=TRUE;
+	for(int m=0; m<12; m++) {
+		int reach=m;
+		for(guint i=0; i<months[m]->len; i++) reach=MAX(reach, event_last_month(g_ptr_array_index(months[m], i)) - 1);
+		guint64 offset=blocks->len;
+		gsize raw_size=0;
+		if(months[m]->len>0) {
+			GBytes *text=archive_csv_text(months[m]);
+			const gchar *data=g_bytes_get_data(text, &raw_size);
+			GByteArray *block=archive_deflate(data, raw_size);
+			g_bytes_unref(text);
+			if(block==NULL) {
+				compressed=FALSE;
+				break;
+			}
+			g_byte_array_append(blocks, block->data, block->len);
+			g_byte_array_unref(block);
+		}
+		g_string_append_printf(index, "%s%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%u:%d",
+			m ? "," : "", offset, (guint64) (blocks->len - offset), (guint64) raw_size, months[m]->len, reach);
+	}
+	for(int m=0; m<12; m++) g_ptr_array_unref(months[m]);
+	
+	gboolean saved=FALSE;
+	if(compressed) {
+		GString *contents=g_string_new(NULL);
+		g_string_append_printf(contents, "%s%" G_GUINT64_FORMAT "\n", CSV_HEADER, generation);
+		if(summary) g_string_append(contents, summary);
+		g_string_append_printf(contents, "%s\n", index->str);
+		g_string_append_len(contents, (const gchar*) blocks->data, blocks->len);
+		//written to a temporary file and renamed into place
+		GError *error=NULL;
+		saved=g_file_set_contents(file_name, contents->str, contents->len, &error);
+		if(!saved) {
+			g_print("error: unable to save archive %s: %s\n", file_name, error->message);
+			g_error_free(error);
+		}
+		g_string_free(contents, TRUE);
+	}
+	else g_print("error: unable to compress archive %s\n", file_name);
+	g_string_free(index, TRUE);
+	g_byte_array_unref(blocks);
+	return saved;
+}
+
+//parse the months (bit 0 = January) of an archive into events
+static gboolean archive_read_events(const gchar *file_name, guint months, GArray *events, ArchiveIndex *index)
+{
+	GMappedFile *file=g_mapped_file_new(file_name, FALSE, NULL);
+	if(file==NULL) return FALSE;
+	const gchar *data=g_mapped_file_get_contents(file);
+	gsize len=g_mapped_file_get_length(file);
+	gboolean read=data && archive_read_index(data, len, index);
+	for(int m=0; read && m<12; m++) {
+		ArchiveBlock *block=&index->blocks[m];
+		if(!(months & (1 << m)) || block->size==0) continue;
+		gchar *text=archive_inflate((const guchar*) data + index->data_start + block->offset, block->size, block->raw_size);
+		if(text==NULL) {
+			g_print("error: damaged block for month %d in %s\n", m + 1, file_name);
+			read=FALSE;
+			break;
+		}
+		csv_parse_lines(NULL, text, block->raw_size, events);
+		g_free(text);
+	}
+	g_mapped_file_unref(file);
+	return read;
+}
+
+//----------------------------------------------------------------------
+// year segments
+//----------------------------------------------------------------------
+
+// One-off events more than a year from today are cold: they are saved by
+// year in <calendar>-years/<year>.csv (events-years/2016.csv for
+// events.csv) instead of the calendar file, which keeps repeating events,
+// events running into another year and the current year +-1. Startup
+// reads the calendar file and lists the year files, so its time and
+// memory do not grow with the history kept. A year file starts with a
+// summary line giving its number of events and the events on each day
+// of the year as one hex digit (at most 15). A query pages in the years
+// it covers whose summary shows events on the queried days (only the
+// months it needs of an archived year), operations on whole calendars
+// (search, export, conflict report) page in every year, and years away
+// from the shown month are dropped again on a low memory warning or in
+// the background if unchanged since they were read. Year files are
+// written under the calendar lock and merged like the calendar file
+// (see external changes) if another process saved them.
+
+#define SEGMENT_DAYS_HEADER "#days,"
+#define SEGMENT_LOADED ARCHIVE_ALL_MONTHS //every month read
+
+static GMemoryMonitor *m_memory_monitor=NULL;
+
+static int current_year()
+{
+	GDateTime *now=g_date_time_new_now_local();
+	int year=g_date_time_get_year(now);
+	g_date_time_unref(now);
+	return year;
+}
+
+//year file an event is saved in, 0 for the calendar file
+static int event_cold_year(const Event *e, int this_year)
+{
+	if(event_is_recurring(e) || ABS(e->year - this_year)<=1) return 0;
+	guint32 jd=julian_from_dmy(e->day, e->month, e->year);
+	if(jd==0) return 0;
+	int day, month, year;
+	dmy_from_julian(jd + event_span_days(e), &day, &month, &year);
+	return (year==e->year) ? e->year : 0;
+}
+
+//caller frees
+static gchar* segment_dir(const Calendar *cal)
+{
+	const char *dot=strrchr(cal->file_name, '.');
+	int len=dot ? (int) (dot - cal->file_name) : (int) strlen(cal->file_name);
+	return g_strdup_printf("%.*s-years", len, cal->file_name);
+}
+
+//caller frees
+static gchar* segment_file_name(const Calendar *cal, int year, gboolean archived)
+{
+	gchar *dir=segment_dir(cal);
+	gchar *file_name=g_strdup_printf("%s/%d.%s", dir, year, archived ? ARCHIVE_SUFFIX : "csv");
+	g_free(dir);
+	return file_name;
+}
+
+//caller frees
+static gchar* segment_path(const Calendar *cal, const YearSegment *seg)
+{
+	return segment_file_name(cal, seg->year, seg->archived);
+}
+
+static void segment_free(gpointer data)
+{
+	YearSegment *seg=data;
+	if(seg->file_hashes) g_array_unref(seg->file_hashes);
+	g_free(seg);
+}
+
+static YearSegment* segment_find(Calendar *cal, int year)
+{
+	for(guint i=0; i<cal->segments->len; i++) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(seg->year==year) return seg;
+	}
+	return NULL;
+}
+
+//segments are kept in year order
+static YearSegment* segment_add(Calendar *cal, int year)
+{
+	YearSegment *seg=g_new0(YearSegment, 1);
+	seg->year=year;
+	guint i=0;
+	while(i<cal->segments->len && ((YearSegment*) g_ptr_array_index(cal->segments, i))->year<year) i++;
+	g_ptr_array_insert(cal->segments, i, seg);
+	return seg;
+}
+
+//events of the calendar saved in the file of year, caller frees
+static GPtrArray* segment_rows(Calendar *cal, int year, int this_year)
+{
+	GPtrArray *rows=g_ptr_array_new();
+	for(int i=0; i<cal->size; i++) {
+		if(event_cold_year(&cal->events[i], this_year)==year) g_ptr_array_add(rows, &cal->events[i]);
+	}
+	return rows;
+}
+
+//are rows what was read from the file or written to it
+static gboolean segment_is_clean(const YearSegment *seg, GPtrArray *rows)
+{
+	if(seg->file_hashes==NULL || seg->file_hashes->len!=rows->len) return FALSE;
+	GArray *hashes=sorted_row_hashes(rows);
+	gboolean clean=memcmp(hashes->data, seg->file_hashes->data, rows->len * sizeof(guint64))==0;
+	g_array_unref(hashes);
+	return clean;
+}
+
+static void segment_count_days(YearSegment *seg, GPtrArray *rows)
+{
+	memset(seg->day_counts, 0, sizeof(seg->day_counts));
+	memset(seg->month_totals, 0, sizeof(seg->month_totals));
+	for(int m=0; m<12; m++) seg->month_reach[m]=m;
+	seg->total=rows->len;
+	seg->summarised=TRUE;
+	guint32 first=julian_from_dmy(1, 1, seg->year);
+	for(guint i=0; i<rows->len; i++) {
+		const Event *e=g_ptr_array_index(rows, i);
+		guint32 jd=julian_from_dmy(e->day, e->month, e->year);
+		for(guint32 day=jd; day<=jd + event_span_days(e); day++) {
+			guint index=day - first;
+			if(index<G_N_ELEMENTS(seg->day_counts) && seg->day_counts[index]<15) seg->day_counts[index]++;
+		}
+		int m=CLAMP(e->month, 1, 12) - 1;
+		seg->month_totals[m]++;
+		seg->month_reach[m]=MAX(seg->month_reach[m], event_last_month(e) - 1);
+	}
+}
+
+//"#days,<total>,<hex digit per day>" line, caller frees
+static gchar* segment_summary_line(const YearSegment *seg)
+{
+	GString *line=g_string_sized_new(400);
+	g_string_append_printf(line, "%s%d,", SEGMENT_DAYS_HEADER, seg->total);
+	for(guint i=0; i<G_N_ELEMENTS(seg->day_counts); i++) g_string_append_c(line, "0123456789abcdef"[seg->day_counts[i]]);
+	g_string_append_c(line, '\n');
+	return g_string_free(line, FALSE);
+}
+
+//summary of a year file without reading its events
+static void segment_read_summary(Calendar *cal, YearSegment *seg)
+{
+	seg->summarised=TRUE;
+	seg->total=0;
+	memset(seg->day_counts, 0, sizeof(seg->day_counts));
+	memset(seg->month_totals, 0, sizeof(seg->month_totals));
+	for(int m=0; m<12; m++) seg->month_reach[m]=11; //unknown, any later month
+	gchar *file_name=segment_path(cal, seg);
+	FILE *file=fopen(file_name, "r");
+	g_free(file_name);
+	if(file==NULL) return;
+	
+	char line[1024];
+	gboolean found=FALSE;
+	while(fgets(line, sizeof(line), file) && line[0]=='#') {
+		if(g_str_has_prefix(line, ARCHIVE_BLOCKS_HEADER)) {
+			ArchiveBlock blocks[12];
+			archive_parse_blocks(line, blocks);
+			for(int m=0; m<12; m++) {
+				seg->month_totals[m]=blocks[m].events;
+				seg->month_reach[m]=CLAMP(blocks[m].reach, m, 11);
+			}
+			break; //compressed blocks follow
+		}
+		if(!g_str_has_prefix(line, SEGMENT_DAYS_HEADER)) continue;
+		char *counts;
+		seg->total=strtol(line + strlen(SEGMENT_DAYS_HEADER), &counts, 10);
+		if(*counts==',') counts++;
+		for(guint i=0; i<G_N_ELEMENTS(seg->day_counts) && g_ascii_isxdigit(counts[i]); i++) {
+			seg->day_counts[i]=g_ascii_xdigit_value(counts[i]);
+		}
+		found=TRUE;
+	}
+	fclose(file);
+	//no summary (edited by hand): page in for any day
+	if(!found) memset(seg->day_counts, 1, sizeof(seg->day_counts));
+}
+
+//months of an archived year with events on months month_from to month_to (0-11)
+static guint segment_months_needed(const YearSegment *seg, int month_from, int month_to)
+{
+	guint months=0;
+	for(int m=0; m<=month_to; m++) {
+		if(seg->month_totals[m]>0 && seg->month_reach[m]>=month_from) months=months | (1 << m);
+	}
+	return months;
+}
+
+//read months (bit 0 = January) of a year file not read yet into the
+//calendar, a csv year file is read whole
+static void segment_load(Calendar *cal, YearSegment *seg, guint months)
+{
+	if(!seg->archived) months=SEGMENT_LOADED;
+	months=months & ~seg->loaded;
+	if(months==0) return;
+	gchar *file_name=segment_path(cal, seg);
+	int first=cal->size;
+	seg->loaded=seg->loaded | months;
+	if(seg->archived) {
+		GArray *events=g_array_new(FALSE, FALSE, sizeof(Event));
+		ArchiveIndex index;
+		if(archive_read_events(file_name, months, events, &index)) seg->generation=index.generation;
+		else g_print("error: unable to read archive %s\n", file_name);
+		db_append_events(cal, events);
+		g_array_unref(events);
+	}
+	else {
+		ImportResult result;
+		if(import_file(file_name, IMPORT_CSV, cal - m_calendars, DUPLICATES_UNCHECKED, &result)) {
+			seg->generation=result.generation;
+		}
+	}
+	g_free(file_name);
+	
+	//the rows read join the ones read before
+	GPtrArray *rows=g_ptr_array_new();
+	for(int i=first; i<cal->size; i++) g_ptr_array_add(rows, &cal->events[i]);
+	GArray *hashes=sorted_row_hashes(rows);
+	g_ptr_array_unref(rows);
+	if(seg->file_hashes) {
+		g_array_append_vals(hashes, seg->file_hashes->data, seg->file_hashes->len);
+		g_array_sort(hashes, compare_hash);
+		g_array_unref(seg->file_hashes);
+	}
+	seg->file_hashes=hashes;
+}
+
+//list the year files of a calendar and read the ones near this year
+static void segments_open(Calendar *cal, int this_year)
+{
+	if(cal->segments==NULL) cal->segments=g_ptr_array_new_with_free_func(segment_free);
+	gchar *dir_name=segment_dir(cal);
+	GDir *dir=g_dir_open(dir_name, 0, NULL);
+	g_free(dir_name);
+	if(dir==NULL) return;
+	const gchar *name;
+	while((name=g_dir_read_name(dir))) {
+		int year=atoi(name);
+		gboolean archived=g_str_has_suffix(name, "." ARCHIVE_SUFFIX);
+		if(year<=0 || (!archived && !g_str_has_suffix(name, ".csv"))) continue;
+		YearSegment *seg=segment_find(cal, year);
+		if(seg==NULL) {
+			seg=segment_add(cal, year);
+			seg->archived=archived;
+			continue;
+		}
+		//both formats: a conversion stopped before removing the old file
+		gchar *listed=segment_path(cal, seg);
+		gchar *other=segment_file_name(cal, year, archived);
+		if(csv_file_generation(other)>csv_file_generation(listed)) seg->archived=archived;
+		g_free(listed);
+		g_free(other);
+	}
+	g_dir_close(dir);
+	
+	//a year file written by a process with another date, saved into the calendar file
+	for(guint i=0; i<cal->segments->len; i++) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(ABS(seg->year - this_year)<=1) segment_load(cal, seg, SEGMENT_LOADED);
+	}
+}
+
+//page in the year files with events on julian days jd_from to jd_to
+static void calendar_page_in(Calendar *cal, guint32 jd_from, guint32 jd_to)
+{
+	if(cal->segments==NULL || cal->segments->len==0 || jd_from==0) return;
+	int day, month_from, month_to, year_from, year_to;
+	dmy_from_julian(jd_from, &day, &month_from, &year_from);
+	dmy_from_julian(jd_to, &day, &month_to, &year_to);
+	for(guint i=0; i<cal->segments->len; i++) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(seg->loaded==SEGMENT_LOADED || seg->year<year_from || seg->year>year_to) continue;
+		if(!seg->summarised) segment_read_summary(cal, seg);
+		guint32 first=julian_from_dmy(1, 1, seg->year);
+		guint from=MAX(jd_from, first) - first;
+		guint to=MIN(jd_to - first, G_N_ELEMENTS(seg->day_counts) - 1);
+		for(guint index=from; index<=to; index++) {
+			if(seg->day_counts[index]==0) continue;
+			int first_month=(seg->year==year_from) ? month_from - 1 : 0;
+			int last_month=(seg->year==year_to) ? month_to - 1 : 11;
+			segment_load(cal, seg, segment_months_needed(seg, first_month, last_month));
+			break;
+		}
+	}
+}
+
+//every year file of every calendar, for operations on whole calendars
+static void db_load_all_years()
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		if(cal->segments==NULL) continue;
+		for(guint i=0; i<cal->segments->len; i++) {
+			segment_load(cal, g_ptr_array_index(cal->segments, i), SEGMENT_LOADED);
+		}
+	}
+}
+
+//events in year files not read yet
+static int calendar_unloaded_events(Calendar *cal)
+{
+	int count=0;
+	if(cal->segments==NULL) return 0;
+	for(guint i=0; i<cal->segments->len; i++) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(seg->loaded==SEGMENT_LOADED) continue;
+		if(!seg->summarised) segment_read_summary(cal, seg);
+		if(!seg->archived) {
+			count=count + seg->total;
+			continue;
+		}
+		for(int m=0; m<12; m++) {
+			if(!(seg->loaded & (1 << m))) count=count + seg->month_totals[m];
+		}
+	}
+	return count;
+}
+
+//apply the changes another process saved in a year file
+static void segment_merge(Calendar *cal, YearSegment *seg)
+{
+	gchar *file_name=segment_path(cal, seg);
+	if(!file_exists(file_name) || csv_file_generation(file_name)==seg->generation) {
+		g_free(file_name);
+		return;
+	}
+	if(seg->archived) {
+		GArray *events=g_array_new(FALSE, FALSE, sizeof(Event));
+		ArchiveIndex index;
+		if(archive_read_events(file_name, SEGMENT_LOADED, events, &index)) {
+			GArray *rows=calendar_row_hashes((const Event*) events->data, events->len);
+			calendar_apply_rows(cal - m_calendars, rows, &seg->file_hashes);
+			seg->generation=index.generation;
+			g_array_unref(rows);
+		}
+		g_array_unref(events);
+	}
+	else csv_merge_file(cal - m_calendars, file_name, &seg->file_hashes, &seg->generation);
+	g_free(file_name);
+}
+
+//before saving: page in the year files that events in memory belong to
+//(they are rewritten) and merge year files saved by another process
+static void segments_prepare(Calendar *cal, int this_year)
+{
+	if(cal->segments==NULL) cal->segments=g_ptr_array_new_with_free_func(segment_free);
+	int last_year=0;
+	for(int i=0; i<cal->size; i++) {
+		int year=event_cold_year(&cal->events[i], this_year);
+		if(year==0 || year==last_year) continue;
+		last_year=year;
+		YearSegment *seg=segment_find(cal, year);
+		if(seg==NULL) {
+			seg=segment_add(cal, year);
+			//a new year file, unless another process has just written one
+			gchar *archive_name=segment_file_name(cal, year, TRUE);
+			seg->archived=file_exists(archive_name);
+			g_free(archive_name);
+			gchar *file_name=segment_path(cal, seg);
+			seg->loaded=file_exists(file_name) ? 0 : SEGMENT_LOADED;
+			g_free(file_name);
+		}
+		if(seg->loaded==0) segment_load(cal, seg, SEGMENT_LOADED); //appends, cal->events may move
+	}
+	
+	for(guint i=0; i<cal->segments->len; i++) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(seg->loaded==0) continue;
+		if(seg->loaded!=SEGMENT_LOADED) {
+			//an archive read in part is only rewritten if its events changed
+			GPtrArray *rows=segment_rows(cal, seg->year, this_year);
+			gboolean clean=segment_is_clean(seg, rows);
+			g_ptr_array_unref(rows);
+			if(clean) continue;
+			segment_load(cal, seg, SEGMENT_LOADED);
+		}
+		segment_merge(cal, seg);
+	}
+}
+
+//a cleared calendar deletes its year files on the next save
+static void segments_clear(Calendar *cal)
+{
+	if(cal->segments==NULL) return;
+	for(guint i=0; i<cal->segments->len; i++) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(seg->loaded==SEGMENT_LOADED) continue;
+		gchar *file_name=segment_path(cal, seg);
+		seg->generation=csv_file_generation(file_name); //nothing to merge
+		seg->loaded=SEGMENT_LOADED;
+		g_free(file_name);
+	}
+}
+
+//drop the events of unchanged years outside keep_from to keep_to
+static void db_evict_years(int keep_from, int keep_to)
+{
+	int this_year=current_year();
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		if(cal->segments==NULL) continue;
+		gboolean evicted=FALSE;
+		for(guint i=0; i<cal->segments->len; i++) {
+			YearSegment *seg=g_ptr_array_index(cal->segments, i);
+			if(seg->loaded==0 || (seg->year>=keep_from && seg->year<=keep_to)) continue;
+			GPtrArray *rows=segment_rows(cal, seg->year, this_year);
+			gboolean clean=segment_is_clean(seg, rows);
+			//the summary of the file (an archive read in part was summarised to page in)
+			if(clean && seg->loaded==SEGMENT_LOADED) segment_count_days(seg, rows);
+			g_ptr_array_unref(rows);
+			if(!clean) continue; //kept until saved
+			
+			int size=0;
+			for(int j=0; j<cal->size; j++) {
+				if(event_cold_year(&cal->events[j], this_year)==seg->year) continue;
+				cal->events[size]=cal->events[j];
+				size++;
+			}
+			cal->size=size;
+			seg->loaded=0;
+			g_array_unref(seg->file_hashes);
+			seg->file_hashes=NULL;
+			evicted=TRUE;
+		}
+		if(!evicted) continue;
+		db_shrink(cal);
+		db_store_changed(cal);
+		search_index_invalidate();
+	}
+}
+
+static void trim_task_func(Task *task, gpointer data)
+{
+	malloc_trim(0);
+}
+
+static void callbk_low_memory_warning(GMemoryMonitor *monitor, GMemoryMonitorWarningLevel level, gpointer user_data)
+{
+	db_evict_years(m_year - 1, m_year + 1); //the shown month and its neighbours stay
+	task_submit(TASK_IDLE, trim_task_func, NULL, NULL); //walks the whole heap
+}
+
+static void memory_monitor_start()
+{
+	m_memory_monitor=g_memory_monitor_dup_default();
+	g_signal_connect(m_memory_monitor, "low-memory-warning", G_CALLBACK(callbk_low_memory_warning), NULL);
+}
+
+static void memory_monitor_stop()
+{
+	g_clear_object(&m_memory_monitor);
+}
+
+//----------------------------------------------------------------------
+// background saves
+//----------------------------------------------------------------------
+
+// Saving a large calendar should not freeze the window. A save picks
+// the rows of each file on the main thread while holding the calendar
+// locks (save_calendar_snapshot: a SaveFile per calendar and year file,
+// after merging what other processes saved) as indices in the published
+// version of the calendar (see store snapshots), writes them on a
+// thread that then releases the locks (save_file_write skips a file whose
+// rows hash the same as what it holds) and applies the new generations
+// and row hashes back on the main thread (save_file_done), so edits made
+// meanwhile are saved next time. The writing is a worker pool task.
+// Every change schedules an autosave AUTOSAVE_DELAY seconds after the
+// last one. Closing the window or
+// quitting waits for the save behind a progress dialog; shutdown and
+// command line saves write on the calling thread (save_csv_file).
+
+#define AUTOSAVE_DELAY 3 //seconds after the last change
+#define SAVE_PROGRESS_INTERVAL 100 //ms
+
+//a file to write, taken from a calendar so it can be written on another thread
+typedef struct {
+	int calendar;
+	int year; //0 for the calendar file
+	gboolean archived;
+	gchar *file_name;
+	gchar *summary; //year files
+	guint64 generation; //to write
+	StoreVersion *version; //of the calendar when copied
+	GArray *rows; //indices in version of the rows to write, none removes a year file
+	GArray *baseline; //sorted hashes of the rows in the file, NULL if unknown
+	GArray *hashes; //sorted hashes of events once written
+	gboolean written;
+} SaveFile;
+
+typedef void (*SaveDone)(gpointer user_data);
+
+typedef struct {
+	GPtrArray *files; //SaveFile
+	int locks[NUM_CALENDARS]; //released once written
+	gint files_done; //atomic, for the progress dialog
+	Task *task; //writing the files
+	SaveDone done;
+	gpointer user_data;
+} SaveJob;
+
+typedef struct {
+	GtkWidget *dialog;
+	guint timer;
+	SaveDone done;
+	gpointer user_data;
+} SaveProgress;
+
+static SaveJob *m_save_job=NULL; //being written
+static gboolean m_save_again=FALSE; //changed (or closing) while being written
+static SaveDone m_save_waiter=NULL; //called after the next save
+static gpointer m_save_waiter_data=NULL;
+static SaveProgress *m_save_progress=NULL; //closing or quitting
+static guint m_autosave_source=0;
+
+//rows (pointers to the calendar's events) are kept as indices in its
+//version in the published snapshot, summary is taken
+static SaveFile* save_file_new(int calendar, int year, gboolean archived, const gchar *file_name, guint64 generation, gchar *summary, GPtrArray *rows, GArray *baseline)
+{
+	Calendar *cal=&m_calendars[calendar];
+	store_publish(); //the snapshot holds the events as they are now
+	StoreSnapshot *snapshot=store_snapshot_acquire();
+	SaveFile *file=g_new0(SaveFile, 1);
+	file->calendar=calendar;
+	file->year=year;
+	file->archived=archived;
+	file->file_name=g_strdup(file_name);
+	file->summary=summary;
+	file->generation=generation;
+	file->version=g_atomic_rc_box_acquire(snapshot->calendars[calendar]);
+	store_snapshot_release(snapshot);
+	file->rows=g_array_sized_new(FALSE, FALSE, sizeof(int), rows->len);
+	for(guint i=0; i<rows->len; i++) {
+		int index=(Event*) g_ptr_array_index(rows, i) - cal->events;
+		g_array_append_val(file->rows, index);
+	}
+	if(baseline) file->baseline=g_array_copy(baseline);
+	return file;
+}
+
+static void save_file_free(gpointer data)
+{
+	SaveFile *file=data;
+	g_free(file->file_name);
+	g_free(file->summary);
+	g_atomic_rc_box_release(file->version);
+	g_array_unref(file->rows);
+	if(file->baseline) g_array_unref(file->baseline);
+	if(file->hashes) g_array_unref(file->hashes);
+	g_free(file);
+}
+
+//any thread: write the file unless it already holds the rows
+static void save_file_write(SaveFile *file)
+{
+	if(file->year && file->rows->len==0) {
+		g_remove(file->file_name);
+		return;
+	}
+	GPtrArray *rows=g_ptr_array_sized_new(file->rows->len);
+	for(guint i=0; i<file->rows->len; i++) g_ptr_array_add(rows, &file->version->events[g_array_index(file->rows, int, i)]);
+	GArray *hashes=sorted_row_hashes(rows);
+	gboolean unchanged=file->baseline && file->baseline->len==hashes->len
+		&& memcmp(file->baseline->data, hashes->data, hashes->len * sizeof(guint64))==0
+		&& file_exists(file->file_name);
+	if(!unchanged) {
+		if(file->year) {
+			gchar *dir=g_path_get_dirname(file->file_name);
+			g_mkdir_with_parents(dir, 0755);
+			g_free(dir);
+		}
+		file->written=file->archived
+			? archive_write_file(file->file_name, file->generation, file->summary, rows)
+			: csv_write_file(file->file_name, file->generation, file->summary, rows);
+	}
+	if(file->written && file->year) {
+		//the year changed format (see segment_set_archived)
+		gchar *other=segment_file_name(&m_calendars[file->calendar], file->year, !file->archived);
+		if(file_exists(other)) g_remove(other);
+		g_free(other);
+	}
+	g_ptr_array_unref(rows);
+	if(file->written) file->hashes=hashes;
+	else g_array_unref(hashes);
+}
+
+//main thread: the file now holds the rows that were copied
+static void save_file_done(SaveFile *file)
+{
+	if(!file->written) return;
+	Calendar *cal=&m_calendars[file->calendar];
+	GArray **hashes;
+	if(file->year==0) {
+		cal->file_generation=file->generation;
+		cal->file_version++; //a parse of the file in flight is dropped
+		hashes=&cal->file_hashes;
+	}
+	else {
+		YearSegment *seg=segment_find(cal, file->year);
+		if(seg==NULL || seg->archived!=file->archived) return; //converted since
+		seg->generation=file->generation;
+		if(seg->loaded==0) return; //dropped from memory since
+		hashes=&seg->file_hashes;
+	}
+	if(*hashes) g_array_unref(*hashes);
+	*hashes=file->hashes;
+	file->hashes=NULL;
+}
+
+//a year file holding rows, counting its summary
+static SaveFile* segment_save_file(Calendar *cal, YearSegment *seg, GPtrArray *rows, GArray *baseline)
+{
+	gchar *summary=NULL;
+	if(rows->len>0) {
+		segment_count_days(seg, rows);
+		summary=segment_summary_line(seg);
+	}
+	gchar *file_name=segment_path(cal, seg);
+	SaveFile *file=save_file_new(cal - m_calendars, seg->year, seg->archived, file_name,
+		seg->generation + 1, summary, rows, baseline);
+	g_free(file_name);
+	return file;
+}
+
+//write rows to the year file in its format now, removing one in the other
+static gboolean segment_write(Calendar *cal, YearSegment *seg, GPtrArray *rows)
+{
+	SaveFile *file=segment_save_file(cal, seg, rows, NULL);
+	save_file_write(file);
+	save_file_done(file);
+	gboolean written=file->written;
+	save_file_free(file);
+	return written;
+}
+
+//copy the year files read whole to files, emptied ones are removed
+static void segments_snapshot(Calendar *cal, int this_year, GPtrArray *files)
+{
+	guint i=0;
+	while(i<cal->segments->len) {
+		YearSegment *seg=g_ptr_array_index(cal->segments, i);
+		if(seg->loaded!=SEGMENT_LOADED) { //unread or unchanged (see segments_prepare)
+			i++;
+			continue;
+		}
+		GPtrArray *rows=segment_rows(cal, seg->year, this_year);
+		g_ptr_array_add(files, segment_save_file(cal, seg, rows, seg->file_hashes));
+		if(rows->len==0) g_ptr_array_remove_index(cal->segments, i);
+		else i++;
+		g_ptr_array_unref(rows);
+	}
+}
+
+//lock a calendar (unless lock is already held), merge what other processes
+//saved and copy its files to files, returns the lock to release once they
+//are written
+static int save_calendar_snapshot(Calendar *cal, GPtrArray *files, int lock)
+{
+	const gchar *file_name =cal->file_name;
+	
+	//g_print("Saving csv data with filename = %s\n",file_name);
+	
+	if(lock<0) lock=calendar_lock(cal);
+	if(lock<0) g_print("warning: unable to lock %s, saving anyway\n", file_name);
+	
+	//changes saved by another process (or program) are merged, not overwritten
+	if(cal->reconcile_source || cal->reconcile_job || csv_file_generation(file_name)!=cal->file_generation) {
+		calendar_reconcile_now(cal - m_calendars);
+	}
+	
+	//one-off events of cold years go to their year files
+	int this_year=current_year();
+	segments_prepare(cal, this_year);
+	GPtrArray *rows=g_ptr_array_new();
+	for (int i=0; i<cal->size; i++) {
+		if(event_cold_year(&cal->events[i], this_year)==0) g_ptr_array_add(rows, &cal->events[i]);
+	}
+	g_ptr_array_add(files, save_file_new(cal - m_calendars, 0, FALSE, file_name,
+		cal->file_generation + 1, NULL, rows, cal->file_hashes));
+	g_ptr_array_unref(rows);
+	segments_snapshot(cal, this_year, files);
+	return lock;
+}
+
+//main thread: copy every calendar (no file is created for one never used),
+//locks (may be NULL) holds calendar locks already taken, given to the job
+static SaveJob* save_job_new(const int *locks)
+{
+	SaveJob *job=g_new0(SaveJob, 1);
+	job->files=g_ptr_array_new_with_free_func(save_file_free);
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		job->locks[c]=locks ? locks[c] : -1;
+		if(cal->size==0 && !file_exists(cal->file_name) && (cal->segments==NULL || cal->segments->len==0)) continue;
+		job->locks[c]=save_calendar_snapshot(cal, job->files, job->locks[c]);
+	}
+	return job;
+}
+
+//any thread
+static void save_job_write(SaveJob *job)
+{
+	for(guint i=0; i<job->files->len; i++) {
+		save_file_write(g_ptr_array_index(job->files, i));
+		g_atomic_int_inc(&job->files_done);
+	}
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		calendar_unlock(job->locks[c]);
+		job->locks[c]=-1;
+	}
+}
+
+//main thread: apply what was written, free the job and call its done
+static void save_job_finish(SaveJob *job)
+{
+	for(guint i=0; i<job->files->len; i++) save_file_done(g_ptr_array_index(job->files, i));
+	SaveDone done=job->done;
+	gpointer user_data=job->user_data;
+	g_ptr_array_unref(job->files);
+	g_free(job);
+	if(done) done(user_data);
+}
+
+static void save_start(SaveDone done, gpointer user_data);
+
+static void save_task_done(Task *task, gpointer data)
+{
+	SaveJob *job=data;
+	m_save_job=NULL;
+	save_job_finish(job);
+	if(m_save_again) {
+		SaveDone waiter=m_save_waiter;
+		gpointer waiter_data=m_save_waiter_data;
+		m_save_again=FALSE;
+		m_save_waiter=NULL;
+		m_save_waiter_data=NULL;
+		save_start(waiter, waiter_data);
+	}
+}
+
+static void save_task_func(Task *task, gpointer data)
+{
+	save_job_write(data);
+}
+
+//write a job with no save in flight on a thread at priority (a TASK_ class)
+static void save_submit(SaveJob *job, int priority)
+{
+	if(job->files->len==0) {
+		save_job_write(job); //releases the locks
+		save_job_finish(job);
+		return;
+	}
+	m_save_job=job;
+	job->task=task_submit(priority, save_task_func, save_task_done, job);
+}
+
+//save every calendar on a thread and call done (may be NULL) on the main
+//thread once written, after the save in flight if there is one
+static void save_start(SaveDone done, gpointer user_data)
+{
+	if(m_save_job) {
+		m_save_again=TRUE;
+		if(done) {
+			m_save_waiter=done;
+			m_save_waiter_data=user_data;
+		}
+		return;
+	}
+	SaveJob *job=save_job_new(NULL);
+	job->done=done;
+	job->user_data=user_data;
+	save_submit(job, TASK_NORMAL);
+}
+
+//finish the save in flight on this thread, what was to be called after it is dropped
+static void save_wait()
+{
+	SaveJob *job=m_save_job;
+	if(job==NULL) return;
+	m_save_again=FALSE;
+	m_save_waiter=NULL;
+	m_save_waiter_data=NULL;
+	job->done=NULL;
+	task_wait(job->task); //finishes the job
+}
+
+static gboolean callbk_autosave(gpointer user_data)
+{
+	m_autosave_source=0;
+	save_start(NULL, NULL);
+	return G_SOURCE_REMOVE;
+}
+
+//save a while after the last change
+static void autosave_schedule()
+{
+	if(m_headless || !m_db_open) return;
+	if(m_autosave_source) g_source_remove(m_autosave_source);
+	m_autosave_source=g_timeout_add_seconds(AUTOSAVE_DELAY, callbk_autosave, NULL);
+}
+
+static void autosave_cancel()
+{
+	if(m_autosave_source) g_source_remove(m_autosave_source);
+	m_autosave_source=0;
+}
+
+//save every calendar on this thread, after the save in flight
+void save_csv_file(){
+	save_wait();
+	SaveJob *job=save_job_new(NULL);
+	save_job_write(job);
+	save_job_finish(job);
+}
+
+static gboolean callbk_save_progress_timeout(gpointer user_data)
+{
+	SaveProgress *progress=user_data;
+	GtkWidget *progress_bar = g_object_get_data(G_OBJECT(progress->dialog), "progress-bar-key");
+	if(m_save_job) {
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar),
+			(double) g_atomic_int_get(&m_save_job->files_done) / m_save_job->files->len);
+	}
+	else gtk_progress_bar_pulse(GTK_PROGRESS_BAR(progress_bar)); //waiting to start
+	//shown only if saving takes a while
+	if(!gtk_widget_get_visible(progress->dialog)) gtk_window_present(GTK_WINDOW(progress->dialog));
+	return G_SOURCE_CONTINUE;
+}
+
+static void save_progress_done(gpointer user_data)
+{
+	SaveProgress *progress=user_data;
+	m_save_progress=NULL;
+	g_source_remove(progress->timer);
+	gtk_window_destroy(GTK_WINDOW(progress->dialog));
+	progress->done(progress->user_data);
+	g_free(progress);
+}
+
+//save every calendar on a thread behind a progress dialog, then call done
+static void save_with_progress(GtkWindow *window, SaveDone done, gpointer user_data)
+{
+	GtkWidget *dialog;
+	GtkWidget *box;
+	GtkWidget *label;
+	GtkWidget *progress_bar;
+	
+	if(m_save_progress) return; //already waiting
+	autosave_cancel();
+	
+	//not destroyed with the window, save_progress_done closes it
+	dialog = gtk_dialog_new_with_buttons ("Saving", window, 
+	GTK_DIALOG_MODAL|GTK_DIALOG_USE_HEADER_BAR, NULL, NULL);
+	gtk_window_set_deletable(GTK_WINDOW(dialog), FALSE);
+	gtk_window_set_default_size(GTK_WINDOW(dialog),350,80);
+	
+	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+	gtk_window_set_child (GTK_WINDOW (dialog), box);
+	
+	label =gtk_label_new("Saving events");
+	progress_bar =gtk_progress_bar_new();
+	gtk_box_append(GTK_BOX(box), label);
+	gtk_box_append(GTK_BOX(box), progress_bar);
+	g_object_set_data(G_OBJECT(dialog), "progress-bar-key",progress_bar);
+	
+	GtkStyleContext *context_dialog;	
 	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
 	GtkCssProvider *cssProvider;	
 	cssProvider = gtk_css_provider_new();
 	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
-	
-	// get GtkStyleContext from widget
 	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
-	//finally load style provider 
 	gtk_style_context_add_provider(context_dialog,    
 	GTK_STYLE_PROVIDER(cssProvider), 
-	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
-	//gtk_widget_show(dialog);	    
-  
-  g_signal_connect (dialog, "response", G_CALLBACK (callbk_edit_event_response),window);
-  
-  gtk_window_present (GTK_WINDOW (dialog)); 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+	
+	SaveProgress *progress=g_new0(SaveProgress, 1);
+	progress->dialog=dialog;
+	progress->done=done;
+	progress->user_data=user_data;
+	progress->timer=g_timeout_add(SAVE_PROGRESS_INTERVAL, callbk_save_progress_timeout, progress);
+	m_save_progress=progress;
+	save_start(save_progress_done, progress); //may be done already
+}
 
+static void save_done_quit(gpointer user_data)
+{
+	g_application_quit(G_APPLICATION(user_data));
 }
- 
-static void callbk_delete_selected(GtkButton *button, gpointer  user_data){
-		
-	if (m_row_index==-1) return;
-	
-	GtkWindow *window =user_data;
-	
-	//remove event from db  
-	int j=0;
-	Event e;
-	for(int i=0; i<m_db_size; i++)
-	{
-	e=db_store[i];      
-	if(e.id==m_id_selection){
-	continue;
-	}
-	db_store[j] = db_store[i];
-	j++;
-	}
-	
-	////Decrement db size
-	m_db_size=m_db_size-1;
-	
-	g_list_store_remove (m_store, m_row_index); //remove selected
-	update_calendar(GTK_WINDOW(window));
-	update_store(m_year, m_month, m_day); 
-	
+
+static void save_done_close(gpointer user_data)
+{
+	GtkWindow *window=user_data;
+	g_object_set_data(G_OBJECT(window), "saved-key", GINT_TO_POINTER(1));
+	gtk_window_close(window);
+	g_object_unref(window);
+}
+
+//the window closes once the events are saved
+static gboolean callbk_window_close_request(GtkWindow *window, gpointer user_data)
+{
+	if(g_object_get_data(G_OBJECT(window), "saved-key")) return FALSE;
+	if(m_save_progress==NULL) save_with_progress(window, save_done_close, g_object_ref(window));
+	return TRUE;
 }
 
 //----------------------------------------------------------------------
-// flat csv database functions
+// year conversion
 //----------------------------------------------------------------------
 
-int break_fields(char *s, char** data, int n)
+// --archive YEAR and --unarchive YEAR convert the year file of every
+// calendar (a calendar file from before year files is split first, as a
+// save would). The year is read whole and merged with what other processes
+// saved on the main thread under the calendar lock, its format flag is
+// flipped and a save of its own writes it (compressing it from the
+// published snapshot) as an idle pool task, removing the file in the old
+// format. Saves started meanwhile wait for it like for any save. The read
+// latency of a new archive is then timed by another idle task and the
+// report (disk space saved, time to read the busiest month and the whole
+// year) is passed to the caller's reply on the main thread, which for
+// a second launch is the reply to its Archive call (see remote commands).
+
+typedef void (*ArchiveReply)(const gchar *report, gpointer user_data);
+
+typedef struct {
+	int year;
+	gboolean archive;
+	guint converting; //bit per calendar
+	guint events[NUM_CALENDARS];
+	goffset old_size[NUM_CALENDARS];
+	gchar *file_name[NUM_CALENDARS]; //new archives to time, NULL otherwise
+	int busiest[NUM_CALENDARS]; //month read as a query would
+	int busiest_events[NUM_CALENDARS];
+	gint64 month_time[NUM_CALENDARS]; //us
+	gint64 year_time[NUM_CALENDARS];
+	GString *report;
+	ArchiveReply reply;
+	gpointer user_data;
+} ArchiveRequest;
+
+static goffset file_size(const char *file_name)
 {
-	//n = number of fields
-	//assumes comma delimiter
-	
-	int fields=0;
-	int i;
-	char *start=s; //start at begiining of string
-	char *end=s; //walking pointer
-	
-	for(i=0; i<n; i++)
-	{
-		while(*end !=',' && *end != '\0') {
-			end++;			
+	GStatBuf buf;
+	return (g_stat(file_name, &buf)==0) ? buf.st_size : 0;
+}
+
+static void archive_request_reply(ArchiveRequest *request)
+{
+	request->reply(request->report->str, request->user_data);
+	for(int c=0; c<NUM_CALENDARS; c++) g_free(request->file_name[c]);
+	g_string_free(request->report, TRUE);
+	g_free(request);
+}
+
+//any thread: read the busiest month of each new archive, then the whole year
+static void archive_time_func(Task *task, gpointer data)
+{
+	ArchiveRequest *request=data;
+	GArray *parsed=g_array_new(FALSE, FALSE, sizeof(Event));
+	ArchiveIndex index;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(request->file_name[c]==NULL) continue;
+		gint64 begin=g_get_monotonic_time();
+		archive_read_events(request->file_name[c], 1 << request->busiest[c], parsed, &index);
+		request->month_time[c]=g_get_monotonic_time() - begin;
+		g_array_set_size(parsed, 0);
+		begin=g_get_monotonic_time();
+		archive_read_events(request->file_name[c], SEGMENT_LOADED, parsed, &index);
+		request->year_time[c]=g_get_monotonic_time() - begin;
+		g_array_set_size(parsed, 0);
+	}
+	g_array_unref(parsed);
+}
+
+static void archive_time_done(Task *task, gpointer data)
+{
+	ArchiveRequest *request=data;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(request->file_name[c]==NULL) continue;
+		g_string_append_printf(request->report, "%s %d: reading month %d (%d events) takes %.2f ms, the whole year %.2f ms\n",
+			m_calendars[c].name, request->year, request->busiest[c] + 1, request->busiest_events[c],
+			request->month_time[c] / 1000.0, request->year_time[c] / 1000.0);
+	}
+	archive_request_reply(request);
+}
+
+//main thread: the save writing the converted years is done
+static void archive_saved(gpointer user_data)
+{
+	ArchiveRequest *request=user_data;
+	gboolean timing=FALSE;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(!(request->converting & (1 << c))) continue;
+		Calendar *cal=&m_calendars[c];
+		YearSegment *seg=segment_find(cal, request->year);
+		gchar *file_name=seg ? segment_path(cal, seg) : NULL;
+		if(file_name==NULL || !file_exists(file_name)) {
+			if(seg) seg->archived=!request->archive; //an emptied year is removed by the next save
+			g_string_append_printf(request->report, "%s %d: not converted\n", cal->name, request->year);
+			g_free(file_name);
+			continue;
 		}
-		
-		if(*end =='\0') {
-			
-			data[i]=(char*) malloc(strlen(start)+1);
-			strcpy(data[i],start);
-			fields++;
-			break;
+		goffset old_size=request->old_size[c];
+		goffset new_size=file_size(file_name);
+		gchar *old_str=g_format_size(old_size);
+		gchar *new_str=g_format_size(new_size);
+		if(old_size==0) {
+			g_string_append_printf(request->report, "%s %d: %u events moved out of %s into %s (%s)\n", cal->name,
+				request->year, request->events[c], cal->file_name, file_name, new_str);
 		}
-		else if (*end ==',') {
-			*end ='\0';
-			data[i]=(char*) malloc(strlen(start)+1);
-			strcpy(data[i],start);
-			start=end+1;
-			end=start;
-			fields++;
+		else g_string_append_printf(request->report, "%s %d: %u events, %s -> %s (%d%% %s)\n", cal->name, request->year,
+			request->events[c], old_str, new_str, (int) (ABS(old_size - new_size) * 100 / old_size),
+			new_size<=old_size ? "smaller" : "larger");
+		g_free(old_str);
+		g_free(new_str);
+		if(!request->archive) {
+			g_free(file_name);
+			continue;
 		}
-		
+		int busiest=0;
+		for(int m=1; m<12; m++) if(seg->month_totals[m]>seg->month_totals[busiest]) busiest=m;
+		request->busiest[c]=busiest;
+		request->busiest_events[c]=seg->month_totals[busiest];
+		request->file_name[c]=file_name;
+		timing=TRUE;
 	}
-		
-	return fields;
-	
-} 
-
-void load_csv_file(){
-	
-	
-	int field_num =11;
-	
-	char *data[field_num]; // fields
-	int i = 0; //counter	
-    int total_num_lines = 0; //total number of lines
-    int ret;
-    
-	GFile *file;
-    GFileInputStream *file_stream=NULL;   
-	GDataInputStream *input = NULL;
-    
-    file = g_file_new_for_path("events.csv");
+	if(timing) task_submit(TASK_IDLE, archive_time_func, archive_time_done, request);
+	else archive_request_reply(request);
+}
 
-	file_stream = g_file_read(file, NULL, NULL);	
-	if(!file_stream) {
-		g_print("error: unable to open database\n");
-		return;
-	}
-	
-	input = g_data_input_stream_new (G_INPUT_STREAM (file_stream));
-		
-	while (TRUE) {
-		
-		char *line;
-		line = g_data_input_stream_read_line (input, NULL, NULL, NULL);		
-		if (line == NULL) break;
-		
-		Event e;  
-		      
-        ret=break_fields(line,data,field_num);
-        //g_print("break_fields return value %d\n",ret);
-		
-		for (int j=0; j<field_num;j++) {
-			
-			
-			if (j==0) e.id =m_db_size; 
-			if (j==1) strcpy(e.title,data[j]);
-			if (j==2) strcpy(e.location,data[j]);
-			if (j==3) e.year=atoi(data[j]);
-			if (j==4) e.month=atoi(data[j]);
-			if (j==5) e.day=atoi(data[j]);				          
-			          
-			if (j==6) e.start_time=atof(data[j]);
-			if (j==7) e.end_time=atof(data[j]);          
-			
-			if (j==8) e.priority=atoi(data[j]);
-			if (j==9) e.is_yearly=atoi(data[j]);
-			if (j==10) e.is_allday=atoi(data[j]);
-			
-			//printf("data[%d] = %s\n",j, data[j]);
-			free(data[j]);
-			
+//main thread: convert year of every calendar to (archive) or from an
+//archive, reply is called with the report once written
+static void archive_convert_year(int year, gboolean archive, ArchiveReply reply, gpointer user_data)
+{
+	ArchiveRequest *request=g_new0(ArchiveRequest, 1);
+	request->year=year;
+	request->archive=archive;
+	request->report=g_string_new(NULL);
+	request->reply=reply;
+	request->user_data=user_data;
+	
+	//the conversion is a save of its own, finish the ones in flight (and
+	//queued behind them) first
+	while(m_save_job) task_wait(m_save_job->task);
+	int locks[NUM_CALENDARS];
+	gboolean found=FALSE;
+	int this_year=current_year();
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		locks[c]=-1;
+		YearSegment *seg=cal->segments ? segment_find(cal, year) : NULL;
+		if(seg==NULL) {
+			//a calendar file from before year files: split it first
+			gboolean in_memory=FALSE;
+			for(int i=0; i<cal->size && !in_memory; i++) in_memory=event_cold_year(&cal->events[i], this_year)==year;
+			if(!in_memory) continue;
+			locks[c]=calendar_lock(cal);
+			segments_prepare(cal, this_year);
+			seg=segment_find(cal, year);
 		}
-		
-		db_store[m_db_size] =e;			
-		m_db_size=m_db_size+1;		
-		if(m_db_size>max_records)
-		{
-			g_print("Error: max number of records exceeded\n");
-			exit(1);
+		found=TRUE;
+		if(seg->archived==archive) {
+			g_string_append_printf(request->report, "%s %d: already %s\n", cal->name, year, archive ? "archived" : "not archived");
+			continue;
 		}
-		i++;		
+		//held until the save has written the year
+		if(locks[c]<0) locks[c]=calendar_lock(cal);
+		segment_load(cal, seg, SEGMENT_LOADED);
+		segment_merge(cal, seg);
+		GPtrArray *rows=segment_rows(cal, year, this_year);
+		request->events[c]=rows->len;
+		g_ptr_array_unref(rows);
+		if(request->events[c]==0) {
+			g_string_append_printf(request->report, "%s %d: no events, not converted\n", cal->name, year);
+			continue;
+		}
+		gchar *old_name=segment_path(cal, seg);
+		request->old_size[c]=file_size(old_name);
+		g_free(old_name);
+		seg->archived=archive;
+		//rewritten whatever it holds, and kept in memory until then
+		if(seg->file_hashes) g_array_unref(seg->file_hashes);
+		seg->file_hashes=NULL;
+		request->converting=request->converting | (1 << c);
+	}
+	if(!found) g_string_append_printf(request->report, "%s: no year file for %d\n", archive ? "archive" : "unarchive", year);
+	if(request->converting==0) {
+		for(int c=0; c<NUM_CALENDARS; c++) calendar_unlock(locks[c]);
+		archive_request_reply(request);
+		return;
 	}
 	
-	total_num_lines=i;
-    //g_print("total_number_of_lines =%d\n",total_num_lines);	
-	g_object_unref (file_stream);	
-	g_object_unref (file);	
-		
+	SaveJob *job=save_job_new(locks);
+	job->done=archive_saved;
+	job->user_data=request;
+	save_submit(job, TASK_IDLE);
 }
 
-void save_csv_file(){
+//----------------------------------------------------------------------
+// import and export dialogs
+//----------------------------------------------------------------------
+
+static void show_message(GtkWindow *window, const char *title, const char *text)
+{
+  GtkWidget *dialog;
+  dialog = GTK_WIDGET (gtk_message_dialog_new (window,
+                                               GTK_DIALOG_MODAL|
+                                               GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               GTK_MESSAGE_INFO,
+                                               GTK_BUTTONS_CLOSE,
+                                               "%s", title));
+  gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog), "%s", text);
+  
+  GtkStyleContext *context_dialog;	
+  gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+  GtkCssProvider *cssProvider;	
+  cssProvider = gtk_css_provider_new();
+  gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+  context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+  gtk_style_context_add_provider(context_dialog,    
+  GTK_STYLE_PROVIDER(cssProvider), 
+  GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+  
+  g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
+  gtk_window_present (GTK_WINDOW (dialog));
+}
 
-    GFile *file;
-	gchar *file_name ="events.csv";
+static void import_progress(ImportJob *job, gpointer user_data)
+{
+	GtkWidget *dialog = user_data;
+	GtkWidget *progress_bar = g_object_get_data(G_OBJECT(dialog), "progress-bar-key");
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), (double) job->chunks_done / job->chunks->len);
+}
 
-	GFileOutputStream *file_stream;
-	GDataOutputStream *data_stream;
-	
-	//g_print("Saving csv data with filename = %s\n",file_name);
-	
-	file = g_file_new_for_path (file_name);
-	file_stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL);
-	
-	if (file_stream == NULL) {
-		g_object_unref (file);
-		g_print("error: unable to open abd save database file\n");
-		return;
+static void import_done(ImportJob *job, gpointer user_data)
+{
+	GtkWidget *dialog = user_data;
+	gtk_window_destroy(GTK_WINDOW(dialog));
+	
+	//the window may have been closed (or recreated) while importing
+	GtkWindow *window=gtk_application_get_active_window(GTK_APPLICATION(g_application_get_default()));
+	if(window) {
+		update_calendar(window);
+		update_store(m_year,m_month,m_day);
 	}
+	gchar *summary=import_summary(&job->result);
+	show_message(window, "Import", summary);
+	g_free(summary);
+}
 
-	data_stream = g_data_output_stream_new (G_OUTPUT_STREAM (file_stream));
-	
-	
-	for (int i=0; i<m_db_size; i++)
-	{
-	char *line="";  
-	Event e;
-	e=db_store[i];     
-	//g_print("Save CSV: e.id =%d e.title =%s date =%d-%d-%d\n",e.id,e.title,e.day,e.month,e.year);
+//parse on the thread pool behind a progress dialog
+static void import_with_progress(GtkWindow *window, const char *file_name, int calendar)
+{
+	GtkWidget *dialog;
+	GtkWidget *box;
+	GtkWidget *label;
+	GtkWidget *progress_bar;
 	
-	gchar *id_str = g_strdup_printf("%d", e.id); 
-	gchar *year_str = g_strdup_printf("%d", e.year); 
-	gchar *month_str = g_strdup_printf("%d", e.month);
-	gchar *day_str = g_strdup_printf("%d", e.day); 
+	//not destroyed with the window, import_done closes it
+	dialog = gtk_dialog_new_with_buttons ("Importing", window, 
+	GTK_DIALOG_MODAL|GTK_DIALOG_USE_HEADER_BAR, NULL, NULL);
+	gtk_window_set_deletable(GTK_WINDOW(dialog), FALSE);
+	gtk_window_set_default_size(GTK_WINDOW(dialog),350,80);
 	
-	gchar *starttime_str = g_strdup_printf("%0.2f", e.start_time); 
-	gchar *endtime_str = g_strdup_printf("%0.2f", e.end_time);
+	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+	gtk_window_set_child (GTK_WINDOW (dialog), box);
 	
-	gchar *priority_str = g_strdup_printf("%d", e.priority); 
-	gchar *isyearly_str = g_strdup_printf("%d", e.is_yearly); 
-	gchar *isallday_str = g_strdup_printf("%d", e.is_allday); 
-		
+	gchar *base_name=g_path_get_basename(file_name);
+	label =gtk_label_new(base_name);
+	g_free(base_name);
+	progress_bar =gtk_progress_bar_new();
+	gtk_box_append(GTK_BOX(box), label);
+	gtk_box_append(GTK_BOX(box), progress_bar);
+	g_object_set_data(G_OBJECT(dialog), "progress-bar-key",progress_bar);
 	
-	line =g_strconcat(line,
-	id_str,",",
-	e.title,",",
-	e.location,",",
-	year_str,",",
-	month_str,",",
-	day_str,",",
-	starttime_str,",",
-	endtime_str,",",	
-	priority_str,",",
-	isyearly_str,",",
-	isallday_str,",",
-	"\n", NULL);
+	GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
 	
-	g_data_output_stream_put_string (data_stream, line, NULL, NULL)	;
+	if(import_job_start(file_name, import_format_from_name(file_name), calendar, m_import_duplicates, import_progress, import_done, dialog)==NULL) {
+		gtk_window_destroy(GTK_WINDOW(dialog));
+		show_message(window, "Import", "The file could not be opened.");
+		return;
 	}
-	
-	g_object_unref (data_stream);
-	g_object_unref (file_stream);
-	g_object_unref (file);
-	
+	gtk_window_present (GTK_WINDOW (dialog));
+}
+
+static void callbk_import_response(GtkNativeDialog *native, int response, gpointer user_data)
+{
+	GtkWindow *window = user_data;
+	if(response==GTK_RESPONSE_ACCEPT) {
+		GFile *file=gtk_file_chooser_get_file(GTK_FILE_CHOOSER(native));
+		gchar *path=g_file_get_path(file);
+		const char *calendar=gtk_file_chooser_get_choice(GTK_FILE_CHOOSER(native), "calendar");
+		if(calendar && calendar_from_name(calendar)>=0) m_calendar=calendar_from_name(calendar);
+		import_with_progress(window, path, m_calendar);
+		g_free(path);
+		g_object_unref(file);
+	}
+	g_object_unref(native);
+}
+
+static void import_choose_file(GtkWindow *window, const char *title, const char *filter_name, const char *pattern)
+{
+	GtkFileChooserNative *native;
+	native = gtk_file_chooser_native_new (title, window,
+	GTK_FILE_CHOOSER_ACTION_OPEN, "_Import", "_Cancel");
+	
+	GtkFileFilter *filter = gtk_file_filter_new ();
+	gtk_file_filter_set_name (filter, filter_name);
+	gtk_file_filter_add_pattern (filter, pattern);
+	gtk_file_chooser_add_filter (GTK_FILE_CHOOSER (native), filter);
+	g_object_unref (filter);
+	
+	gtk_file_chooser_add_choice (GTK_FILE_CHOOSER (native), "calendar", "Calendar",
+	get_calendar_names(), get_calendar_names());
+	gtk_file_chooser_set_choice (GTK_FILE_CHOOSER (native), "calendar", m_calendars[m_calendar].name);
+	
+	g_signal_connect (native, "response", G_CALLBACK (callbk_import_response), window);
+	gtk_native_dialog_show (GTK_NATIVE_DIALOG (native));
+}
+
+static void callbk_import_ics(GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+	import_choose_file(GTK_WINDOW(user_data), "Import iCalendar", "iCalendar (*.ics)", "*.ics");
+}
+
+static void callbk_import_csv(GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+	import_choose_file(GTK_WINDOW(user_data), "Import CSV", "Talk Calendar CSV (*.csv)", "*.csv");
 }
- 
 
+static void callbk_export_ics_response(GtkNativeDialog *native, int response, gpointer user_data)
+{
+	GtkWindow *window = user_data;
+	if(response==GTK_RESPONSE_ACCEPT) {
+		GFile *file=gtk_file_chooser_get_file(GTK_FILE_CHOOSER(native));
+		gchar *path=g_file_get_path(file);
+		FILE *ics=g_fopen(path, "wb");
+		gboolean saved=(ics!=NULL && ics_export_file(ics));
+		if(ics!=NULL && fclose(ics)!=0) saved=FALSE;
+		if(!saved) show_message(window, "Export iCalendar", "The file could not be written.");
+		g_free(path);
+		g_object_unref(file);
+	}
+	g_object_unref(native);
+}
 
+static void callbk_export_ics(GSimpleAction *action, GVariant *parameter, gpointer user_data)
+{
+	GtkWindow *window = user_data;
+	GtkFileChooserNative *native;
+	native = gtk_file_chooser_native_new ("Export iCalendar", window,
+	GTK_FILE_CHOOSER_ACTION_SAVE, "_Export", "_Cancel");
+	gtk_file_chooser_set_current_name (GTK_FILE_CHOOSER (native), "talkcalendar.ics");
+	
+	g_signal_connect (native, "response", G_CALLBACK (callbk_export_ics_response), window);
+	gtk_native_dialog_show (GTK_NATIVE_DIALOG (native));
+}
 
 //----------------------------------------------------------------------
 
@@ -1137,8 +6442,7 @@ static void callbk_day_selected (GtkButton *button, gpointer user_data)
   m_day =day;
   m_month=month;
   m_year=year;  
-  update_calendar(GTK_WINDOW(window)); 
-  update_store(m_year,m_month,m_day);
+  calendar_queue_update(GTK_WINDOW(window), TRUE);
 }
 
 static void callbk_next_month(GtkButton *button, gpointer user_data)
@@ -1154,7 +6458,7 @@ static void callbk_next_month(GtkButton *button, gpointer user_data)
 	}
 	m_id_selection=-1;
 	m_row_index=-1;
-	update_calendar(GTK_WINDOW (window));
+	calendar_queue_update(GTK_WINDOW (window), FALSE);
 }
 
 static void callbk_prev_month(GtkButton *button, gpointer user_data)
@@ -1171,7 +6475,7 @@ static void callbk_prev_month(GtkButton *button, gpointer user_data)
 	}
 	m_id_selection=-1;
 	m_row_index=-1;
-	update_calendar(GTK_WINDOW (window));
+	calendar_queue_update(GTK_WINDOW (window), FALSE);
 	
 }
 //---------------------------------------------------------------------
@@ -1208,23 +6512,29 @@ static void callbk_row_activated (GtkListBox    *listbox,
   
   m_id_selection=id_value;
   //g_print("m_id_selection = %d\n",m_id_selection);    
-  //g_print("m_db_size =%d\n",m_db_size);
   
 }
 //---------------------------------------------------------------------
-static void update_store(int year, int month, int day) {	
-   
-  g_list_store_remove_all (m_store);//clear
- 
-  Event e; 
-  int start_time=0; 
-  for (int i=0; i<m_db_size; i++)
-  {
-  e=db_store[i]; 
- 
-  if ((year==e.year && month ==e.month && day==e.day) || (e.is_yearly && month==e.month && day==e.day))
-  {  
+// The day's events are added to the list a few at a time as urgent
+// frame work, so a day with many events does not block input while its
+// rows are created.
+
+#define STORE_FILL_BATCH 8 //rows added per step
+
+typedef struct {
+	GListStore *store; //filled while it is m_store
+	GArray *day_events; //or
+	GPtrArray *objects; //prefetched rows in order
+	guint next;
+	int year, month, day;
+} StoreFill;
+
+static FrameWork *m_store_fill_work=NULL;
+
+static DisplayObject* display_object_new_for_event(const Event *event, int year, int month, int day) {
   
+  Event e=*event;
+  int start_time=0; 
   DisplayObject *obj; 
   char *time_str="";
   char *title_str="";
@@ -1334,6 +6644,11 @@ static void update_store(int year, int month, int day) {
   else {
 	 time_str = g_strconcat(time_str,NULL);
   }
+  
+  //multi-day event which started on an earlier day
+  if (e.year!=year || e.month!=month || e.day!=day) {
+	  time_str="Continued. ";
+  }
     
   char *display_str ="";
   title_str=e.title;  
@@ -1355,6 +6670,7 @@ static void update_store(int year, int month, int day) {
    double fract1 = round(e.start_time-floor(e.start_time));  	
    start_min=fract1 *100;
   start_time = 60 * 60 * start_hour + 60 * start_min; //seconds
+  if (e.year!=year || e.month!=month || e.day!=day) start_time=0; //continued events first
   
   obj = g_object_new (display_object_get_type (),
 						//"id",     e.id,
@@ -1363,11 +6679,211 @@ static void update_store(int year, int month, int day) {
 						"starttime", start_time, 
 						
 						NULL); 
+  return obj;
+}
+
+static void store_fill_free(gpointer data)
+{
+	StoreFill *fill=data;
+	g_object_unref(fill->store);
+	if(fill->day_events) g_array_unref(fill->day_events);
+	if(fill->objects) g_ptr_array_unref(fill->objects);
+	g_free(fill);
+}
+
+//frame work: add the next batch of rows
+static gboolean store_fill_step(gpointer data)
+{
+	StoreFill *fill=data;
+	if(fill->store!=m_store) return FALSE; //the window was rebuilt
+	if(fill->objects) {
+		guint n=MIN(STORE_FILL_BATCH, fill->objects->len - fill->next);
+		g_list_store_splice(fill->store, g_list_model_get_n_items(G_LIST_MODEL(fill->store)), 0, fill->objects->pdata + fill->next, n);
+		fill->next+=n;
+		return fill->next<fill->objects->len;
+	}
+	for(int n=0; n<STORE_FILL_BATCH && fill->next<fill->day_events->len; n++) {
+		Event *e=&g_array_index(fill->day_events, Event, fill->next);
+		fill->next++;
+		DisplayObject *obj=display_object_new_for_event(e, fill->year, fill->month, fill->day);
+		g_list_store_insert_sorted(fill->store, obj, compare_items, NULL); 
+		g_object_unref (obj);
+	}
+	return fill->next<fill->day_events->len;
+}
+
+//---------------------------------------------------------------------
+// prefetch
+//---------------------------------------------------------------------
+
+// After the window is rebuilt the months before and after the shown one
+// and the days next to the selected one are prepared as normal frame
+// work, one per step, so the month buttons and moving to a nearby day
+// usually find their marked days, holidays and event rows ready instead
+// of querying the calendars. The shown month goes through the same cache.
+// It holds the PREFETCH_MONTHS months and PREFETCH_DAYS days used last
+// and is cleared whenever events, the shown calendars or the display
+// preferences change. Navigation cancels a prefetch in progress and the
+// rebuild it causes starts one around the new date.
+
+#define PREFETCH_MONTHS 4
+#define PREFETCH_DAYS 4
+
+typedef struct {
+	int key; //year*12+month
+	int marks[31]; //days with events
+	int num_marked; //events in the month
+	guint32 holidays; //bit per day, day 1 is bit 0
+} MonthPrefetch;
+
+typedef struct {
+	guint32 jd;
+	GPtrArray *objects; //DisplayObject rows in start time order
+} DayPrefetch;
+
+typedef struct {
+	int day, month, year; //around
+	int next; //target
+} Prefetch;
+
+static GQueue m_prefetch_months; //most recently used first
+static GQueue m_prefetch_days;
+static FrameWork *m_prefetch_work=NULL;
+static guint m_prefetch_hits=0; //shown months and days found prepared
+static guint m_prefetch_misses=0;
+
+static void day_prefetch_free(gpointer data)
+{
+	DayPrefetch *entry=data;
+	g_ptr_array_unref(entry->objects);
+	g_free(entry);
+}
+
+//a prefetch in progress carries on with the current events
+static void prefetch_clear()
+{
+	g_queue_clear_full(&m_prefetch_months, g_free);
+	g_queue_clear_full(&m_prefetch_days, day_prefetch_free);
+}
+
+//the cached entry moved to the front, or NULL
+static MonthPrefetch* prefetch_month_lookup(int month, int year)
+{
+	for(GList *l=m_prefetch_months.head; l; l=l->next) {
+		MonthPrefetch *entry=l->data;
+		if(entry->key!=year * 12 + month) continue;
+		g_queue_unlink(&m_prefetch_months, l);
+		g_queue_push_head_link(&m_prefetch_months, l);
+		return entry;
+	}
+	return NULL;
+}
+
+static MonthPrefetch* prefetch_month(int month, int year)
+{
+	MonthPrefetch *entry=prefetch_month_lookup(month, year);
+	if(entry) return entry;
+	entry=g_new0(MonthPrefetch, 1);
+	entry->key=year * 12 + month;
+	entry->num_marked=mark_month_days(month, year, entry->marks);
+	int days_in_month=g_date_get_days_in_month(month, year);
+	for(int day=1; day<=days_in_month; day++) {
+		if(is_public_holiday_in(day, month, year)) entry->holidays|=1u << (day - 1);
+	}
+	g_queue_push_head(&m_prefetch_months, entry);
+	while(m_prefetch_months.length > PREFETCH_MONTHS) g_free(g_queue_pop_tail(&m_prefetch_months));
+	return entry;
+}
+
+static DayPrefetch* prefetch_day_lookup(guint32 jd)
+{
+	for(GList *l=m_prefetch_days.head; l; l=l->next) {
+		DayPrefetch *entry=l->data;
+		if(entry->jd!=jd) continue;
+		g_queue_unlink(&m_prefetch_days, l);
+		g_queue_push_head_link(&m_prefetch_days, l);
+		return entry;
+	}
+	return NULL;
+}
+
+static int compare_item_ptrs(gconstpointer a, gconstpointer b, gpointer data)
+{
+	return compare_items(*(gconstpointer*) a, *(gconstpointer*) b, data);
+}
+
+static void prefetch_day(guint32 jd)
+{
+	if(jd==0 || prefetch_day_lookup(jd)) return;
+	int day, month, year;
+	dmy_from_julian(jd, &day, &month, &year);
+	GArray *day_events=get_day_events(year, month, day);
+	DayPrefetch *entry=g_new0(DayPrefetch, 1);
+	entry->jd=jd;
+	entry->objects=g_ptr_array_new_full(day_events->len, g_object_unref);
+	for(guint i=0; i<day_events->len; i++) {
+		g_ptr_array_add(entry->objects, display_object_new_for_event(&g_array_index(day_events, Event, i), year, month, day));
+	}
+	g_ptr_array_sort_with_data(entry->objects, compare_item_ptrs, NULL);
+	g_array_unref(day_events);
+	g_queue_push_head(&m_prefetch_days, entry);
+	while(m_prefetch_days.length > PREFETCH_DAYS) day_prefetch_free(g_queue_pop_tail(&m_prefetch_days));
+}
+
+//frame work: the next month or day around the shown date
+static gboolean prefetch_step(gpointer data)
+{
+	Prefetch *prefetch=data;
+	int month_index=prefetch->year * 12 + prefetch->month - 1;
+	guint32 jd=julian_from_dmy(prefetch->day, prefetch->month, prefetch->year);
+	switch(prefetch->next) {
+		case 0: //>>
+			prefetch_month((month_index + 1) % 12 + 1, (month_index + 1) / 12);
+			break;
+		case 1: //<<
+			prefetch_month((month_index - 1) % 12 + 1, (month_index - 1) / 12);
+			break;
+		case 2:
+			prefetch_day(jd + 1);
+			break;
+		case 3:
+			if(jd>1) prefetch_day(jd - 1);
+			break;
+	}
+	prefetch->next++;
+	return prefetch->next<4;
+}
+
+static void prefetch_schedule()
+{
+	Prefetch *prefetch=g_new0(Prefetch, 1);
+	prefetch->day=m_day;
+	prefetch->month=m_month;
+	prefetch->year=m_year;
+	frame_work_add(FRAME_NORMAL, prefetch_step, prefetch, g_free, &m_prefetch_work);
+}
+
+//---------------------------------------------------------------------
+
+static void update_store(int year, int month, int day) {	
+   
+  g_list_store_remove_all (m_store);//clear
   
-  g_list_store_insert_sorted(m_store, obj, compare_items, NULL); 
-  g_object_unref (obj);
-  } //if selected date 
-  } //for
+  StoreFill *fill=g_new0(StoreFill, 1);
+  fill->store=g_object_ref(m_store);
+  DayPrefetch *entry=prefetch_day_lookup(julian_from_dmy(day, month, year));
+  if(entry) {
+	  fill->objects=g_ptr_array_ref(entry->objects);
+	  m_prefetch_hits++;
+  }
+  else {
+	  fill->day_events=get_day_events(year, month, day);
+	  m_prefetch_misses++;
+  }
+  fill->year=year;
+  fill->month=month;
+  fill->day=day;
+  frame_work_add(FRAME_URGENT, store_fill_step, fill, store_fill_free, &m_store_fill_work);
 }
 
 static void set_button_blue(GtkButton *button){
@@ -1480,20 +6996,39 @@ static void reset_marked_dates() {
   
 }
 
-static void update_marked_dates(int month, int year) {
+//mark every day of the month an event covers, returns the number of events
+static int mark_month_days(int month, int year, int *marks) {
 	
-  //reset marked dates 
-  num_marked_dates = 0;  
-  Event e;  
-  for (int i=0; i<m_db_size; i++)
+  int count=0;
+  guint32 first_day=julian_from_dmy(1, month, year);
+  guint32 last_day=first_day + g_date_get_days_in_month(month, year) - 1;
+  
+  GArray *occurrences=query_range(first_day, last_day);
+  for (guint i=0; i<occurrences->len; i++)
   {
-  e=db_store[i];  
-  if ((e.month==month && e.year ==year)  || (e.is_yearly && month==e.month))  
+  Occurrence *o=&g_array_index(occurrences, Occurrence, i);
+  gint64 start, end;
+  event_interval(occurrence_event(o), o->jd, &start, &end);
+  guint32 from=MAX((guint32) (start / 1440), first_day);
+  guint32 to=MIN((guint32) ((end - 1) / 1440), last_day);
+  for (guint32 jd=from; jd<=to; jd++)
   {
-	  marked_date[e.day-1]=TRUE; //zero index so 1=0
-	  num_marked_dates= num_marked_dates+1;
-  } //if
+	  marks[jd-first_day]=TRUE; //zero index so 1=0
+  }
+  count=count+1;
   } //for 
+  g_array_unref(occurrences);
+  return count;
+}
+
+static void update_marked_dates(int month, int year) {
+	
+  //prefetched when the user got here from a neighbouring month
+  if(prefetch_month_lookup(month, year)) m_prefetch_hits++;
+  else m_prefetch_misses++;
+  MonthPrefetch *entry=prefetch_month(month, year);
+  memcpy(marked_date, entry->marks, sizeof(entry->marks));
+  num_marked_dates = entry->num_marked;
 }
 
 
@@ -1560,17 +7095,84 @@ static void callbk_about(GSimpleAction * action, GVariant *parameter, gpointer u
 //---------------------------------------------------------------------
 // speak
 //---------------------------------------------------------------------
-static gpointer thread_speak_func(gpointer user_data)
-{     
-    gchar *text =user_data;   
-    gchar * command_str ="espeak --stdout";
-    gchar *m_str = g_strdup_printf("%i", m_speed); 
-    gchar *speed_str ="-s ";
-    speed_str= g_strconcat(speed_str,m_str, NULL);   
-    command_str= g_strconcat(command_str," '",speed_str,"' "," '",text,"' ", "| aplay", NULL);
-    system(command_str);
-    g_mutex_unlock (&lock); //thread mutex unlock 
-    return NULL;   
+// Texts are spoken one after another on the main thread: espeak reads
+// the text on its stdin and writes audio into a pipe to aplay, both
+// spawned with argument vectors (no shell), and the next text is started
+// when aplay exits. Nothing blocks a worker while audio plays.
+
+static void speak_next();
+
+static void callbk_speech_written(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, NULL, NULL);
+	g_output_stream_close(G_OUTPUT_STREAM(source), NULL, NULL); //espeak reads to the end
+	g_free(user_data);
+}
+
+static void callbk_speech_done(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	g_subprocess_wait_finish(G_SUBPROCESS(source), result, NULL);
+	g_object_unref(source);
+	g_object_unref(user_data); //espeak, finished before aplay
+	speak_next();
+}
+
+//start the next queued text
+static void speak_next()
+{
+	gchar *text=g_queue_pop_head(&m_speech_queue);
+	m_speaking=text!=NULL;
+	if(text==NULL) return;
+	
+	GError *error=NULL;
+	int fds[2];
+	if(!g_unix_open_pipe(fds, FD_CLOEXEC, &error)) {
+		g_print("speak: unable to create pipe: %s\n", error->message);
+		g_error_free(error);
+		g_free(text);
+		speak_next();
+		return;
+	}
+	gchar *speed_str=g_strdup_printf("%i", m_speed);
+	GSubprocessLauncher *launcher=g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDIN_PIPE);
+	g_subprocess_launcher_take_stdout_fd(launcher, fds[1]);
+	GSubprocess *espeak=g_subprocess_launcher_spawn(launcher, &error, "espeak", "--stdout", "--stdin", "-s", speed_str, NULL);
+	g_object_unref(launcher); //closes the write end here, aplay sees the end of the audio
+	g_free(speed_str);
+	GSubprocess *aplay=NULL;
+	if(espeak) {
+		launcher=g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+		g_subprocess_launcher_take_stdin_fd(launcher, fds[0]);
+		aplay=g_subprocess_launcher_spawn(launcher, &error, "aplay", NULL);
+		g_object_unref(launcher);
+	}
+	else close(fds[0]);
+	if(aplay==NULL) {
+		g_print("speak: %s\n", error->message);
+		g_error_free(error);
+		if(espeak) g_object_unref(espeak);
+		g_free(text);
+		speak_next();
+		return;
+	}
+	
+	GOutputStream *input=g_subprocess_get_stdin_pipe(espeak);
+	g_output_stream_write_all_async(input, text, strlen(text), G_PRIORITY_DEFAULT, NULL, callbk_speech_written, text);
+	g_subprocess_wait_async(aplay, NULL, callbk_speech_done, espeak);
+}
+
+//speak a copy of text after what is queued
+static void speak_text(const gchar *text)
+{
+	g_queue_push_tail(&m_speech_queue, g_strdup(text));
+	if(!m_speaking) speak_next();
+}
+
+//run the main context until everything queued has been spoken (when
+//there is no main loop, from the command line)
+static void speak_wait()
+{
+	while(m_speaking) g_main_context_iteration(NULL, TRUE);
 }
 
 
@@ -1651,6 +7253,10 @@ void callbk_preferences_response(GtkDialog *dialog, gint response_id,  gpointer
     GtkWidget *check_button_talk_startup= g_object_get_data(G_OBJECT(dialog), "check-button-talk-startup-key");  
     GtkWidget *check_button_holidays= g_object_get_data(G_OBJECT(dialog), "check-button-holidays-key");
     GtkWidget *check_button_end_time= g_object_get_data(G_OBJECT(dialog), "check-button-display-end-time-key");
+    GtkWidget *check_button_reminders= g_object_get_data(G_OBJECT(dialog), "check-button-reminders-key");
+    GtkWidget *entry_leads= g_object_get_data(G_OBJECT(dialog), "entry-reminder-leads-key");
+    GtkWidget *check_button_background= g_object_get_data(G_OBJECT(dialog), "check-button-background-key");
+    GtkWidget *dropdown_duplicates= g_object_get_data(G_OBJECT(dialog), "dropdown-duplicates-key");
     
 	if(response_id==GTK_RESPONSE_OK)
 	{
@@ -1658,7 +7264,13 @@ void callbk_preferences_response(GtkDialog *dialog, gint response_id,  gpointer
 	m_talk_at_startup=gtk_check_button_get_active (GTK_CHECK_BUTTON(check_button_talk_startup));
 	m_holidays=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_holidays));
 	m_show_end_time=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_end_time));
+	m_reminders=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_reminders));
+	m_reminder_leads=g_strdup(gtk_entry_buffer_get_text(gtk_entry_get_buffer(GTK_ENTRY(entry_leads))));
+	m_background=gtk_check_button_get_active(GTK_CHECK_BUTTON(check_button_background));
+	m_import_duplicates=gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown_duplicates));
 	config_write();	
+	reminder_schedule();
+	prefetch_clear(); //rows show end times or not
 	update_calendar(GTK_WINDOW(window));
 	update_store(m_year,m_month,m_day);
 	}	
@@ -1678,6 +7290,14 @@ static void callbk_preferences(GSimpleAction* action, GVariant *parameter,gpoint
 	GtkWidget *check_button_talk_startup;
 	GtkWidget *check_button_holidays;
 	GtkWidget *check_button_end_time;
+	GtkWidget *check_button_reminders;
+	GtkWidget *label_leads;
+	GtkWidget *entry_leads;
+	GtkWidget *box_leads;
+	GtkWidget *check_button_background;
+	GtkWidget *label_duplicates;
+	GtkWidget *dropdown_duplicates;
+	GtkWidget *box_duplicates;
 	
 	dialog = gtk_dialog_new_with_buttons ("New Event", GTK_WINDOW(window),   
 	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT|GTK_DIALOG_USE_HEADER_BAR,
@@ -1694,23 +7314,51 @@ static void callbk_preferences(GSimpleAction* action, GVariant *parameter,gpoint
 	check_button_talk_startup = gtk_check_button_new_with_label ("Talk At Startup");
 	check_button_holidays = gtk_check_button_new_with_label ("Show UK Public Holidays");
 	check_button_end_time = gtk_check_button_new_with_label ("Display End Time");
+	check_button_reminders = gtk_check_button_new_with_label ("Reminders");
+	check_button_background = gtk_check_button_new_with_label ("Keep Running When Closed");
+	
+	label_leads =gtk_label_new("Minutes Before (e.g. 10,0) ");
+	entry_leads =gtk_entry_new();
+	gtk_entry_set_buffer(GTK_ENTRY(entry_leads),gtk_entry_buffer_new(m_reminder_leads,-1));
+	box_leads=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+	gtk_box_append (GTK_BOX(box_leads),label_leads);
+	gtk_box_append (GTK_BOX(box_leads),entry_leads);
+	
+	//order of the DUPLICATES_ modes
+	const char *duplicate_options[] = {"Skip", "Merge", "Keep", NULL};
+	label_duplicates =gtk_label_new("Import Duplicates ");
+	dropdown_duplicates =gtk_drop_down_new_from_strings(duplicate_options);
+	box_duplicates=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+	gtk_box_append (GTK_BOX(box_duplicates),label_duplicates);
+	gtk_box_append (GTK_BOX(box_duplicates),dropdown_duplicates);
 	
 	gtk_box_append(GTK_BOX(box), check_button_talk);
 	gtk_box_append(GTK_BOX(box), check_button_talk_startup);
 	gtk_box_append(GTK_BOX(box), check_button_holidays);
 	gtk_box_append(GTK_BOX(box), check_button_end_time);
+	gtk_box_append(GTK_BOX(box), check_button_reminders);
+	gtk_box_append(GTK_BOX(box), box_leads);
+	gtk_box_append(GTK_BOX(box), check_button_background);
+	gtk_box_append(GTK_BOX(box), box_duplicates);
 	
 	
 	g_object_set_data(G_OBJECT(dialog), "check-button-talk-key",check_button_talk);
 	g_object_set_data(G_OBJECT(dialog), "check-button-talk-startup-key",check_button_talk_startup);
 	g_object_set_data(G_OBJECT(dialog), "check-button-holidays-key",check_button_holidays);
 	g_object_set_data(G_OBJECT(dialog), "check-button-display-end-time-key",check_button_end_time);
+	g_object_set_data(G_OBJECT(dialog), "check-button-reminders-key",check_button_reminders);
+	g_object_set_data(G_OBJECT(dialog), "entry-reminder-leads-key",entry_leads);
+	g_object_set_data(G_OBJECT(dialog), "check-button-background-key",check_button_background);
+	g_object_set_data(G_OBJECT(dialog), "dropdown-duplicates-key",dropdown_duplicates);
 	
 	
 	gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_talk), m_talk);
 	gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_talk_startup), m_talk_at_startup);
 	gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_holidays), m_holidays);
 	gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_end_time), m_show_end_time);	
+	gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_reminders), m_reminders);
+	gtk_check_button_set_active (GTK_CHECK_BUTTON(check_button_background), m_background);
+	gtk_drop_down_set_selected(GTK_DROP_DOWN(dropdown_duplicates), m_import_duplicates);
 	
 	
 	GtkStyleContext *context_dialog;	
@@ -1751,6 +7399,7 @@ static void callbk_shortcuts(GSimpleAction * action, GVariant *parameter, gpoint
 	GtkWidget *label_about_sc;	
 	GtkWidget *label_version_sc;
 	GtkWidget *label_quit_sc;
+	GtkWidget *label_search_sc;
 	
 	dialog = gtk_dialog_new_with_buttons ("Information", GTK_WINDOW(window), 
 	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT,
@@ -1768,12 +7417,14 @@ static void callbk_shortcuts(GSimpleAction * action, GVariant *parameter, gpoint
 	label_about_sc=gtk_label_new("About: <Ctrl A>");	
 	label_version_sc=gtk_label_new("Version: <Ctrl V>");
 	label_quit_sc=gtk_label_new("Quit: <Ctrl Q>");
+	label_search_sc=gtk_label_new("Search: <Ctrl F>");
 		
 	
 	gtk_box_append(GTK_BOX(box), label_speak_sc);
 	gtk_box_append(GTK_BOX(box),label_home_sc);
 	gtk_box_append(GTK_BOX(box), label_about_sc);
 	gtk_box_append(GTK_BOX(box), label_version_sc);
+	gtk_box_append(GTK_BOX(box),label_search_sc);
 	gtk_box_append(GTK_BOX(box),label_quit_sc);
 	
 	GtkStyleContext *context_dialog;	
@@ -1805,6 +7456,7 @@ static void callbk_info(GSimpleAction *action, GVariant *parameter,  gpointer us
 	GtkWidget *label_record_number;	
 	GtkWidget *label_font_name;
 	GtkWidget *label_font_size;	
+	GtkWidget *label_latency;
                                                
    dialog = gtk_dialog_new_with_buttons ("Information", GTK_WINDOW(window), 
    GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT,
@@ -1816,8 +7468,8 @@ static void callbk_info(GSimpleAction *action, GVariant *parameter,  gpointer us
 	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
 	gtk_window_set_child (GTK_WINDOW (dialog), box);
 	
-	char* record_num_str =" Number of records (max 5000) = ";
-	char* n_str = g_strdup_printf("%d", m_db_size);   
+	char* record_num_str =" Number of records = ";
+	char* n_str = g_strdup_printf("%d", db_count_events(FALSE));   
 	record_num_str = g_strconcat(record_num_str, n_str,NULL);   
 	label_record_number =gtk_label_new(record_num_str); 
 	
@@ -1826,31 +7478,353 @@ static void callbk_info(GSimpleAction *action, GVariant *parameter,  gpointer us
 	label_font_name=gtk_label_new(font_str);
 	
 	
-	char* font_size_str =" Font size = ";
-	char* font_n_str = g_strdup_printf("%d", m_font_size);   
-	font_size_str = g_strconcat(font_size_str, font_n_str,NULL);   
-	label_font_size =gtk_label_new(font_size_str); 
-  
-  gtk_box_append(GTK_BOX(box), label_record_number);
-  gtk_box_append(GTK_BOX(box), label_font_name);
-  gtk_box_append(GTK_BOX(box),label_font_size);
-  
-  GtkStyleContext *context_dialog;	
-  gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
-  GtkCssProvider *cssProvider;	
-  cssProvider = gtk_css_provider_new();
-  gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
-  
-  // get GtkStyleContext from widget
-  context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
-  //finally load style provider 
-  gtk_style_context_add_provider(context_dialog,    
-  GTK_STYLE_PROVIDER(cssProvider), 
-  GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
-  
-  gtk_window_present (GTK_WINDOW (dialog));
-  g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
- 	
+	char* font_size_str =" Font size = ";
+	char* font_n_str = g_strdup_printf("%d", m_font_size);   
+	font_size_str = g_strconcat(font_size_str, font_n_str,NULL);   
+	label_font_size =gtk_label_new(font_size_str); 
+	
+	gchar *latency_str;
+	if(m_nav_painted>0) {
+		latency_str=g_strdup_printf(" Input to paint = %.1f ms (average %.1f ms, max %.1f ms)\n %u navigation steps drawn in %u rebuilds",
+		m_nav_latency_last / 1000.0, m_nav_latency_total / 1000.0 / m_nav_painted, m_nav_latency_max / 1000.0,
+		m_nav_steps, m_nav_rebuilds);
+	}
+	else latency_str=g_strdup(" Input to paint = not measured yet");
+	gchar *prefetch_str=g_strdup_printf("%s\n %u of %u months and days shown were prefetched", latency_str,
+	m_prefetch_hits, m_prefetch_hits + m_prefetch_misses);
+	g_free(latency_str);
+	latency_str=prefetch_str;
+	label_latency =gtk_label_new(latency_str);
+	g_free(latency_str);
+  
+  gtk_box_append(GTK_BOX(box), label_record_number);
+  gtk_box_append(GTK_BOX(box), label_font_name);
+  gtk_box_append(GTK_BOX(box),label_font_size);
+  gtk_box_append(GTK_BOX(box),label_latency);
+  
+  GtkStyleContext *context_dialog;	
+  gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+  GtkCssProvider *cssProvider;	
+  cssProvider = gtk_css_provider_new();
+  gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+  
+  // get GtkStyleContext from widget
+  context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+  //finally load style provider 
+  gtk_style_context_add_provider(context_dialog,    
+  GTK_STYLE_PROVIDER(cssProvider), 
+  GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+  
+  gtk_window_present (GTK_WINDOW (dialog));
+  g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
+ 	
+}
+
+//warn about double booking after an event is added or edited
+static void warn_event_conflicts(GtkWindow *window, int id)
+{
+  gchar *titles=get_event_conflicts(id);
+  if(titles==NULL) return;
+  
+  GtkWidget *dialog;
+  dialog = GTK_WIDGET (gtk_message_dialog_new (window,
+                                               GTK_DIALOG_MODAL|
+                                               GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               GTK_MESSAGE_WARNING,
+                                               GTK_BUTTONS_CLOSE,
+                                               "Double Booking"));
+  gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog),
+                                            "This event overlaps with: %s", titles);
+  g_free(titles);
+  
+  GtkStyleContext *context_dialog;	
+  gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+  GtkCssProvider *cssProvider;	
+  cssProvider = gtk_css_provider_new();
+  gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+  context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+  gtk_style_context_add_provider(context_dialog,    
+  GTK_STYLE_PROVIDER(cssProvider), 
+  GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+  
+  g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
+  gtk_window_present (GTK_WINDOW (dialog));
+}
+
+static void callbk_conflicts(GSimpleAction *action, GVariant *parameter,  gpointer user_data){
+
+	GtkWidget *window =user_data;
+	GtkWidget *dialog; 
+	GtkWidget *box; 
+	GtkWidget *label_summary;
+	GtkWidget *label_details;
+	GtkWidget *sw;
+	
+	dialog = gtk_dialog_new_with_buttons ("Conflict Report", GTK_WINDOW(window), 
+	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT,
+	"Close", GTK_RESPONSE_CLOSE,
+	NULL);                                         
+	
+	gtk_window_set_default_size(GTK_WINDOW(dialog),480,300);  
+	
+	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+	gtk_window_set_child (GTK_WINDOW (dialog), box);
+	
+	gint64 start_time=g_get_monotonic_time();
+	ConflictReport report = {0};
+	report.details=g_string_new("");
+	get_conflict_report(&report, 50);
+	gint64 elapsed=g_get_monotonic_time()-start_time;
+	
+	gchar *summary_str=g_strdup_printf("%d double bookings involving %d events (%d overlapping pairs)\nChecked %d records in %.1f ms",
+	report.num_clusters, report.num_events, report.num_pairs, db_count_events(TRUE), elapsed/1000.0);
+	label_summary=gtk_label_new(summary_str);
+	g_free(summary_str);
+	
+	label_details=gtk_label_new(report.details->str);
+	gtk_label_set_xalign(GTK_LABEL(label_details), 0.0);
+	g_string_free(report.details, TRUE);
+	
+	sw = gtk_scrolled_window_new ();
+	gtk_widget_set_vexpand (GTK_WIDGET (sw), TRUE);
+	gtk_scrolled_window_set_child (GTK_SCROLLED_WINDOW (sw), label_details);
+	
+	gtk_box_append(GTK_BOX(box), label_summary);
+	gtk_box_append(GTK_BOX(box), sw);
+	
+	GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+	
+	gtk_window_present (GTK_WINDOW (dialog));
+	g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
+}
+
+static void callbk_free_slot_response(GtkDialog *dialog, gint response_id, gpointer  user_data)
+{
+	if(response_id!=GTK_RESPONSE_APPLY) {
+		gtk_window_destroy(GTK_WINDOW(dialog));
+		return;
+	}
+	
+	GtkWidget *spin_button_duration= g_object_get_data(G_OBJECT(dialog), "spin-duration-key");
+	GtkWidget *spin_button_from= g_object_get_data(G_OBJECT(dialog), "spin-from-hour-key");
+	GtkWidget *spin_button_to= g_object_get_data(G_OBJECT(dialog), "spin-to-hour-key");
+	GtkWidget *spin_button_days= g_object_get_data(G_OBJECT(dialog), "spin-days-key");
+	GtkWidget *label_result= g_object_get_data(G_OBJECT(dialog), "label-result-key");
+	
+	int duration=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_duration));
+	int from_hour=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_from));
+	int to_hour=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_to));
+	int days=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin_button_days));
+	
+	guint32 jd=julian_from_dmy(m_day, m_month, m_year);
+	GArray *free_slots=find_free_slots(jd, jd + days - 1, from_hour*60, to_hour*60, duration, 20);
+	
+	GString *result=g_string_new("");
+	if(free_slots->len==0) g_string_append(result, "No free slot found");
+	for(guint i=0; i<free_slots->len; i++) {
+		gchar *slot_str=free_slot_to_string(&g_array_index(free_slots, TimeSlot, i));
+		g_string_append_printf(result, "%s%s\n", i==0 ? "First free: " : "", slot_str);
+		g_free(slot_str);
+	}
+	g_array_unref(free_slots);
+	gtk_label_set_text(GTK_LABEL(label_result), result->str);
+	g_string_free(result, TRUE);
+}
+
+static void callbk_free_slot(GSimpleAction *action, GVariant *parameter,  gpointer user_data){
+
+	GtkWidget *window =user_data;
+	GtkWidget *dialog; 
+	GtkWidget *box; 
+	GtkWidget *label_result;
+	GtkWidget *sw;
+	
+	dialog = gtk_dialog_new_with_buttons ("Find Free Slot", GTK_WINDOW(window), 
+	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT,
+	"Find", GTK_RESPONSE_APPLY,
+	"Close", GTK_RESPONSE_CLOSE,
+	NULL);                                         
+	
+	gtk_window_set_default_size(GTK_WINDOW(dialog),420,340);  
+	
+	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+	gtk_window_set_child (GTK_WINDOW (dialog), box);
+	
+	gchar *from_str=g_strdup_printf("Searching from %d-%d-%d", m_day, m_month, m_year);
+	gtk_box_append(GTK_BOX(box), gtk_label_new(from_str));
+	g_free(from_str);
+	
+	const char *labels[] = {"Duration (minutes) ", "From Hour ", "To Hour ", "Number of Days "};
+	const char *keys[] = {"spin-duration-key", "spin-from-hour-key", "spin-to-hour-key", "spin-days-key"};
+	//value,lower,upper,step_increment
+	const double ranges[4][4] = {{60, 5, 720, 15}, {9, 0, 23, 1}, {17, 1, 24, 1}, {7, 1, 366, 1}};
+	
+	for(int i=0; i<4; i++) {
+		GtkAdjustment *adjustment = gtk_adjustment_new (ranges[i][0], ranges[i][1], ranges[i][2], ranges[i][3], 5.0, 0.0);
+		GtkWidget *spin_button = gtk_spin_button_new (adjustment, 1.0, 0);
+		GtkWidget *box_row=gtk_box_new(GTK_ORIENTATION_HORIZONTAL,1);
+		gtk_box_append (GTK_BOX(box_row),gtk_label_new(labels[i]));
+		gtk_box_append (GTK_BOX(box_row),spin_button);
+		gtk_box_append(GTK_BOX(box), box_row);
+		g_object_set_data(G_OBJECT(dialog), keys[i],spin_button);
+	}
+	
+	label_result=gtk_label_new("");
+	gtk_label_set_xalign(GTK_LABEL(label_result), 0.0);
+	g_object_set_data(G_OBJECT(dialog), "label-result-key",label_result);
+	
+	sw = gtk_scrolled_window_new ();
+	gtk_widget_set_vexpand (GTK_WIDGET (sw), TRUE);
+	gtk_scrolled_window_set_child (GTK_SCROLLED_WINDOW (sw), label_result);
+	gtk_box_append(GTK_BOX(box), sw);
+	
+	GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+	
+	g_signal_connect (dialog, "response", G_CALLBACK (callbk_free_slot_response),NULL);
+	gtk_window_present (GTK_WINDOW (dialog));
+}
+
+static void callbk_search_setup(GtkSignalListItemFactory *factory, GtkListItem *list_item, gpointer user_data)
+{
+	GtkWidget *label = gtk_label_new("");
+	gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+	gtk_list_item_set_child(list_item, label);
+}
+
+static void callbk_search_bind(GtkSignalListItemFactory *factory, GtkListItem *list_item, gpointer user_data)
+{
+	GtkWidget *label = gtk_list_item_get_child(list_item);
+	DisplayObject *obj = gtk_list_item_get_item(list_item);
+	gtk_label_set_text(GTK_LABEL(label), obj->label);
+}
+
+static void callbk_search_changed(GtkSearchEntry *entry, gpointer user_data)
+{
+	GtkWidget *dialog = user_data;
+	GListStore *results= g_object_get_data(G_OBJECT(dialog), "store-results-key");
+	GtkWidget *label_count= g_object_get_data(G_OBJECT(dialog), "label-count-key");
+	
+	gint64 start_time=g_get_monotonic_time();
+	int total=0;
+	GArray *hits=search_events(gtk_editable_get_text(GTK_EDITABLE(entry)), 500, &total);
+	gint64 elapsed=g_get_monotonic_time()-start_time;
+	
+	gpointer *objects=g_new(gpointer, hits->len);
+	for(guint i=0; i<hits->len; i++) {
+		SearchHit *hit=&g_array_index(hits, SearchHit, i);
+		objects[i]=g_object_new (display_object_get_type (),
+						"id",     hit->id,
+						"label",  search_doc_lookup(hit->id)->label, 
+						"starttime", i, 
+						NULL);
+	}
+	//replace the results in one change so the list view updates once
+	g_list_store_splice(results, 0, g_list_model_get_n_items(G_LIST_MODEL(results)), objects, hits->len);
+	for(guint i=0; i<hits->len; i++) g_object_unref(objects[i]);
+	g_free(objects);
+	
+	gchar *count_str=g_strdup_printf("%d matches (%.2f ms)%s", total, elapsed/1000.0,
+	total > (int) hits->len ? ", showing best 500" : "");
+	gtk_label_set_text(GTK_LABEL(label_count), count_str);
+	g_free(count_str);
+	g_array_unref(hits);
+}
+
+//go to the date of the activated result
+static void callbk_search_activate(GtkListView *list_view, guint position, gpointer user_data)
+{
+	GtkWidget *dialog = user_data;
+	GtkWindow *window= g_object_get_data(G_OBJECT(dialog), "window-key");
+	GListStore *results= g_object_get_data(G_OBJECT(dialog), "store-results-key");
+	
+	DisplayObject *obj = g_list_model_get_item(G_LIST_MODEL(results), position);
+	if(obj==NULL) return;
+	SearchDoc *doc=search_doc_lookup(obj->id);
+	g_object_unref(obj);
+	if(doc==NULL || doc->jd==0) return;
+	
+	dmy_from_julian(doc->jd, &m_day, &m_month, &m_year);
+	update_calendar(window); 
+	update_store(m_year,m_month,m_day); 
+	gtk_window_destroy(GTK_WINDOW(dialog));
+}
+
+static void callbk_search(GSimpleAction *action, GVariant *parameter,  gpointer user_data){
+
+	GtkWidget *window =user_data;
+	GtkWidget *dialog; 
+	GtkWidget *box; 
+	GtkWidget *search_entry;
+	GtkWidget *label_count;
+	GtkWidget *list_view;
+	GtkWidget *sw;
+	GListStore *results;
+	GtkListItemFactory *factory;
+	
+	dialog = gtk_dialog_new_with_buttons ("Search", GTK_WINDOW(window), 
+	GTK_DIALOG_MODAL|GTK_DIALOG_DESTROY_WITH_PARENT,
+	"Close", GTK_RESPONSE_CLOSE,
+	NULL);                                         
+	
+	gtk_window_set_default_size(GTK_WINDOW(dialog),480,400);  
+	
+	box =gtk_box_new(GTK_ORIENTATION_VERTICAL,1);  
+	gtk_window_set_child (GTK_WINDOW (dialog), box);
+	
+	search_entry=gtk_search_entry_new();
+	label_count=gtk_label_new("Type at least two letters");
+	
+	//list view only creates rows for visible results
+	results = g_list_store_new (display_object_get_type ()); 
+	factory = gtk_signal_list_item_factory_new();
+	g_signal_connect(factory, "setup", G_CALLBACK(callbk_search_setup), NULL);
+	g_signal_connect(factory, "bind", G_CALLBACK(callbk_search_bind), NULL);
+	list_view = gtk_list_view_new(GTK_SELECTION_MODEL(gtk_single_selection_new(G_LIST_MODEL(results))), factory);
+	
+	sw = gtk_scrolled_window_new ();
+	gtk_widget_set_vexpand (GTK_WIDGET (sw), TRUE);
+	gtk_scrolled_window_set_child (GTK_SCROLLED_WINDOW (sw), list_view);
+	
+	gtk_box_append(GTK_BOX(box), search_entry);
+	gtk_box_append(GTK_BOX(box), label_count);
+	gtk_box_append(GTK_BOX(box), sw);
+	
+	g_object_set_data(G_OBJECT(dialog), "window-key",window);
+	g_object_set_data(G_OBJECT(dialog), "store-results-key",results);
+	g_object_set_data(G_OBJECT(dialog), "label-count-key",label_count);
+	
+	g_signal_connect(search_entry, "search-changed", G_CALLBACK(callbk_search_changed), dialog);
+	g_signal_connect(list_view, "activate", G_CALLBACK(callbk_search_activate), dialog);
+	
+	GtkStyleContext *context_dialog;	
+	gtk_widget_set_name (GTK_WIDGET(dialog), "cssView"); 
+	GtkCssProvider *cssProvider;	
+	cssProvider = gtk_css_provider_new();
+	gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 
+	context_dialog = gtk_widget_get_style_context(GTK_WIDGET(dialog));	
+	gtk_style_context_add_provider(context_dialog,    
+	GTK_STYLE_PROVIDER(cssProvider), 
+	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);	
+	
+	g_signal_connect (dialog, "response", G_CALLBACK (gtk_window_destroy), NULL);
+	gtk_window_present (GTK_WINDOW (dialog));
+	gtk_widget_grab_focus(search_entry);
 }
 
 static void callbk_delete_all_response(GtkDialog *dialog, gint response_id, gpointer  user_data)								 
@@ -1863,29 +7837,15 @@ static void callbk_delete_all_response(GtkDialog *dialog, gint response_id, gpoi
     
     //g_print("Danger: Deleting everything\n");
     
-    Event e_empty;
-    e_empty.id=0;    
-    strcpy(e_empty.title, "");   
-    strcpy(e_empty.location,"");
-    e_empty.year=0;
-    e_empty.month=0;
-    e_empty.day=0;
-    e_empty.start_time=0;
-    e_empty.end_time=0;	
-    e_empty.priority;
-    e_empty.is_yearly=0;
-    e_empty.is_allday=0;
-    
-    for(int i=0;  i<m_db_size; i++)
+    //hidden calendars are kept
+    for(int c=0; c<NUM_CALENDARS; c++)
     {
-		db_store[i]=e_empty;
-		
+		if(calendar_is_visible(c)) db_clear_calendar(&m_calendars[c]);
 	}
     
     reset_marked_dates();  
     update_calendar(GTK_WINDOW(window));
 	update_store(m_year,m_month,m_day);
-	m_db_size=0;
 	m_id_selection=-1;
 	m_row_index=-1; 	
     }
@@ -1916,7 +7876,7 @@ static void callbk_delete_all(GSimpleAction *action, GVariant *parameter,  gpoin
                                                GTK_BUTTONS_NONE,
                                                "Delete"));
   gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog),
-                                            "All events will be delete");
+                                            "All events in the shown calendars will be deleted");
   gtk_dialog_add_buttons (GTK_DIALOG (dialog), 
                           "Cancel", GTK_RESPONSE_CANCEL,
                           "Delete", GTK_RESPONSE_OK,
@@ -1960,11 +7920,7 @@ static void callbk_home(GSimpleAction * action, GVariant *parameter, gpointer us
   m_year =g_date_get_year(current_date); 
   g_date_free (current_date);
     
-  //mark days with events
-  reset_marked_dates();
-  update_marked_dates(m_month,m_year); 
-  update_calendar(GTK_WINDOW (window)); 
-  update_store(m_year,m_month,m_day); 
+  calendar_queue_update(GTK_WINDOW (window), TRUE);
    
 }
 
@@ -1973,7 +7929,10 @@ static void callbk_quit(GSimpleAction * action,
 							              gpointer       user_data)
 {
 	
-	g_application_quit(G_APPLICATION(user_data));
+	//quit once the events are saved
+	GtkWindow *window=gtk_application_get_active_window(GTK_APPLICATION(user_data));
+	if(window==NULL) g_application_quit(G_APPLICATION(user_data));
+	else save_with_progress(window, save_done_quit, user_data);
 	
 }
 
@@ -1994,30 +7953,11 @@ int compare (const void * a, const void * b)
 static void speak_events() {
 	
 	if(m_talk==0) return;
-	int event_count=0;
-	Event e;  
-	for (int i=0; i<m_db_size; i++)
-	{  
-	e=db_store[i];
-	if(m_year==e.year && m_month ==e.month && m_day==e.day)
-	{		
-	event_count++;
-	}//if		
-	}//for
-      
-   Event day_events[event_count]; 
-   
+	
    //load day events 
-   int j=0;
-   for (int i=0; i<m_db_size; i++)
-	{  
-	e=db_store[i];
-	if(m_year==e.year && m_month ==e.month && m_day==e.day)
-	{		
-	day_events[j] =e;
-	j++;
-	}//if		
-	}//for
+   GArray *day_array=get_day_events(m_year, m_month, m_day);
+   int event_count=day_array->len;
+   Event *day_events=(Event*) day_array->data;
    
    //sort
    
@@ -2140,6 +8080,10 @@ static void speak_events() {
    } //else not allday
    
       
+   if (day.year!=m_year || day.month!=m_month || day.day!=m_day) {
+   time_str="Continuing. ";
+   }
+   
    title_str=day.title;
       
    if(strlen(day.location) ==0)
@@ -2155,90 +8099,1235 @@ static void speak_events() {
    speak_str=g_strconcat(speak_str, " This is a high priority event.  ", NULL);
    }
  
-   GThread *thread_speak;   
-    if(m_talk) {	
-	g_mutex_lock (&lock);
-    thread_speak = g_thread_new(NULL, thread_speak_func, speak_str);   
-	}	
-	g_thread_unref (thread_speak);	
+   speak_text(speak_str);
+   g_free(speak_str);
  } 
+ g_array_unref(day_array);
+		
+}
+
+static void callbk_speak(GSimpleAction* action, GVariant *parameter,gpointer user_data){
+		
+	speak_events();	
+	
+}
+	
+
+
+static void callbk_speak_about(GSimpleAction *action,
+							G_GNUC_UNUSED  GVariant      *parameter,
+							  gpointer       user_data){
+		
+	gchar* message_speak ="Talk Calendar. Gtk4 Version 1.0";    
+		
+	if(m_talk) speak_text(message_speak);
+}
+
+//---------------------------------------------------------------------
+// d-bus query service
+//---------------------------------------------------------------------
+// Read-only queries exported by the primary instance on its GApplication
+// connection so other desktop components can share the loaded store.
+// Dates are YYYY-MM-DD strings and events are returned as packed arrays
+// of (id, date, start, end, all day, title, location, priority).
+
+static const gchar m_query_introspection[] =
+	"<node>"
+	"  <interface name='org.gtk.talkcalendar.Query'>"
+	"    <method name='GetEventsInRange'>"
+	"      <arg type='s' name='from' direction='in'/>"
+	"      <arg type='s' name='to' direction='in'/>"
+	"      <arg type='a(isssbssb)' name='events' direction='out'/>"
+	"    </method>"
+	"    <method name='Search'>"
+	"      <arg type='s' name='text' direction='in'/>"
+	"      <arg type='u' name='max_results' direction='in'/>"
+	"      <arg type='a(isssbssb)' name='events' direction='out'/>"
+	"    </method>"
+	"    <method name='GetMarkedDays'>"
+	"      <arg type='i' name='year' direction='in'/>"
+	"      <arg type='i' name='month' direction='in'/>"
+	"      <arg type='au' name='days' direction='out'/>"
+	"    </method>"
+	"  </interface>"
+	"</node>";
+
+static guint m_query_registration=0;
+
+static void query_add_event(GVariantBuilder *builder, const Event *e, guint32 jd)
+{
+	int day, month, year;
+	dmy_from_julian(jd, &day, &month, &year);
+	int start=minutes_from_time(e->start_time);
+	int end=minutes_from_time(e->end_time);
+	gchar *date_str=g_strdup_printf("%04d-%02d-%02d", year, month, day);
+	gchar *start_str=g_strdup_printf("%02d:%02d", start / 60, start % 60);
+	gchar *end_str=g_strdup_printf("%02d:%02d", end / 60, end % 60);
+	//files edited elsewhere may hold invalid UTF-8, which a "s" variant rejects
+	gchar *title=g_utf8_make_valid(e->title, -1);
+	gchar *location=g_utf8_make_valid(e->location, -1);
+	g_variant_builder_add(builder, "(isssbssb)", e->id, date_str, start_str, end_str,
+	e->is_allday!=0, title, location, e->priority!=0);
+	g_free(date_str);
+	g_free(start_str);
+	g_free(end_str);
+	g_free(title);
+	g_free(location);
+}
+
+static void callbk_query_method(GDBusConnection *connection, const gchar *sender,
+	const gchar *object_path, const gchar *interface_name, const gchar *method_name,
+	GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data)
+{
+	GVariantBuilder builder;
+	
+	if(g_strcmp0(method_name, "GetEventsInRange")==0) {
+		const gchar *from_str, *to_str;
+		g_variant_get(parameters, "(&s&s)", &from_str, &to_str);
+		guint32 from=julian_from_date_string(from_str);
+		guint32 to=julian_from_date_string(to_str);
+		if(from==0 || to<from || to-from>3660) {
+			g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"Expected YYYY-MM-DD dates at most ten years apart");
+			return;
+		}
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("a(isssbssb)"));
+		GArray *occurrences=query_range(from, to);
+		for(guint i=0; i<occurrences->len; i++) {
+			Occurrence *o=&g_array_index(occurrences, Occurrence, i);
+			query_add_event(&builder, occurrence_event(o), o->jd);
+		}
+		g_array_unref(occurrences);
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(isssbssb))", &builder));
+	}
+	else if(g_strcmp0(method_name, "Search")==0) {
+		const gchar *text;
+		guint32 max_results;
+		g_variant_get(parameters, "(&su)", &text, &max_results);
+		int total;
+		GArray *hits=search_events(text, MIN(max_results, 1000), &total);
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("a(isssbssb)"));
+		for(guint i=0; i<hits->len; i++) {
+			Event *e=db_find_event(g_array_index(hits, SearchHit, i).id);
+			if(e) query_add_event(&builder, e, julian_from_dmy(e->day, e->month, e->year));
+		}
+		g_array_unref(hits);
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(isssbssb))", &builder));
+	}
+	else if(g_strcmp0(method_name, "GetMarkedDays")==0) {
+		int year, month;
+		g_variant_get(parameters, "(ii)", &year, &month);
+		if(!g_date_valid_dmy(1, month, year)) {
+			g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"Invalid year or month");
+			return;
+		}
+		int marks[31]={0};
+		mark_month_days(month, year, marks);
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("au"));
+		for(int day=1; day<=31; day++) {
+			if(marks[day-1]) g_variant_builder_add(&builder, "u", day);
+		}
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(au)", &builder));
+	}
+}
+
+static const GDBusInterfaceVTable m_query_vtable = { callbk_query_method, NULL, NULL };
+
+//export the query interface next to the application object
+static void query_service_register(GApplication *app)
+{
+	GDBusConnection *connection=g_application_get_dbus_connection(app);
+	if(connection==NULL) return; //not on a bus
+	
+	GError *error=NULL;
+	GDBusNodeInfo *info=g_dbus_node_info_new_for_xml(m_query_introspection, NULL);
+	gchar *path=g_strconcat(g_application_get_dbus_object_path(app), "/Query", NULL);
+	m_query_registration=g_dbus_connection_register_object(connection, path,
+	info->interfaces[0], &m_query_vtable, NULL, NULL, &error);
+	if(m_query_registration==0) {
+		g_print("unable to export query service: %s\n", error->message);
+		g_error_free(error);
+	}
+	g_free(path);
+	g_dbus_node_info_unref(info);
+}
+
+static void query_service_unregister(GApplication *app)
+{
+	GDBusConnection *connection=g_application_get_dbus_connection(app);
+	if(connection && m_query_registration) g_dbus_connection_unregister_object(connection, m_query_registration);
+	m_query_registration=0;
+}
+
+//---------------------------------------------------------------------
+// shared memory agenda
+//---------------------------------------------------------------------
+// The primary instance publishes the next AGENDA_SHM_DAYS days in a POSIX
+// shared memory object (layout and reader in agenda-shm.h). Changes are
+// coalesced into one publish from an idle callback and a timeout moves
+// the window on at midnight.
+
+static AgendaShm *m_agenda_shm=NULL;
+static guint m_agenda_idle=0;
+static guint m_agenda_midnight=0;
+
+static gboolean agenda_shm_publish(gpointer user_data)
+{
+	m_agenda_idle=0;
+	if(m_agenda_shm==NULL) return G_SOURCE_REMOVE;
+	
+	GDate *current_date = g_date_new();
+	g_date_set_time_t(current_date, time(NULL));
+	guint32 today=g_date_get_julian(current_date);
+	g_date_free(current_date);
+	GArray *entries=get_agenda(today, today + AGENDA_SHM_DAYS - 1);
+	
+	AgendaShm *shm=m_agenda_shm;
+	//seqlock: odd while writing, readers retry
+	__atomic_store_n(&shm->sequence, shm->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	guint n=MIN(entries->len, AGENDA_SHM_MAX_EVENTS);
+	for(guint i=0; i<n; i++) {
+		AgendaEntry *entry=&g_array_index(entries, AgendaEntry, i);
+		const Event *e=entry->event;
+		AgendaShmEvent *out=&shm->events[i];
+		memset(out, 0, sizeof(AgendaShmEvent));
+		out->julian_day=entry->jd;
+		out->id=e->id;
+		out->start_min=minutes_from_time(e->start_time);
+		out->end_min=minutes_from_time(e->end_time);
+		if(e->is_allday) out->flags|=AGENDA_SHM_ALLDAY;
+		if(e->priority) out->flags|=AGENDA_SHM_PRIORITY;
+		if(entry->start_jd < entry->jd) out->flags|=AGENDA_SHM_CONTINUED;
+		g_strlcpy(out->title, e->title, AGENDA_SHM_TITLE_LEN);
+		g_strlcpy(out->location, e->location, AGENDA_SHM_LOCATION_LEN);
+	}
+	shm->num_events=n;
+	shm->first_day=today;
+	shm->num_days=AGENDA_SHM_DAYS;
+	shm->generation=shm->generation + 1;
+	
+	__atomic_store_n(&shm->sequence, shm->sequence + 1, __ATOMIC_RELEASE);
+	g_array_unref(entries);
+	return G_SOURCE_REMOVE;
+}
+
+//publish once the current burst of changes is done
+static void agenda_shm_schedule()
+{
+	if(m_agenda_shm==NULL || m_agenda_idle) return;
+	m_agenda_idle=g_idle_add(agenda_shm_publish, NULL);
+}
+
+static gboolean agenda_shm_midnight(gpointer user_data)
+{
+	GDateTime *now=g_date_time_new_now_local();
+	int seconds=24*3600 - (g_date_time_get_hour(now)*3600 + g_date_time_get_minute(now)*60 + g_date_time_get_second(now));
+	g_date_time_unref(now);
+	if(user_data) agenda_shm_publish(NULL); //called at midnight
+	m_agenda_midnight=g_timeout_add_seconds(seconds + 1, agenda_shm_midnight, GINT_TO_POINTER(1));
+	return G_SOURCE_REMOVE;
+}
+
+static void agenda_shm_open_writer()
+{
+	char name[64];
+	agenda_shm_name(name, sizeof(name));
+	int fd=shm_open(name, O_CREAT|O_RDWR, 0600);
+	if(fd<0) {
+		g_print("unable to create shared memory agenda\n");
+		return;
+	}
+	if(ftruncate(fd, sizeof(AgendaShm))!=0) {
+		g_print("unable to size shared memory agenda\n");
+		close(fd);
+		return;
+	}
+	void *shm=mmap(NULL, sizeof(AgendaShm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm==MAP_FAILED) {
+		g_print("unable to map shared memory agenda\n");
+		return;
+	}
+	m_agenda_shm=shm;
+	m_agenda_shm->magic=AGENDA_SHM_MAGIC;
+	m_agenda_shm->version=AGENDA_SHM_VERSION;
+	agenda_shm_publish(NULL);
+	agenda_shm_midnight(NULL);
+}
+
+static void agenda_shm_close_writer()
+{
+	if(m_agenda_shm==NULL) return;
+	if(m_agenda_idle) g_source_remove(m_agenda_idle);
+	if(m_agenda_midnight) g_source_remove(m_agenda_midnight);
+	m_agenda_idle=0;
+	m_agenda_midnight=0;
+	munmap(m_agenda_shm, sizeof(AgendaShm));
+	m_agenda_shm=NULL;
+	char name[64];
+	agenda_shm_name(name, sizeof(name));
+	shm_unlink(name);
+}
+
+//---------------------------------------------------------------------
+// reminders
+//---------------------------------------------------------------------
+// Reminders due in the next two days are kept in a min-heap ordered by
+// due time and a single timerfd is armed for the earliest one. The timer
+// uses CLOCK_REALTIME with an absolute expiry so it fires on resume if
+// the due time passed during suspend, and TFD_TIMER_CANCEL_ON_SET wakes
+// it when the clock is set so the heap is rebuilt. Nothing polls: the
+// only wakeups are due reminders and a refill when the window runs out.
+// Store changes rebuild the window (one index query) from an idle. A
+// rebuild only pushes reminders due after the timer last ran, except at
+// startup and after the clock was set, when ones up to REMINDER_GRACE
+// late are given too. The due time of the last reminder given for each
+// event is kept so none is given twice.
+
+#define REMINDER_WINDOW_DAYS 2
+#define REMINDER_GRACE 300 //seconds late a reminder is still given
+
+typedef struct {
+	gint64 due; //unix time
+	gint64 start; //unix time the occurrence starts
+	int id; //event id (-1 = refill the window), looked up when due
+	int lead; //minutes
+} Reminder;
+
+static GArray *m_reminder_heap=NULL;
+static int m_reminder_fd=-1;
+static guint m_reminder_source=0;
+static guint m_reminder_idle=0;
+static GApplication *m_reminder_app=NULL;
+static gint64 m_reminder_checked=0; //reminders due up to here were given or skipped
+static GHashTable *m_reminder_given=NULL; //event id -> due time of its last reminder given
+
+static void reminder_heap_push(Reminder *r)
+{
+	g_array_append_val(m_reminder_heap, *r);
+	Reminder *h=(Reminder*) m_reminder_heap->data;
+	int i=m_reminder_heap->len - 1;
+	while(i > 0 && h[(i - 1) / 2].due > h[i].due) {
+		Reminder tmp=h[i];
+		h[i]=h[(i - 1) / 2];
+		h[(i - 1) / 2]=tmp;
+		i=(i - 1) / 2;
+	}
+}
+
+static void reminder_heap_pop()
+{
+	Reminder *h=(Reminder*) m_reminder_heap->data;
+	int n=m_reminder_heap->len - 1;
+	h[0]=h[n];
+	g_array_set_size(m_reminder_heap, n);
+	int i=0;
+	for(;;) {
+		int smallest=i;
+		if(2 * i + 1 < n && h[2 * i + 1].due < h[smallest].due) smallest=2 * i + 1;
+		if(2 * i + 2 < n && h[2 * i + 2].due < h[smallest].due) smallest=2 * i + 2;
+		if(smallest==i) break;
+		Reminder tmp=h[i];
+		h[i]=h[smallest];
+		h[smallest]=tmp;
+		i=smallest;
+	}
+}
+
+//local wall time of minutes since julian day 0 as unix time
+static gint64 unix_from_minutes(gint64 minutes)
+{
+	int day, month, year;
+	dmy_from_julian(minutes / 1440, &day, &month, &year);
+	int min=minutes % 1440;
+	GDateTime *dt=g_date_time_new_local(year, month, day, min / 60, min % 60, 0);
+	gint64 t=g_date_time_to_unix(dt);
+	g_date_time_unref(dt);
+	return t;
+}
+
+//arm the timer for the earliest reminder (disarmed when there is none)
+static void reminder_arm()
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	if(m_reminder_heap->len > 0) {
+		spec.it_value.tv_sec=MAX(g_array_index(m_reminder_heap, Reminder, 0).due, 1);
+	}
+	timerfd_settime(m_reminder_fd, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+}
+
+//late: also push reminders missed by up to REMINDER_GRACE (startup, clock set)
+static void reminder_rebuild(gboolean late)
+{
+	g_array_set_size(m_reminder_heap, 0);
+	gint64 now=g_get_real_time() / G_USEC_PER_SEC;
+	gint64 after=late ? now - REMINDER_GRACE : m_reminder_checked;
+	
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, m_reminder_given);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		if(*(gint64*) value < now - 86400) g_hash_table_iter_remove(&iter); //long past
+	}
+	
+	GDate *current_date=g_date_new();
+	g_date_set_time_t(current_date, now);
+	guint32 today=g_date_get_julian(current_date);
+	g_date_free(current_date);
+	
+	if(m_reminders) {
+		gchar **leads=g_strsplit(m_reminder_leads, ",", -1);
+		GArray *occurrences=query_range(today, today + REMINDER_WINDOW_DAYS);
+		for(guint i=0; i<occurrences->len; i++) {
+			Occurrence *o=&g_array_index(occurrences, Occurrence, i);
+			if(occurrence_event(o)->is_allday) continue;
+			Reminder r;
+			r.start=unix_from_minutes(o->start);
+			r.id=occurrence_event(o)->id;
+			for(int j=0; leads[j]; j++) {
+				r.lead=atoi(leads[j]);
+				r.due=r.start - r.lead * 60;
+				gint64 *given=g_hash_table_lookup(m_reminder_given, GINT_TO_POINTER(r.id));
+				if(given && r.due <= *given) continue;
+				if(r.due > after) reminder_heap_push(&r);
+			}
+		}
+		g_array_unref(occurrences);
+		g_strfreev(leads);
+		
+		//refill before reminders for the day after the window are due
+		Reminder refill={ unix_from_minutes((gint64) (today + REMINDER_WINDOW_DAYS) * 1440), 0, -1, 0 };
+		reminder_heap_push(&refill);
+	}
+	reminder_arm();
+}
+
+static void reminder_fire(Reminder *r)
+{
+	Event *e=db_find_event(r->id);
+	if(e==NULL) return; //deleted before the heap was rebuilt
+	gint64 *given=g_new(gint64, 1);
+	*given=r->due;
+	g_hash_table_replace(m_reminder_given, GINT_TO_POINTER(r->id), given);
+	gchar *when;
+	if(r->lead > 0) when=g_strdup_printf("In %d minutes", r->lead);
+	else when=g_strdup("Now");
+	
+	GNotification *notification=g_notification_new(e->title);
+	gchar *body=g_strdup_printf("%s%s%s", when, strlen(e->location) ? " at " : "", e->location);
+	g_notification_set_body(notification, body);
+	if(e->priority) g_notification_set_priority(notification, G_NOTIFICATION_PRIORITY_HIGH);
+	g_application_send_notification(m_reminder_app, NULL, notification);
+	g_object_unref(notification);
+	g_free(body);
+	
+	if(m_talk) {
+		gchar *speak_str=g_strdup_printf("Reminder. %s. %s. %s%s", when, e->title,
+		strlen(e->location) ? "At " : "", e->location);
+		speak_text(speak_str);
+		g_free(speak_str);
+	}
+	g_free(when);
+}
+
+static gboolean callbk_reminder_timer(gint fd, GIOCondition condition, gpointer user_data)
+{
+	guint64 expirations;
+	if(read(fd, &expirations, sizeof(expirations)) < 0 && errno==ECANCELED) {
+		//the clock was set, due times may have moved
+		reminder_rebuild(TRUE);
+		return G_SOURCE_CONTINUE;
+	}
+	
+	gint64 now=g_get_real_time() / G_USEC_PER_SEC;
+	gboolean refill=FALSE;
+	while(m_reminder_heap->len > 0 && g_array_index(m_reminder_heap, Reminder, 0).due <= now) {
+		Reminder r=g_array_index(m_reminder_heap, Reminder, 0);
+		reminder_heap_pop();
+		if(r.id < 0) refill=TRUE;
+		else if(now - r.due <= REMINDER_GRACE) reminder_fire(&r); //skip ones missed while suspended
+	}
+	m_reminder_checked=now;
+	if(refill) reminder_rebuild(FALSE);
+	else reminder_arm();
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean reminder_rebuild_idle(gpointer user_data)
+{
+	m_reminder_idle=0;
+	reminder_rebuild(FALSE);
+	return G_SOURCE_REMOVE;
+}
+
+//rebuild once the current burst of changes is done
+static void reminder_schedule()
+{
+	if(m_reminder_fd < 0 || m_reminder_idle) return;
+	m_reminder_idle=g_idle_add(reminder_rebuild_idle, NULL);
+}
+
+static void reminder_init(GApplication *app)
+{
+	m_reminder_fd=timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(m_reminder_fd < 0) {
+		g_print("unable to create reminder timer\n");
+		return;
+	}
+	m_reminder_app=app;
+	m_reminder_heap=g_array_new(FALSE, FALSE, sizeof(Reminder));
+	m_reminder_given=g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	m_reminder_checked=g_get_real_time() / G_USEC_PER_SEC;
+	m_reminder_source=g_unix_fd_add(m_reminder_fd, G_IO_IN, callbk_reminder_timer, NULL);
+	reminder_rebuild(TRUE);
+}
+
+static void reminder_shutdown()
+{
+	if(m_reminder_fd < 0) return;
+	if(m_reminder_idle) g_source_remove(m_reminder_idle);
+	g_source_remove(m_reminder_source);
+	close(m_reminder_fd);
+	g_array_unref(m_reminder_heap);
+	g_hash_table_unref(m_reminder_given);
+	m_reminder_fd=-1;
+	m_reminder_idle=0;
+	m_reminder_source=0;
+}
+
+//---------------------------------------------------------------------
+// calendar visibility
+//---------------------------------------------------------------------
+// Each calendar has a boolean app.calendar-<name> action shown as a check
+// item in the Calendars menu. Toggling it flips a bit in m_hidden_calendars
+// that queries test, so no file is reloaded and no index is rebuilt.
+
+//action name without the "app." prefix, caller frees
+static gchar* calendar_action_name(int calendar)
+{
+	gchar *name=g_ascii_strdown(m_calendars[calendar].name, -1);
+	gchar *action_name=g_strdup_printf("calendar-%s", name);
+	g_free(name);
+	return action_name;
+}
+
+static void callbk_calendar_visible(GSimpleAction *action, GVariant *state, gpointer user_data)
+{
+	int calendar=GPOINTER_TO_INT(g_object_get_data(G_OBJECT(action), "calendar-key"));
+	g_simple_action_set_state(action, state);
+	if(g_variant_get_boolean(state)) m_hidden_calendars=m_hidden_calendars & ~(1 << calendar);
+	else m_hidden_calendars=m_hidden_calendars | (1 << calendar);
+	config_write();
+	
+	//the published agenda and reminders follow what is shown
+	prefetch_clear();
+	agenda_shm_schedule();
+	reminder_schedule();
+	GtkWindow *window=gtk_application_get_active_window(GTK_APPLICATION(user_data));
+	if(window) {
+		m_id_selection=-1;
+		m_row_index=-1;
+		update_calendar(window);
+		update_store(m_year,m_month,m_day);
+	}
+}
+
+static void calendar_actions_add(GApplication *app)
+{
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		gchar *action_name=calendar_action_name(c);
+		GSimpleAction *action=g_simple_action_new_stateful(action_name, NULL, g_variant_new_boolean(calendar_is_visible(c)));
+		g_object_set_data(G_OBJECT(action), "calendar-key", GINT_TO_POINTER(c));
+		g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(action));
+		g_signal_connect(action, "change-state", G_CALLBACK(callbk_calendar_visible), app);
+		g_free(action_name);
+	}
+}
+
+//---------------------------------------------------------------------
+// background mode
+//---------------------------------------------------------------------
+
+// Started with --background, or after the window is closed with Keep
+// Running When Closed set, the application is held without a window. The
+// widget tree and the caches only the window uses are freed and the heap
+// is trimmed, leaving the event store, the interval index, the reminder
+// scheduler and the speech queue resident (espeak and aplay only run
+// while a reminder is spoken, as subprocesses). Activating the application
+// again (launching it, --goto, clicking a notification) creates a new
+// window from the store.
+
+static void background_enter(GApplication *app)
+{
+	if(!m_background_hold) {
+		g_application_hold(app);
+		m_background_hold=TRUE;
+	}
+	//actions bound to the destroyed window
+	const char *window_actions[] = {"speak", "version", "about", "preferences", "font", "home",
+	"delete", "info", "conflicts", "search", "freeslot", "importics", "importcsv", "exportics", "shortcuts"};
+	for(guint i=0; i<G_N_ELEMENTS(window_actions); i++) {
+		g_action_map_remove_action(G_ACTION_MAP(app), window_actions[i]);
+	}
+	g_clear_object(&m_store);
+	search_index_release();
+	prefetch_clear();
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(m_calendars[c].month_cache) g_hash_table_remove_all(m_calendars[c].month_cache);
+	}
+	db_evict_years(1, 0); //reminders only need the years near today
+	malloc_trim(0); //return freed widget memory to the system
+}
+
+static void background_leave(GApplication *app)
+{
+	if(!m_background_hold) return;
+	g_application_release(app); //the window holds the application now
+	m_background_hold=FALSE;
+}
+
+//---------------------------------------------------------------------
+// startup and shutdown
+//---------------------------------------------------------------------
+int file_exists(const char *file_name)
+{
+    FILE *file;
+    file = fopen(file_name, "r");
+    if (file){       
+        fclose(file);
+        return 1; //file exists return 1
+    }
+    return 0; //file does not exist
+}
+
+//load the calendar files (also used without a window), stores grow on demand
+static void db_open()
+{
+	load_csv_file();
+	m_db_open=TRUE;
+}
+
+//free every calendar and its derived data
+static void db_close()
+{
+	store_close();
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		Calendar *cal=&m_calendars[c];
+		free(cal->events);
+		cal->events=NULL;
+		cal->size=0;
+		cal->capacity=0;
+		if(cal->series) g_array_unref(cal->series);
+		if(cal->month_cache) g_hash_table_unref(cal->month_cache);
+		if(cal->file_hashes) g_array_unref(cal->file_hashes);
+		if(cal->segments) g_ptr_array_unref(cal->segments);
+		cal->segments=NULL;
+		cal->series=NULL;
+		cal->month_cache=NULL;
+		cal->file_hashes=NULL;
+		if(cal->index) {
+			if(cal->index->entries) {
+				g_array_unref(cal->index->entries);
+				g_array_unref(cal->index->nodes);
+			}
+			g_free(cal->index->by_start);
+			g_free(cal->index->by_end);
+			g_free(cal->index);
+			cal->index=NULL;
+		}
+	}
+	m_db_open=FALSE;
+}
+
+static void callbk_app_shutdown(GApplication *app, gpointer user_data)
+{
+	query_service_unregister(app);
+	command_service_unregister(app);
+	agenda_shm_close_writer();
+	reminder_shutdown();
+	calendar_watch_stop();
+	memory_monitor_stop();
+	autosave_cancel();
+	if(m_db_open) {
+		save_csv_file(); //waits for a save in flight
+		db_close();
+	}
+}
+
+static void startup (GtkApplication *app)
+{
+	db_open();
+	
+	//remote commands from a second launch, registered here so they
+	//work whether or not a window has been created
+	GSimpleAction *add_event_action;	
+	add_event_action=g_simple_action_new("add-event",G_VARIANT_TYPE("(ssss)")); //app.add-event
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(add_event_action));	
+	g_signal_connect(add_event_action, "activate",  G_CALLBACK(callbk_remote_add_event), app);
+	
+	GSimpleAction *goto_action;	
+	goto_action=g_simple_action_new("goto",G_VARIANT_TYPE_STRING); //app.goto
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(goto_action));	
+	g_signal_connect(goto_action, "activate",  G_CALLBACK(callbk_remote_goto), app);
+	
+	calendar_actions_add(G_APPLICATION(app)); //app.calendar-personal ...
+	
+	query_service_register(G_APPLICATION(app));
+	command_service_register(G_APPLICATION(app));
+	agenda_shm_open_writer();
+	reminder_init(G_APPLICATION(app));
+	calendar_watch_start();
+	memory_monitor_start();
+	
+	 //---------------------------------------------------
+  
+		
+}
+
+//the store is saved and freed in callbk_app_shutdown
+static void callbk_window_destroy(GtkWidget *window, gpointer user_data)
+{
+	if(m_background) {
+		save_start(NULL, NULL); //saved on close unless closed another way
+		background_enter(G_APPLICATION(user_data));
+	}
+}
+
+
+//---------------------------------------------------------------------
+// command line
+//---------------------------------------------------------------------
+
+// Queries handled in handle-local-options, before startup and activate,
+// so gtk is never initialised. They load the store, print and exit.
+
+//YYYY-MM-DD or "today" to julian day (0 if invalid), NULL is today
+static guint32 julian_from_date_string(const char *str)
+{
+	if(str==NULL || g_strcmp0(str, "today")==0) {
+		GDate *current_date = g_date_new();
+		g_date_set_time_t(current_date, time(NULL));
+		guint32 jd=g_date_get_julian(current_date);
+		g_date_free(current_date);
+		return jd;
+	}
+	int year, month, day;
+	if(sscanf(str, "%d-%d-%d", &year, &month, &day)!=3) return 0;
+	return julian_from_dmy(day, month, year);
+}
+
+//events from jd_from to jd_to grouped by day, days without events are skipped
+static void print_agenda(guint32 jd_from, guint32 jd_to)
+{
+	const char *weekdays[] = {"Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", "Sunday"};
+	GArray *entries = get_agenda(jd_from, jd_to);
+	
+	GString *out = g_string_new("");
+	guint32 current = 0;
+	for(guint i=0; i<entries->len; i++) {
+		AgendaEntry *entry = &g_array_index(entries, AgendaEntry, i);
+		const Event *e = entry->event;
+		if(entry->jd != current) {
+			int day, month, year;
+			dmy_from_julian(entry->jd, &day, &month, &year);
+			g_string_append_printf(out, "%s%s %d-%d-%d\n", current ? "\n" : "",
+			weekdays[weekday_from_julian(entry->jd) - 1], day, month, year);
+			current = entry->jd;
+		}
+		if(entry->start_jd < entry->jd) g_string_append(out, "Continued   ");
+		else if(e->is_allday) g_string_append(out, "All day     ");
+		else {
+			int start = minutes_from_time(e->start_time);
+			int end = minutes_from_time(e->end_time);
+			g_string_append_printf(out, "%02d:%02d-%02d:%02d ", start / 60, start % 60, end / 60, end % 60);
+		}
+		g_string_append(out, e->title);
+		if(strlen(e->location) > 0) g_string_append_printf(out, " (%s)", e->location);
+		if(e->priority) g_string_append(out, " [high priority]");
+		g_string_append_c(out, '\n');
+	}
+	if(entries->len==0) g_string_append(out, "No events\n");
+	g_print("%s", out->str);
+	g_string_free(out, TRUE);
+	g_array_unref(entries);
+}
+
+static void json_append_string(GString *out, const char *str)
+{
+	g_string_append_c(out, '"');
+	for(const char *p=str; *p; p++) {
+		if(*p=='"' || *p=='\\') g_string_append_printf(out, "\\%c", *p);
+		else if((guchar) *p < 0x20) g_string_append_printf(out, "\\u%04x", (guchar) *p);
+		else g_string_append_c(out, *p);
+	}
+	g_string_append_c(out, '"');
+}
+
+static void json_append_date(GString *out, guint32 jd)
+{
+	if(jd==0) {
+		g_string_append(out, "null");
+		return;
+	}
+	int day, month, year;
+	dmy_from_julian(jd, &day, &month, &year);
+	g_string_append_printf(out, "\"%04d-%02d-%02d\"", year, month, day);
+}
 
-		
+//every record of the visible calendars as a json array, repeating events
+//are exported as their rule
+static void print_events_json()
+{
+	const char *freq_names[] = {"none", "daily", "weekly", "monthly", "monthly-weekday", "yearly"};
+	db_load_all_years();
+	GString *out = g_string_new("[");
+	int count = 0;
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		if(!calendar_is_visible(c)) continue;
+		for(int i=0; i<m_calendars[c].size; i++) {
+			Event *e = &m_calendars[c].events[i];
+			int start = minutes_from_time(e->start_time);
+			int end = minutes_from_time(e->end_time);
+			g_string_append_printf(out, "%s\n  {\"id\": %d, \"calendar\": ", count ? "," : "", e->id);
+			json_append_string(out, m_calendars[c].name);
+			g_string_append(out, ", \"title\": ");
+			json_append_string(out, e->title);
+			g_string_append(out, ", \"location\": ");
+			json_append_string(out, e->location);
+			g_string_append(out, ", \"date\": ");
+			json_append_date(out, julian_from_dmy(e->day, e->month, e->year));
+			g_string_append(out, ", \"end_date\": ");
+			json_append_date(out, e->end_date);
+			g_string_append_printf(out, ", \"start_time\": \"%02d:%02d\", \"end_time\": \"%02d:%02d\", \"all_day\": %s, \"priority\": %d",
+			start / 60, start % 60, end / 60, end % 60, e->is_allday ? "true" : "false", e->priority);
+			if(event_is_recurring(e)) {
+				g_string_append_printf(out, ", \"repeat\": {\"freq\": \"%s\", \"interval\": %d, \"weekdays\": %d, \"count\": %d, \"until\": ",
+				freq_names[e->recur_freq], MAX(e->recur_interval, 1), e->recur_weekdays, e->recur_count);
+				json_append_date(out, e->recur_until);
+				g_string_append(out, ", \"exdates\": [");
+				for(int j=0; j<e->num_exdates; j++) {
+					if(j) g_string_append(out, ", ");
+					json_append_date(out, e->exdates[j]);
+				}
+				g_string_append(out, "]}");
+			}
+			g_string_append_c(out, '}');
+			count++;
+		}
+	}
+	g_string_append(out, "\n]\n");
+	g_print("%s", out->str);
+	g_string_free(out, TRUE);
 }
 
-static void callbk_speak(GSimpleAction* action, GVariant *parameter,gpointer user_data){
-		
-	speak_events();	
+//talkcalendar --free-slot 45 [--date 2026-10-26] [--days 7] [--hours 9-17]
+static int print_free_slots(GVariantDict *options)
+{
+	int duration=0;
+	int days=7;
+	const char *date_str=NULL;
+	const char *hours_str="9-17";
+	g_variant_dict_lookup(options, "free-slot", "i", &duration);
+	g_variant_dict_lookup(options, "days", "i", &days);
+	g_variant_dict_lookup(options, "date", "&s", &date_str);
+	g_variant_dict_lookup(options, "hours", "&s", &hours_str);
+	
+	guint32 jd=julian_from_date_string(date_str);
+	
+	int from_hour, to_hour;
+	if(jd==0 || days<1 || duration<1 || sscanf(hours_str, "%d-%d", &from_hour, &to_hour)!=2
+	|| from_hour<0 || to_hour>24 || from_hour>=to_hour) {
+		g_printerr("free-slot: invalid duration, date, days or hours\n");
+		return 1;
+	}
 	
+	db_open();
+	GArray *free_slots=find_free_slots(jd, jd + days - 1, from_hour*60, to_hour*60, duration, 0);
+	for(guint i=0; i<free_slots->len; i++) {
+		gchar *slot_str=free_slot_to_string(&g_array_index(free_slots, TimeSlot, i));
+		g_print("%s\n", slot_str);
+		g_free(slot_str);
+	}
+	if(free_slots->len==0) g_print("No free slot found\n");
+	g_array_unref(free_slots);
+	db_close();
+	return 0;
 }
-	
-
 
-static void callbk_speak_about(GSimpleAction *action,
-							G_GNUC_UNUSED  GVariant      *parameter,
-							  gpointer       user_data){
-		
-	GThread *thread_speak; 
-		
-	gchar* message_speak ="Talk Calendar. Gtk4 Version 1.0";    
-		
-	if(m_talk) {	
-	g_mutex_lock (&lock);
-    thread_speak = g_thread_new(NULL, thread_speak_func, message_speak);   
-	}	
-	g_thread_unref (thread_speak);	
+//talkcalendar --agenda DATE | --month [--date DATE] | --export json | --speak-today
+static int print_query(GVariantDict *options)
+{
+	const char *date_str=NULL;
+	const char *format=NULL;
+	g_variant_dict_lookup(options, "date", "&s", &date_str);
+	
+	if(g_variant_dict_lookup(options, "export", "&s", &format) && g_strcmp0(format, "json")!=0 && g_strcmp0(format, "ics")!=0) {
+		g_printerr("export: unknown format %s (json and ics are supported)\n", format);
+		return 1;
+	}
+	if(g_variant_dict_lookup(options, "agenda", "&s", &date_str) && julian_from_date_string(date_str)==0) {
+		g_printerr("agenda: invalid date %s (use YYYY-MM-DD or today)\n", date_str);
+		return 1;
+	}
+	guint32 jd=julian_from_date_string(date_str);
+	if(jd==0) {
+		g_printerr("invalid date %s (use YYYY-MM-DD or today)\n", date_str);
+		return 1;
+	}
+	
+	db_open();
+	if(g_strcmp0(format, "ics")==0) ics_export_file(stdout);
+	else if(format) print_events_json();
+	else if(g_variant_dict_contains(options, "month")) {
+		int day, month, year;
+		dmy_from_julian(jd, &day, &month, &year);
+		print_agenda(jd - day + 1, jd - day + g_date_get_days_in_month(month, year));
+	}
+	else if(g_variant_dict_contains(options, "speak-today")) {
+		dmy_from_julian(julian_from_date_string(NULL), &m_day, &m_month, &m_year);
+		m_talk=1; //asked for explicitly
+		speak_events();
+		speak_wait(); //the last utterance
+	}
+	else print_agenda(jd, jd);
+	db_close();
+	return 0;
 }
 
 //---------------------------------------------------------------------
-// startup and shutdown
+// remote commands
 //---------------------------------------------------------------------
-int file_exists(const char *file_name)
+// --add and --goto are sent as app actions over the GApplication d-bus
+// connection to the primary instance, which changes its in-memory store
+// and saves on shutdown as usual. --import, --archive and --unarchive
+// call a method of the org.gtk.talkcalendar.Command object instead, so
+// their summary comes back in the reply and is printed by the process
+// that was launched.
+// Without a primary instance the command is applied by this process
+// (which becomes primary during register).
+
+//HH:MM to hh.mm
+static gboolean time_from_string(const char *str, float *time)
 {
-    FILE *file;
-    file = fopen(file_name, "r");
-    if (file){       
-        fclose(file);
-        return 1; //file exists return 1
-    }
-    return 0; //file does not exist
+	int hour, min;
+	if(str==NULL || sscanf(str, "%d:%d", &hour, &min)!=2) return FALSE;
+	if(hour<0 || hour>23 || min<0 || min>59) return FALSE;
+	*time=hour + min / 100.0;
+	return TRUE;
 }
 
-static void startup (GtkApplication *app)
+static void refresh_window(GApplication *app)
 {
-	
-	//g_print("Allocating memory of size %d bytes\n",max_records*sizeof(Event));	
-	db_store=malloc(max_records*sizeof(Event));
-	
-	if (db_store==NULL){
-	g_print("memory allocation failed -not enough RAM\n");
-	exit(1);
+	GtkWindow *window=gtk_application_get_active_window(GTK_APPLICATION(app));
+	if(window==NULL) return;
+	update_calendar(window);
+	update_store(m_year,m_month,m_day);
+}
+
+//parameter (title, date, time, calendar) already checked by the sender, no time is all day
+static void callbk_remote_add_event(GSimpleAction* action, GVariant *parameter, gpointer user_data)
+{
+	const char *title, *date_str, *time_str, *calendar_name;
+	g_variant_get(parameter, "(&s&s&s&s)", &title, &date_str, &time_str, &calendar_name);
+	int calendar=MAX(calendar_from_name(calendar_name), CALENDAR_PERSONAL);
+	
+	guint32 jd=julian_from_date_string(date_str);
+	float start_time=0;
+	if(jd==0 || (strlen(time_str) > 0 && !time_from_string(time_str, &start_time))) {
+		g_print("add-event: invalid date or time\n");
+		return;
 	}
 	
-	
-	if(file_exists("events.csv"))
-	{
-		//g_print("events.csv exists-load it\n");
-		load_csv_file();
+	Event event;
+	memset(&event, 0, sizeof(Event));
+	csv_copy_text(event.title, sizeof(event.title), title);
+	dmy_from_julian(jd, &event.day, &event.month, &event.year);
+	if(strlen(time_str)==0) event.is_allday=1;
+	else {
+		event.start_time=start_time;
+		event.end_time=(start_time < 23) ? start_time + 1 : 23.59; //an hour by default
+	}
+	db_add_event(calendar, &event);
+	refresh_window(G_APPLICATION(user_data));
+}
+
+static void callbk_remote_goto(GSimpleAction* action, GVariant *parameter, gpointer user_data)
+{
+	guint32 jd=julian_from_date_string(g_variant_get_string(parameter, NULL));
+	if(jd==0) return;
+	dmy_from_julian(jd, &m_day, &m_month, &m_year);
+	m_start_jd=jd; //used if the window has not been created yet
+	refresh_window(G_APPLICATION(user_data));
+	GtkWindow *window=gtk_application_get_active_window(GTK_APPLICATION(user_data));
+	if(window) gtk_window_present(window);
+	else g_application_activate(G_APPLICATION(user_data)); //running in the background
+}
+
+//import an absolute file name with a duplicates mode ("" = preference)
+//into a calendar ("" = Personal), returns the summary line to print
+static gchar* remote_import(GApplication *app, const char *file_name, const char *mode, const char *calendar_name)
+{
+	int duplicates=duplicates_from_string(mode);
+	if(duplicates<0) duplicates=m_import_duplicates;
+	int calendar=MAX(calendar_from_name(calendar_name), CALENDAR_PERSONAL);
+	ImportResult result;
+	if(!import_file(file_name, import_format_from_name(file_name), calendar, duplicates, &result)) {
+		return g_strdup_printf("import: unable to open %s\n", file_name);
+	}
+	gchar *summary=import_summary(&result);
+	gchar *line=g_strdup_printf("%s\n", summary);
+	g_free(summary);
+	refresh_window(app);
+	return line;
+}
+
+//commands whose report is returned to the second launch that sent them
+static const gchar m_command_introspection[] =
+	"<node>"
+	"  <interface name='org.gtk.talkcalendar.Command'>"
+	"    <method name='Archive'>"
+	"      <arg type='i' name='year' direction='in'/>"
+	"      <arg type='b' name='archive' direction='in'/>"
+	"      <arg type='s' name='report' direction='out'/>"
+	"    </method>"
+	"    <method name='Import'>"
+	"      <arg type='ay' name='file_name' direction='in'/>"
+	"      <arg type='s' name='duplicates' direction='in'/>"
+	"      <arg type='s' name='calendar' direction='in'/>"
+	"      <arg type='s' name='summary' direction='out'/>"
+	"    </method>"
+	"  </interface>"
+	"</node>";
+
+static guint m_command_registration=0;
+static gboolean m_archive_replied=FALSE; //this process converted a year itself
+
+static void archive_print_reply(const gchar *report, gpointer user_data)
+{
+	g_print("%s", report);
+	m_archive_replied=TRUE;
+}
+
+static void archive_invocation_reply(const gchar *report, gpointer user_data)
+{
+	g_dbus_method_invocation_return_value(user_data, g_variant_new("(s)", report));
+}
+
+static void callbk_command_method(GDBusConnection *connection, const gchar *sender,
+	const gchar *object_path, const gchar *interface_name, const gchar *method_name,
+	GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data)
+{
+	if(g_strcmp0(method_name, "Archive")==0) {
+		int year;
+		gboolean archive;
+		g_variant_get(parameters, "(ib)", &year, &archive);
+		archive_convert_year(year, archive, archive_invocation_reply, invocation); //replies once written
+	}
+	else if(g_strcmp0(method_name, "Import")==0) {
+		const char *file_name, *mode, *calendar_name;
+		g_variant_get(parameters, "(^&ay&s&s)", &file_name, &mode, &calendar_name);
+		gchar *summary=remote_import(user_data, file_name, mode, calendar_name);
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", summary));
+		g_free(summary);
+	}
+}
+
+static const GDBusInterfaceVTable m_command_vtable = { callbk_command_method, NULL, NULL };
+
+static gchar* command_object_path(GApplication *app)
+{
+	return g_strconcat(g_application_get_dbus_object_path(app), "/Command", NULL);
+}
+
+static void command_service_register(GApplication *app)
+{
+	GDBusConnection *connection=g_application_get_dbus_connection(app);
+	if(connection==NULL) return; //not on a bus
+	
+	GError *error=NULL;
+	GDBusNodeInfo *info=g_dbus_node_info_new_for_xml(m_command_introspection, NULL);
+	gchar *path=command_object_path(app);
+	m_command_registration=g_dbus_connection_register_object(connection, path,
+	info->interfaces[0], &m_command_vtable, app, NULL, &error);
+	if(m_command_registration==0) {
+		g_print("unable to export command service: %s\n", error->message);
+		g_error_free(error);
+	}
+	g_free(path);
+	g_dbus_node_info_unref(info);
+}
+
+static void command_service_unregister(GApplication *app)
+{
+	GDBusConnection *connection=g_application_get_dbus_connection(app);
+	if(connection && m_command_registration) g_dbus_connection_unregister_object(connection, m_command_registration);
+	m_command_registration=0;
+}
+
+//second launch: call method on the primary instance and print its report
+static int command_call(GApplication *app, const gchar *method, GVariant *parameters)
+{
+	GError *error=NULL;
+	gchar *path=command_object_path(app);
+	GVariant *result=g_dbus_connection_call_sync(g_application_get_dbus_connection(app),
+		g_application_get_application_id(app), path, "org.gtk.talkcalendar.Command", method,
+		parameters, G_VARIANT_TYPE("(s)"), G_DBUS_CALL_FLAGS_NO_AUTO_START, G_MAXINT, NULL, &error);
+	g_free(path);
+	if(result==NULL) {
+		g_printerr("%s: %s\n", method, error->message);
+		g_error_free(error);
+		return 1;
+	}
+	const gchar *report;
+	g_variant_get(result, "(&s)", &report);
+	g_print("%s", report);
+	g_variant_unref(result);
+	return 0;
+}
+
+static int forward_remote_command(GApplication *app, GVariantDict *options)
+{
+	const char *title=NULL;
+	const char *date_str=NULL;
+	const char *time_str="";
+	const char *goto_str=NULL;
+	const char *import_file=NULL;
+	const char *duplicates="";
+	const char *calendar="";
+	int archive_year=0;
+	int unarchive_year=0;
+	float start_time;
+	g_variant_dict_lookup(options, "add", "&s", &title);
+	g_variant_dict_lookup(options, "date", "&s", &date_str);
+	g_variant_dict_lookup(options, "time", "&s", &time_str);
+	g_variant_dict_lookup(options, "goto", "&s", &goto_str);
+	g_variant_dict_lookup(options, "import", "^&ay", &import_file);
+	g_variant_dict_lookup(options, "duplicates", "&s", &duplicates);
+	g_variant_dict_lookup(options, "calendar", "&s", &calendar);
+	g_variant_dict_lookup(options, "archive", "i", &archive_year);
+	g_variant_dict_lookup(options, "unarchive", "i", &unarchive_year);
+	gboolean archive=g_variant_dict_contains(options, "archive") || g_variant_dict_contains(options, "unarchive");
+	
+	//check here so errors are reported by the sender
+	if(title && (julian_from_date_string(date_str)==0 || (strlen(time_str) > 0 && !time_from_string(time_str, &start_time)))) {
+		g_printerr("add: invalid date or time (use --date YYYY-MM-DD --time HH:MM)\n");
+		return 1;
+	}
+	if(import_file && strlen(duplicates) > 0 && duplicates_from_string(duplicates)<0) {
+		g_printerr("import: invalid duplicates mode %s (use skip, merge or keep)\n", duplicates);
+		return 1;
+	}
+	if(strlen(calendar) > 0 && calendar_from_name(calendar)<0) {
+		g_printerr("calendar: unknown calendar %s (use personal, work, family or shared)\n", calendar);
+		return 1;
+	}
+	if(g_variant_dict_contains(options, "archive") && (archive_year<1 || archive_year>=current_year() - 1)) {
+		g_printerr("archive: %d is not a completed year before last year\n", archive_year);
+		return 1;
+	}
+	if(g_variant_dict_contains(options, "unarchive") && unarchive_year<1) {
+		g_printerr("unarchive: invalid year %d\n", unarchive_year);
+		return 1;
+	}
+	if(!title && !import_file && !archive && julian_from_date_string(goto_str)==0) {
+		g_printerr("goto: invalid date %s (use YYYY-MM-DD or today)\n", goto_str);
+		return 1;
 	}
 	
+	GError *error=NULL;
+	if(!g_application_register(app, NULL, &error)) {
+		g_printerr("unable to register application: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
 	
+	GVariant *parameter;
+	const char *action_name;
+	if(title) {
+		parameter=g_variant_new("(ssss)", title, date_str ? date_str : "today", time_str, calendar);
+		action_name="add-event";
+	}
+	else if(import_file) {
+		//the primary instance may run in another directory
+		gchar *path=g_canonicalize_filename(import_file, NULL);
+		int status=0;
+		if(g_application_get_is_remote(app)) status=command_call(app, "Import", g_variant_new("(^ayss)", path, duplicates, calendar));
+		else {
+			gchar *summary=remote_import(app, path, duplicates, calendar);
+			g_print("%s", summary);
+			g_free(summary);
+			callbk_app_shutdown(app, NULL); //saves the store
+		}
+		g_free(path);
+		return status;
+	}
+	else if(archive) {
+		gboolean archiving=g_variant_dict_contains(options, "archive");
+		int year=archiving ? archive_year : unarchive_year;
+		if(g_application_get_is_remote(app)) return command_call(app, "Archive", g_variant_new("(ib)", year, archiving));
+		archive_convert_year(year, archiving, archive_print_reply, NULL);
+		while(!m_archive_replied) g_main_context_iteration(NULL, TRUE);
+		callbk_app_shutdown(app, NULL); //saves the store
+		return 0;
+	}
+	else {
+		parameter=g_variant_new_string(goto_str);
+		action_name="goto";
+	}
+	g_action_group_activate_action(G_ACTION_GROUP(app), action_name, parameter);
 	
-	 //---------------------------------------------------
-  
-		
+	if(g_application_get_is_remote(app)) {
+		//make sure the message is sent before exiting
+		g_dbus_connection_flush_sync(g_application_get_dbus_connection(app), NULL, NULL);
+		return 0;
+	}
+	if(title) {
+		//no primary instance: this process loaded the store in startup
+		callbk_app_shutdown(app, NULL); //saves the store
+		return 0;
+	}
+	return -1; //open the window at the date
 }
 
-void callbk_shutdown(GtkWindow *window, gint response_id,  gpointer  user_data){
-	//g_print("shutdown function called\n");	
-	save_csv_file();
-	free(db_store);
+//queries answered without starting gtk return an exit status, -1 carries on
+static int callbk_handle_local_options(GApplication *app, GVariantDict *options, gpointer user_data)
+{
+	if(g_variant_dict_contains(options, "add") || g_variant_dict_contains(options, "goto")
+	|| g_variant_dict_contains(options, "import") || g_variant_dict_contains(options, "archive")
+	|| g_variant_dict_contains(options, "unarchive")) {
+		return forward_remote_command(app, options);
+	}
+	
+	if(g_variant_dict_contains(options, "background")) {
+		GError *error=NULL;
+		if(!g_application_register(app, NULL, &error)) {
+			g_printerr("unable to register application: %s\n", error->message);
+			g_error_free(error);
+			return 1;
+		}
+		if(g_application_get_is_remote(app)) return 0; //already running
+		m_start_background=TRUE;
+		return -1;
+	}
+	
+	m_headless=TRUE;
+	if(g_variant_dict_contains(options, "free-slot")) return print_free_slots(options);
+	if(g_variant_dict_contains(options, "agenda") || g_variant_dict_contains(options, "month")
+	|| g_variant_dict_contains(options, "export") || g_variant_dict_contains(options, "speak-today")) {
+		return print_query(options);
+	}
+	m_headless=FALSE;
+	return -1;
 }
 
-
 //--------------------------------------------------------------------
 // public holidays
 //---------------------------------------------------------------------
-gboolean is_public_holiday(int day) {
+static gboolean is_public_holiday_in(int day, int month, int year) {
 	
 // UK public holidays 
 // New Year's Day: 1 January (DONE)
@@ -2251,26 +9340,26 @@ gboolean is_public_holiday(int day) {
 // Boxing day: 26 December (DONE)
 	
 	//markup public holidays
-	if (m_month==1 && day ==1) {  
+	if (month==1 && day ==1) {  
 	//new year	
 	 return TRUE;
 	}
 	
-	if (m_month==12 && day==25) {
+	if (month==12 && day==25) {
 	//christmas day
 	return TRUE;	  
 	} 
 	
-	if (m_month==12 && day==26) {
+	if (month==12 && day==26) {
 	//boxing day
 	return TRUE;	  
 	}
 	
 	
-	if (m_month == 5) {
+	if (month == 5) {
      //May complicated
      GDate *first_monday_may;
-     first_monday_may = g_date_new_dmy(1, m_month, m_year);
+     first_monday_may = g_date_new_dmy(1, month, year);
              
      while (g_date_get_weekday(first_monday_may) != G_DATE_MONDAY)
        g_date_add_days(first_monday_may,1);
@@ -2280,7 +9369,7 @@ gboolean is_public_holiday(int day) {
      if( day==may_day) return TRUE;
      //else return FALSE;
      
-     int days_in_may =g_date_get_days_in_month (m_month, m_year);
+     int days_in_may =g_date_get_days_in_month (month, year);
      int plus_days = 0;
      
      if (may_day + 28 <= days_in_may) {
@@ -2289,21 +9378,21 @@ gboolean is_public_holiday(int day) {
        plus_days = 21;
      }
      
-     GDate *spring_bank =g_date_new_dmy (may_day, m_month, m_year);
+     GDate *spring_bank =g_date_new_dmy (may_day, month, year);
      
      g_date_add_days(spring_bank,plus_days);
       
      int spring_bank_day = g_date_get_day(spring_bank);   
       
-     if (g_date_valid_dmy (spring_bank_day,m_month,m_year) && day ==spring_bank_day) 
+     if (g_date_valid_dmy (spring_bank_day,month,year) && day ==spring_bank_day) 
      return TRUE;       
-	} //m_month==5 (may)
+	} //month==5 (may)
 	
-	GDate *easter_date =calculate_easter(m_year); 
+	GDate *easter_date =calculate_easter(year); 
 	int easter_day = g_date_get_day(easter_date);
 	int easter_month =g_date_get_month(easter_date);
 	
-	if(m_month==easter_month && day == easter_day)
+	if(month==easter_month && day == easter_day)
 	{
 	//easter day
 	return TRUE;
@@ -2313,7 +9402,7 @@ gboolean is_public_holiday(int day) {
 	int easter_friday = g_date_get_day(easter_date); 
 	int easter_friday_month =g_date_get_month(easter_date); 
 	
-	if(m_month==easter_friday_month && day ==easter_friday)
+	if(month==easter_friday_month && day ==easter_friday)
 	{
 	//easter friday
 	return TRUE;
@@ -2323,16 +9412,16 @@ gboolean is_public_holiday(int day) {
 	int easter_monday = g_date_get_day(easter_date); //easter monday
 	int easter_monday_month =g_date_get_month(easter_date); 
     
-	if(m_month==easter_monday_month && day ==easter_monday)
+	if(month==easter_monday_month && day ==easter_monday)
 	{
 	//easter monday
 	return TRUE;
 	}
 	
-	if (m_month == 8) {
+	if (month == 8) {
       //August complicated
     GDate *first_monday_august;
-     first_monday_august = g_date_new_dmy(1, m_month, m_year);
+     first_monday_august = g_date_new_dmy(1, month, year);
              
      while (g_date_get_weekday(first_monday_august) != G_DATE_MONDAY)
        g_date_add_days(first_monday_august,1);
@@ -2340,7 +9429,7 @@ gboolean is_public_holiday(int day) {
      int august_day = g_date_get_day(first_monday_august);  
        
           
-     int days_in_august =g_date_get_days_in_month (m_month, m_year);
+     int days_in_august =g_date_get_days_in_month (month, year);
      int plus_days = 0;
      
      if (august_day + 28 <= days_in_august) {
@@ -2349,21 +9438,25 @@ gboolean is_public_holiday(int day) {
        plus_days = 21;
      }
      
-     GDate *august_bank =g_date_new_dmy (august_day, m_month, m_year);
+     GDate *august_bank =g_date_new_dmy (august_day, month, year);
      
      g_date_add_days(august_bank,plus_days);
       
      int august_bank_day = g_date_get_day(august_bank);   
       
-     if (g_date_valid_dmy (august_bank_day,m_month,m_year) && day ==august_bank_day) 
+     if (g_date_valid_dmy (august_bank_day,month,year) && day ==august_bank_day) 
      return TRUE;         
       
       
-    } //m_month==8
+    } //month==8
 		
 	return FALSE;
 }
 
+gboolean is_public_holiday(int day) {
+	return is_public_holiday_in(day, m_month, m_year);
+}
+
 char* get_holiday(int day) {
 	
 // UK public holidays 
@@ -2491,11 +9584,98 @@ char* get_holiday(int day) {
 //---------------------------------------------------------------------
 // update ui
 //---------------------------------------------------------------------
+
+// The day buttons are created a week row per step as urgent frame work
+// after the rest of the window, so navigating months does not block
+// input while 42 styled buttons are built.
+
+typedef struct {
+	GtkWindow *window;
+	GtkWidget *grid; //filled while it is the window's child
+	int day; //of the first column of the next row, may be before the 1st
+	int row;
+	int month; //shown when the grid was built, the globals move on
+	int year;
+	int today; //day of the month, 0 in another month
+	guint32 marks; //bit per day with events
+	guint32 holidays; //bit per day, 0 when holidays are not shown
+} MonthGrid;
+
+static FrameWork *m_month_grid_work=NULL;
+
+static void month_grid_free(gpointer data)
+{
+	MonthGrid *month_grid=data;
+	g_object_unref(month_grid->grid);
+	g_object_unref(month_grid->window);
+	g_free(month_grid);
+}
+
+//frame work: the buttons of the next row
+static gboolean month_grid_step(gpointer data)
+{
+	MonthGrid *month_grid=data;
+	GtkWindow *window=month_grid->window;
+	GtkWidget *grid=month_grid->grid;
+	if(gtk_window_get_child(window)!=grid) return FALSE; //rebuilt or closed
+	
+	GtkWidget *button;
+	GtkCssProvider *cssProvider;
+	gchar* btn_str;
+	int days_in_month =g_date_get_days_in_month (month_grid->month, month_grid->year); 
+	int row=month_grid->row;
+	int day=month_grid->day;
+	
+	for(int col=0; col<7; col++, day++) {
+		if (day < 1 || day > days_in_month) continue;
+		
+		btn_str =g_strdup_printf ("%d", day); //%i
+		button = gtk_button_new_with_label (btn_str); 
+		g_free(btn_str);
+		gtk_widget_set_hexpand(button, TRUE); 
+		gtk_widget_set_vexpand(button,TRUE); 
+		
+		GDate *current_date = g_date_new();
+		g_date_set_dmy (current_date, day, month_grid->month, month_grid->year);
+		
+		//markup event days
+		if(month_grid->marks & (1u << (day - 1))) {			
+			set_button_red_with_borders(GTK_BUTTON(button));			
+		}
+		
+		if(month_grid->holidays & (1u << (day - 1))) {
+			set_button_blue(GTK_BUTTON(button));
+		}
+		
+		if(day==month_grid->today) {
+			set_button_green(GTK_BUTTON(button));
+		}
+		
+		GtkStyleContext *context_button;	
+		gtk_widget_set_name (GTK_WIDGET(button), "cssView"); 
+		
+		cssProvider = gtk_css_provider_new();
+		gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 	
+		context_button = gtk_widget_get_style_context(GTK_WIDGET(button));		
+		gtk_style_context_add_provider(context_button,    
+		GTK_STYLE_PROVIDER(cssProvider), 
+		GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
+		
+		g_object_set_data(G_OBJECT(button), "button-window-key",window);  
+		g_signal_connect (button, "clicked", G_CALLBACK (callbk_day_selected), current_date);
+		
+		gtk_grid_attach(GTK_GRID(grid),button,col,row,1,1);	
+	}
+	
+	month_grid->day=day;
+	month_grid->row++;
+	return month_grid->row<8 && day<=days_in_month;
+}
+
 static void update_calendar(GtkWindow *window) {
 	
  
   GtkWidget* label_date;
-  GtkWidget *button;
   GtkWidget *grid;
   GtkWidget *button_next_month;
   GtkWidget *button_prev_month; 
@@ -2565,6 +9745,10 @@ static void update_calendar(GtkWindow *window) {
     }
       
    
+   if (check_day_events_for_overlap(m_year, m_month, m_day)) {
+	   day_month_year_str =g_strconcat(day_month_year_str," (Double Booked)", NULL);
+   }
+   
    if (m_holidays) {
 	   
 	   //append holiday text
@@ -2589,11 +9773,7 @@ static void update_calendar(GtkWindow *window) {
   int day=0;  
   int remainder = (first_day_of_month(m_month,m_year) - week_start + 7) % 7;   
   day = 1 - remainder;   
-  int n_cols=7;
   int n_rows=8;  
-  gchar* i_str;
-  gchar* j_str;
-  gchar* btn_str="";
   
   button_next_month=gtk_button_new_with_label (">>");
   g_signal_connect (button_next_month, "clicked", G_CALLBACK (callbk_next_month),window);
@@ -2694,68 +9874,22 @@ static void update_calendar(GtkWindow *window) {
   GDate *today_date; 
   today_date = g_date_new();
   g_date_set_time_t (today_date, time (NULL));
-  int today_day= g_date_get_day(today_date);
-  int today_month= g_date_get_month(today_date);
-  int today_year= g_date_get_year(today_date);
-  
-   
-  int days_in_month =g_date_get_days_in_month (m_month, m_year); 
- 
-  for (int row=2; row<n_rows; row++)
-    {
-        
-        for(int col=0; col<n_cols; col++)
-        {
-                
-        if (day > 0 && day <= days_in_month) {
-        
-        btn_str =g_strdup_printf ("%d", day); //%i
-        button = gtk_button_new_with_label (btn_str); 
-		gtk_widget_set_hexpand(button, TRUE); 
-		gtk_widget_set_vexpand(button,TRUE); 
-		
-		 GDate *current_date = g_date_new();
-		 g_date_set_dmy (current_date, day, m_month, m_year);
-		
-		//markup event days
-		if(marked_date[day-1]) {			
-			set_button_red_with_borders(GTK_BUTTON(button));			
-		}
-		
-		if(is_public_holiday(day) && m_holidays) {
-		set_button_blue(GTK_BUTTON(button));
-	    }
-		
-		
-		
-		if(day==today_day && m_month==today_month && m_year==today_year) {
-			set_button_green(GTK_BUTTON(button));
-		}
-		
-		GtkStyleContext *context_button;	
-		gtk_widget_set_name (GTK_WIDGET(button), "cssView"); 
-			
-		cssProvider = gtk_css_provider_new();
-		gtk_css_provider_load_from_data(cssProvider, get_css_string(),-1); 	
-		context_button = gtk_widget_get_style_context(GTK_WIDGET(button));		
-		gtk_style_context_add_provider(context_button,    
-		GTK_STYLE_PROVIDER(cssProvider), 
-		GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
-		
-		
-		
-		g_object_set_data(G_OBJECT(button), "button-window-key",window);  
-       
-        g_signal_connect (button, "clicked", G_CALLBACK (callbk_day_selected), current_date);
-		
-        
-        gtk_grid_attach(GTK_GRID(grid),button,col,row,1,1);	
-        btn_str="";         
-         }                        
-        day=day+1;        
-        }
-        
-    }
+  MonthGrid *month_grid=g_new0(MonthGrid, 1);
+  month_grid->window=g_object_ref(window);
+  month_grid->grid=g_object_ref(grid);
+  month_grid->day=day;
+  month_grid->row=2;
+  month_grid->month=m_month;
+  month_grid->year=m_year;
+  for(int i=0; i<31; i++) {
+	  if(marked_date[i]) month_grid->marks|=1u << i;
+  }
+  if(g_date_get_month(today_date)==m_month && g_date_get_year(today_date)==m_year) {
+	  month_grid->today=g_date_get_day(today_date);
+  }
+  g_date_free(today_date);
+  if(m_holidays) month_grid->holidays=prefetch_month(m_month, m_year)->holidays;
+  frame_work_add(FRAME_URGENT, month_grid_step, month_grid, month_grid_free, &m_month_grid_work);
 
   //set scrolled window
   sw = gtk_scrolled_window_new ();
@@ -2832,9 +9966,94 @@ static void update_calendar(GtkWindow *window) {
 	GTK_STYLE_PROVIDER(cssProvider), 
 	GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);		
     //------------------------------------------------------------------
+    
+    prefetch_schedule(); //where the user is likely to go next
+}
+
+//---------------------------------------------------------------------
+// navigation
+//---------------------------------------------------------------------
+
+// Navigation (the month buttons, selecting a day, Home) only changes
+// m_day, m_month and m_year and queues a rebuild with
+// calendar_queue_update. The window is rebuilt once at the start of the
+// next frame from the latest state, so holding Home or clicking >>
+// quickly costs one rebuild per frame instead of one per step, and each
+// rebuild cancels the unfinished frame work of the one it supersedes.
+// The time from the first input folded into a rebuild to the end of the
+// first paint after its month grid is complete is kept as the input to
+// paint latency, shown in the Information dialog.
+
+static guint m_nav_tick=0; //rebuild queued for the next frame
+static gboolean m_nav_day_changed=FALSE; //the event list is rebuilt too
+static gint64 m_nav_input_time=0; //first input of the queued rebuild
+static gint64 m_nav_paint_input=0; //oldest input not painted yet, 0 if none
+static gulong m_nav_paint_handler=0;
+static GdkFrameClock *m_nav_clock=NULL;
+
+static void callbk_nav_after_paint(GdkFrameClock *clock, gpointer user_data)
+{
+	if(m_month_grid_work) return; //day buttons still being added
+	gint64 latency=g_get_monotonic_time() - m_nav_paint_input;
+	m_nav_latency_last=latency;
+	m_nav_latency_max=MAX(m_nav_latency_max, latency);
+	m_nav_latency_total+=latency;
+	m_nav_painted++;
+	m_nav_paint_input=0;
+	g_signal_handler_disconnect(clock, m_nav_paint_handler);
+	m_nav_paint_handler=0;
+	g_clear_object(&m_nav_clock);
+}
+
+static void calendar_rebuild(GtkWindow *window)
+{
+	update_calendar(window);
+	if(m_nav_day_changed) update_store(m_year,m_month,m_day);
+	m_nav_day_changed=FALSE;
+	m_nav_rebuilds++;
+	
+	GdkFrameClock *clock=gtk_widget_get_frame_clock(GTK_WIDGET(window));
+	if(m_nav_clock && m_nav_clock!=clock) { //the window was closed and opened again
+		g_signal_handler_disconnect(m_nav_clock, m_nav_paint_handler);
+		m_nav_paint_handler=0;
+		g_clear_object(&m_nav_clock);
+		m_nav_paint_input=0;
+	}
+	if(clock==NULL || m_nav_paint_input) return; //the earlier input is measured
+	m_nav_paint_input=m_nav_input_time;
+	m_nav_clock=g_object_ref(clock);
+	m_nav_paint_handler=g_signal_connect(clock, "after-paint", G_CALLBACK(callbk_nav_after_paint), NULL);
+}
+
+static gboolean callbk_nav_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+	calendar_rebuild(GTK_WINDOW(widget));
+	return G_SOURCE_REMOVE;
+}
 
+//also when the window is destroyed first
+static void callbk_nav_tick_removed(gpointer data)
+{
+	m_nav_tick=0;
+}
+
+//rebuild the window for the current date at the next frame
+static void calendar_queue_update(GtkWindow *window, gboolean day_changed)
+{
+	m_nav_steps++;
+	if(day_changed) m_nav_day_changed=TRUE;
+	frame_work_cancel(&m_prefetch_work); //around the old date
+	if(m_nav_tick) return; //folded into the queued rebuild
+	m_nav_input_time=g_get_monotonic_time();
+	if(!gtk_widget_get_mapped(GTK_WIDGET(window))) {
+		calendar_rebuild(window); //no frames to wait for
+		return;
+	}
+	m_nav_tick=gtk_widget_add_tick_callback(GTK_WIDGET(window), callbk_nav_tick, NULL, callbk_nav_tick_removed);
 }
 
+//---------------------------------------------------------------------
+
 static void update_header (GtkWindow *window)
 {
 	GtkWidget *header;
@@ -2873,13 +10092,30 @@ static void update_header (GtkWindow *window)
 	menu = g_menu_new ();  
 	
 	section = g_menu_new ();
+	g_menu_append (section, "Search", "app.search");	
 	g_menu_append (section, "Preferences", "app.preferences");	
 	g_menu_append_section (menu, NULL, G_MENU_MODEL (section));
+	
+	section = g_menu_new ();
+	for(int c=0; c<NUM_CALENDARS; c++) {
+		gchar *action_name=calendar_action_name(c);
+		gchar *detailed_action=g_strconcat("app.", action_name, NULL);
+		g_menu_append (section, m_calendars[c].name, detailed_action); //check item
+		g_free(detailed_action);
+		g_free(action_name);
+	}
+	g_menu_append_submenu (menu, "_Calendars", G_MENU_MODEL (section));
 	g_object_unref (section);
 	
 	section = g_menu_new ();
 	g_menu_append (section, "Font", "app.font"); 	
 	g_menu_append_section (menu, NULL, G_MENU_MODEL (section));
+	
+	section = g_menu_new ();
+	g_menu_append (section, "Import iCalendar", "app.importics");	
+	g_menu_append (section, "Import CSV", "app.importcsv");	
+	g_menu_append (section, "Export iCalendar", "app.exportics");	
+	g_menu_append_section (menu, NULL, G_MENU_MODEL (section));
 	g_object_unref (section);
 	
 	section = g_menu_new ();
@@ -2888,6 +10124,8 @@ static void update_header (GtkWindow *window)
 	g_object_unref (section);
 	
 	section = g_menu_new ();
+	g_menu_append (section, "Find Free Slot", "app.freeslot"); //first free gaps
+	g_menu_append (section, "Conflict Report", "app.conflicts"); //double bookings
 	g_menu_append (section, "Information", "app.info"); //show app info
 	g_menu_append (section, "Shortcuts", "app.shortcuts"); //show shortcuts
 	g_menu_append (section, "Speak Version", "app.version");  //speak version	
@@ -3012,17 +10250,34 @@ static void activate (GtkApplication *app, gpointer  user_data)
   const gchar *home_accels[2] = { "Home", NULL };
   const gchar *about_accels[2] =  { "<Ctrl>A", NULL };
   const gchar *quit_accels[2] =   { "<Ctrl>Q", NULL };
+  const gchar *search_accels[2] = { "<Ctrl>F", NULL };
   
+  static gboolean first_window=TRUE;
+  
+  //one window, activating again presents it
+  GtkWindow *active_window=gtk_application_get_active_window(app);
+  if(active_window) {
+	gtk_window_present(active_window);
+	return;
+  }
+  if(m_start_background) {
+	m_start_background=FALSE;
+	background_enter(G_APPLICATION(app));
+	return;
+  }
   
   // create a new window, and set its title 
   window = gtk_application_window_new (app);
   gtk_window_set_title (GTK_WINDOW (window), "Talk Calendar");
   gtk_window_set_default_size(GTK_WINDOW (window),760,400);
-  g_signal_connect (window, "destroy", G_CALLBACK (callbk_shutdown), NULL);
+  g_signal_connect (window, "close-request", G_CALLBACK (callbk_window_close_request), app);
+  g_signal_connect (window, "destroy", G_CALLBACK (callbk_window_destroy), app);
+  background_leave(G_APPLICATION(app));
     
   GDate *current_date; 
   current_date = g_date_new();
   g_date_set_time_t (current_date, time (NULL)); 
+  if(m_start_jd) g_date_set_julian(current_date, m_start_jd);
   
   m_day =g_date_get_day(current_date);
   m_month =g_date_get_month(current_date);  
@@ -3079,6 +10334,36 @@ static void activate (GtkApplication *app, gpointer  user_data)
 	g_signal_connect(info_action, "activate",  G_CALLBACK(callbk_info), window);
 	
 	
+	GSimpleAction *conflicts_action;	
+	conflicts_action=g_simple_action_new("conflicts",NULL); //app.conflicts
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(conflicts_action)); //make visible	
+	g_signal_connect(conflicts_action, "activate",  G_CALLBACK(callbk_conflicts), window);
+	
+	GSimpleAction *search_action;	
+	search_action=g_simple_action_new("search",NULL); //app.search
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(search_action)); //make visible	
+	g_signal_connect(search_action, "activate",  G_CALLBACK(callbk_search), window);
+	
+	GSimpleAction *free_slot_action;	
+	free_slot_action=g_simple_action_new("freeslot",NULL); //app.freeslot
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(free_slot_action)); //make visible	
+	g_signal_connect(free_slot_action, "activate",  G_CALLBACK(callbk_free_slot), window);
+	
+	GSimpleAction *import_ics_action;	
+	import_ics_action=g_simple_action_new("importics",NULL); //app.importics
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(import_ics_action)); //make visible	
+	g_signal_connect(import_ics_action, "activate",  G_CALLBACK(callbk_import_ics), window);
+	
+	GSimpleAction *import_csv_action;	
+	import_csv_action=g_simple_action_new("importcsv",NULL); //app.importcsv
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(import_csv_action)); //make visible	
+	g_signal_connect(import_csv_action, "activate",  G_CALLBACK(callbk_import_csv), window);
+	
+	GSimpleAction *export_ics_action;	
+	export_ics_action=g_simple_action_new("exportics",NULL); //app.exportics
+	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(export_ics_action)); //make visible	
+	g_signal_connect(export_ics_action, "activate",  G_CALLBACK(callbk_export_ics), window);
+	
 	GSimpleAction *shortcuts_action;	
 	shortcuts_action=g_simple_action_new("shortcuts",NULL); //app.shortcuts
 	g_action_map_add_action(G_ACTION_MAP(app), G_ACTION(shortcuts_action)); //make visible	
@@ -3109,6 +10394,9 @@ static void activate (GtkApplication *app, gpointer  user_data)
 	gtk_application_set_accels_for_action(GTK_APPLICATION(app),
 	"app.quit", quit_accels);
 	
+	gtk_application_set_accels_for_action(GTK_APPLICATION(app),
+	"app.search", search_accels);
+	
 	
     update_header(GTK_WINDOW(window));
   
@@ -3132,7 +10420,8 @@ static void activate (GtkApplication *app, gpointer  user_data)
   //gtk_widget_show (window);
   gtk_window_present (GTK_WINDOW (window));     
   update_store(m_year,m_month,m_day);    
-  if(m_talk && m_talk_at_startup) speak_events(); 
+  if(m_talk && m_talk_at_startup && first_window) speak_events(); 
+  first_window=FALSE;
 }
 
 int main (int  argc, char **argv)
@@ -3143,7 +10432,31 @@ int main (int  argc, char **argv)
   int status;
 
   app = gtk_application_new ("org.gtk.talkcalendar", G_APPLICATION_FLAGS_NONE);
+  
+  const GOptionEntry options[] = {
+    { "agenda", 0, 0, G_OPTION_ARG_STRING, NULL, "Print the events on DATE and exit", "YYYY-MM-DD|today" },
+    { "month", 0, 0, G_OPTION_ARG_NONE, NULL, "Print the events this month (or the month of --date) and exit", NULL },
+    { "export", 0, 0, G_OPTION_ARG_STRING, NULL, "Print all events in FORMAT (json or ics) and exit", "FORMAT" },
+    { "import", 0, 0, G_OPTION_ARG_FILENAME, NULL, "Import an iCalendar (.ics) or csv file in the running calendar", "FILE" },
+    { "duplicates", 0, 0, G_OPTION_ARG_STRING, NULL, "Skip, merge or keep imported duplicates (default from preferences)", "skip|merge|keep" },
+    { "calendar", 0, 0, G_OPTION_ARG_STRING, NULL, "Calendar an added or imported event goes to (default personal)", "NAME" },
+    { "archive", 0, 0, G_OPTION_ARG_INT, NULL, "Compress the one-off events of YEAR (before last year) by month", "YEAR" },
+    { "unarchive", 0, 0, G_OPTION_ARG_INT, NULL, "Restore the archived events of YEAR to a plain year file", "YEAR" },
+    { "speak-today", 0, 0, G_OPTION_ARG_NONE, NULL, "Speak today's events and exit", NULL },
+    { "add", 0, 0, G_OPTION_ARG_STRING, NULL, "Add an event (with --date and --time) in the running calendar", "TITLE" },
+    { "time", 0, 0, G_OPTION_ARG_STRING, NULL, "Start time of an added event (all day if omitted)", "HH:MM" },
+    { "goto", 0, 0, G_OPTION_ARG_STRING, NULL, "Show DATE in the running calendar", "YYYY-MM-DD|today" },
+    { "free-slot", 0, 0, G_OPTION_ARG_INT, NULL, "Print free slots of MINUTES length", "MINUTES" },
+    { "date", 0, 0, G_OPTION_ARG_STRING, NULL, "Start date", "YYYY-MM-DD" },
+    { "days", 0, 0, G_OPTION_ARG_INT, NULL, "Number of days to search (default 7)", "DAYS" },
+    { "hours", 0, 0, G_OPTION_ARG_STRING, NULL, "Working hours (default 9-17)", "FROM-TO" },
+    { "background", 0, 0, G_OPTION_ARG_NONE, NULL, "Run for reminders without a window until activated", NULL },
+    { NULL }
+  };
+  g_application_add_main_option_entries(G_APPLICATION(app), options);
+  g_signal_connect (app, "handle-local-options", G_CALLBACK (callbk_handle_local_options), NULL);
   g_signal_connect_swapped(app, "startup", G_CALLBACK (startup),app);
+  g_signal_connect(app, "shutdown", G_CALLBACK (callbk_app_shutdown), NULL);
   g_signal_connect (app, "activate", G_CALLBACK (activate), NULL);
   status = g_application_run (G_APPLICATION (app), argc, argv);
   g_object_unref (app);